@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scanner.h"
+
+#define DEFAULT_SOURCE_SIZE (16 * 1024 * 1024)
+#define DEFAULT_ITERATIONS 10
+
+static const char *sample =
+    "// Generated configuration table.\n"
+    "fun make_entry(name, weight, threshold) {\n"
+    "    var entry = Entry();\n"
+    "    entry.name = name;\n"
+    "    entry.weight = weight * 1.25;\n"
+    "    if (entry.weight >= threshold and name != \"default\") {\n"
+    "        return entry;\n"
+    "    }\n"
+    "    return nil;\n"
+    "}\n"
+    "var first_entry_in_the_table = make_entry(\"first entry in the table\", 12345.678, 42);\n"
+    "        \n";
+
+static char *generate_source(size_t size)
+{
+    size_t sample_length = strlen(sample);
+    char *source = malloc(size + 1);
+    size_t length = 0;
+
+    while (length + sample_length <= size)
+    {
+        memcpy(source + length, sample, sample_length);
+        length += sample_length;
+    }
+
+    source[length] = '\0';
+    return source;
+}
+
+static char *read_source(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
+
+    char *source = malloc(file_size + 1);
+    size_t bytes_read = fread(source, sizeof(char), file_size, file);
+    source[bytes_read] = '\0';
+
+    fclose(file);
+    return source;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        fprintf(stderr, "Usage: scanner-bench [path] [iterations]\n");
+        exit(64);
+    }
+
+    char *source = argc >= 2 ? read_source(argv[1]) : generate_source(DEFAULT_SOURCE_SIZE);
+    int iterations = argc == 3 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    size_t length = strlen(source);
+
+    long tokens = 0;
+    clock_t start = clock();
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        init_scanner(source, length, 1);
+        for (Token token = scan_token(); token.type != TK_EOF; token = scan_token())
+        {
+            ++tokens;
+        }
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    double megabytes = (double)length * iterations / (1024 * 1024);
+
+    printf("%zu bytes x %d iterations, %ld tokens\n", length, iterations, tokens);
+    printf("%.1f MB/s\n", megabytes / seconds);
+
+    free(source);
+}
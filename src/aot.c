@@ -0,0 +1,356 @@
+#include "aot.h"
+#include <stdlib.h>
+#include "chunk.h"
+#include "memory.h"
+#include "serialize.h"
+
+typedef struct
+{
+    ObjFunction **items;
+    int count;
+    int capacity;
+} FunctionList;
+
+// Lists the script and every function nested in it, in the order they're numbered in.
+static void collect_functions(FunctionList *list, ObjFunction *function)
+{
+    if (list->capacity < list->count + 1)
+    {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->items = realloc(list->items, sizeof(ObjFunction *) * list->capacity);
+    }
+    list->items[list->count++] = function;
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i)
+    {
+        if (IS_FUNCTION(constants->values[i]))
+        {
+            collect_functions(list, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static bool may_fall_back(uint8_t instr)
+{
+    switch (instr)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_EQUAL:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_NEGATE_NUM:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_UNWIND:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static void emit_in_range(FILE *out, uint8_t kind, int slot)
+{
+    switch (kind & ~FOR_SUBTRACT)
+    {
+    case FOR_LESS:
+        fprintf(out, "AOT_COUNTER(%d) < AOT_LIMIT(%d)", slot, slot);
+        break;
+    case FOR_LESS_EQUAL:
+        fprintf(out, "!(AOT_COUNTER(%d) > AOT_LIMIT(%d))", slot, slot);
+        break;
+    case FOR_GREATER:
+        fprintf(out, "AOT_COUNTER(%d) > AOT_LIMIT(%d)", slot, slot);
+        break;
+    default:
+        fprintf(out, "!(AOT_COUNTER(%d) < AOT_LIMIT(%d))", slot, slot);
+        break;
+    }
+}
+
+static void emit_instr(FILE *out, Chunk *chunk, int offset)
+{
+    uint8_t *code = chunk->code + offset;
+    int target = jump_target(chunk, offset);
+
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);\n", code[1]);
+        break;
+    case OP_NIL:
+        fprintf(out, "AOT_NIL();\n");
+        break;
+    case OP_TRUE:
+        fprintf(out, "AOT_TRUE();\n");
+        break;
+    case OP_FALSE:
+        fprintf(out, "AOT_FALSE();\n");
+        break;
+    case OP_POP:
+        fprintf(out, "AOT_POP();\n");
+        break;
+    case OP_GET_LOCAL:
+        fprintf(out, "AOT_GET_LOCAL(%d);\n", code[1]);
+        break;
+    case OP_SET_LOCAL:
+        fprintf(out, "AOT_SET_LOCAL(%d);\n", code[1]);
+        break;
+    case OP_GET_GLOBAL:
+        fprintf(out, "AOT_GET_GLOBAL(%d, %d);\n", offset, code[1]);
+        break;
+    case OP_DEFINE_GLOBAL:
+        fprintf(out, "AOT_DEFINE_GLOBAL(%d);\n", code[1]);
+        break;
+    case OP_SET_GLOBAL:
+        fprintf(out, "AOT_SET_GLOBAL(%d, %d);\n", offset, code[1]);
+        break;
+    case OP_GET_UPVALUE:
+        fprintf(out, "AOT_GET_UPVALUE(%d);\n", code[1]);
+        break;
+    case OP_SET_UPVALUE:
+        fprintf(out, "AOT_SET_UPVALUE(%d);\n", code[1]);
+        break;
+    case OP_GET_CAPTURE:
+        fprintf(out, "AOT_GET_CAPTURE(%d);\n", code[1]);
+        break;
+    case OP_GET_HOISTED:
+        fprintf(out, "AOT_GET_HOISTED(%d, %d, %d);\n", offset, code[1], code[2]);
+        break;
+    case OP_GET_PROPERTY:
+        fprintf(out, "AOT_GET_PROPERTY(%d, %d);\n", offset, code[1]);
+        break;
+    case OP_SET_PROPERTY:
+        fprintf(out, "AOT_SET_PROPERTY(%d, %d);\n", offset, code[1]);
+        break;
+    case OP_EQUAL:
+        fprintf(out, "AOT_EQUAL();\n");
+        break;
+    case OP_GREATER:
+        fprintf(out, "AOT_BINARY(%d, BOOLEAN_VAL, >);\n", offset);
+        break;
+    case OP_LESS:
+        fprintf(out, "AOT_BINARY(%d, BOOLEAN_VAL, <);\n", offset);
+        break;
+    case OP_ADD:
+        fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, +);\n", offset);
+        break;
+    case OP_SUB:
+        fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, -);\n", offset);
+        break;
+    case OP_MUL:
+        fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, *);\n", offset);
+        break;
+    case OP_DIV:
+        fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, /);\n", offset);
+        break;
+    case OP_ADD_NUM:
+        fprintf(out, "AOT_NUMBER(NUMBER_VAL, +);\n");
+        break;
+    case OP_SUB_NUM:
+        fprintf(out, "AOT_NUMBER(NUMBER_VAL, -);\n");
+        break;
+    case OP_MUL_NUM:
+        fprintf(out, "AOT_NUMBER(NUMBER_VAL, *);\n");
+        break;
+    case OP_DIV_NUM:
+        fprintf(out, "AOT_NUMBER(NUMBER_VAL, /);\n");
+        break;
+    case OP_GREATER_NUM:
+        fprintf(out, "AOT_NUMBER(BOOLEAN_VAL, >);\n");
+        break;
+    case OP_LESS_NUM:
+        fprintf(out, "AOT_NUMBER(BOOLEAN_VAL, <);\n");
+        break;
+    case OP_NEGATE_NUM:
+        fprintf(out, "AOT_NEGATE_NUM();\n");
+        break;
+    case OP_NOT:
+        fprintf(out, "AOT_NOT();\n");
+        break;
+    case OP_NEGATE:
+        fprintf(out, "AOT_NEGATE(%d);\n", offset);
+        break;
+    case OP_PRINT:
+        fprintf(out, "AOT_PRINT();\n");
+        break;
+    case OP_JUMP:
+    case OP_LOOP:
+        fprintf(out, "AOT_JUMP(%d);\n", target);
+        break;
+    case OP_JUMP_IF_FALSE:
+        fprintf(out, "AOT_JUMP_IF_FALSE(%d);\n", target);
+        break;
+    case OP_FOR_PREP:
+        fprintf(out, "AOT_FOR_PREP(%d, %d, ", offset, code[1]);
+        emit_in_range(out, code[2], code[1]);
+        fprintf(out, ", %d);\n", target);
+        break;
+    case OP_FOR_ITER:
+        fprintf(out, "AOT_FOR_ITER(%d, %d, %sAS_NUMBER(constants[%d]), ", offset, code[1],
+                code[2] & FOR_SUBTRACT ? "-" : "", code[3]);
+        emit_in_range(out, code[2], code[1]);
+        fprintf(out, ", %d);\n", target);
+        break;
+    case OP_UNWIND:
+        fprintf(out, "AOT_UNWIND(%d);\n", code[1]);
+        break;
+    default:
+        fprintf(out, "AOT_FALLBACK(%d);\n", offset);
+        break;
+    }
+}
+
+// Translates the function to C. Any instruction that can be resumed at gets a label and a case
+// in the switch it starts with: the start, everything after an instruction that can fall back to
+// the interpreter, and jump targets.
+static void emit_function(FILE *out, ObjFunction *function, int index)
+{
+    Chunk *chunk = &function->chunk;
+    bool *labels = calloc((size_t)chunk->count + 1, sizeof(bool));
+
+    labels[0] = true;
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        int target = jump_target(chunk, offset);
+        if (target >= 0)
+        {
+            labels[target] = true;
+        }
+        if (may_fall_back(chunk->code[offset]))
+        {
+            labels[offset + instr_length(chunk, offset)] = true;
+        }
+    }
+
+    if (function->name != NULL)
+    {
+        fprintf(out, "\n// %.*s()\n", function->name->length, function->name->chars);
+    }
+    else
+    {
+        fprintf(out, "\n// script\n");
+    }
+    fprintf(out, "static void aot_%d(CallFrame *frame)\n{\n    AOT_ENTER();\n\n", index);
+
+    fprintf(out, "    switch (frame->ip - code)\n    {\n");
+    for (int offset = 0; offset < chunk->count; ++offset)
+    {
+        if (labels[offset])
+        {
+            fprintf(out, "    case %d:\n        goto L%d;\n", offset, offset);
+        }
+    }
+    fprintf(out, "    default:\n        return;\n    }\n\n");
+
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        if (labels[offset])
+        {
+            fprintf(out, "L%d:\n", offset);
+        }
+        fprintf(out, "    ");
+        emit_instr(out, chunk, offset);
+    }
+    fprintf(out, "}\n");
+
+    free(labels);
+}
+
+// Writes a C program that runs the script without compiling it: the compiled functions as an
+// image, and each function's bytecode translated to C. Link it against everything but main.o.
+bool emit_c(const char *path, ObjFunction *script)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+    {
+        return false;
+    }
+
+    FunctionList list = {NULL, 0, 0};
+    collect_functions(&list, script);
+
+    fprintf(out, "// Generated by clox --emit-c.\n\n#define _DEFAULT_SOURCE\n\n#include \"aot.h\"\n");
+    for (int i = 0; i < list.count; ++i)
+    {
+        emit_function(out, list.items[i], i);
+    }
+
+    fprintf(out, "\nstatic const AotFn functions[] = {\n");
+    for (int i = 0; i < list.count; ++i)
+    {
+        fprintf(out, "    aot_%d,\n", i);
+    }
+    fprintf(out, "};\n");
+
+    Writer image;
+    init_writer(&image);
+    write_function(&image, script);
+
+    fprintf(out, "\nstatic const uint8_t image[] = {");
+    for (size_t i = 0; i < image.count; ++i)
+    {
+        fprintf(out, i % 16 == 0 ? "\n    %d," : " %d,", image.bytes[i]);
+    }
+    fprintf(out, "\n};\n");
+
+    fprintf(out, "\nint main()\n{\n    return run_aot(image, sizeof(image), functions, %d);\n}\n",
+            list.count);
+
+    free_writer(&image);
+    free(list.items);
+    return fclose(out) == 0;
+}
+
+// Runs a program written by emit_c(), returning its exit code. The functions are numbered the
+// same way emit_c() numbered them.
+int run_aot(const uint8_t *image, size_t size, const AotFn *functions, int function_count)
+{
+    Vm program_vm;
+    init_vm(&program_vm);
+
+    Reader reader;
+    init_reader(&reader, image, size);
+    ObjFunction *script = read_function(&reader);
+
+    FunctionList list = {NULL, 0, 0};
+    if (script != NULL)
+    {
+        collect_functions(&list, script);
+    }
+
+    if (script == NULL || list.count != function_count)
+    {
+        fprintf(stderr, "Program image is damaged.\n");
+        free(list.items);
+        free_vm();
+        return 74;
+    }
+
+    for (int i = 0; i < list.count; ++i)
+    {
+        list.items[i]->aot = functions[i];
+    }
+    free(list.items);
+
+    InterpretResult result = interpret_function(script);
+    free_vm();
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,191 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+#include "common.h"
+#include "obj.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+bool emit_c(const char *path, ObjFunction *script);
+int run_aot(const uint8_t *image, size_t size, const AotFn *functions, int function_count);
+
+// What emit_c() writes each instruction as. Every translated function starts with AOT_ENTER()
+// and a switch to the label of the instruction at frame->ip. The stack top lives in sp and is
+// stored back before anything that can collect garbage, and before handing an instruction to the
+// interpreter with AOT_FALLBACK(). Instructions that call, return, touch classes or hit an error
+// always go through the interpreter, so they behave and report exactly as it does.
+
+#define AOT_ENTER()                                                   \
+    ObjClosure *closure = frame->closure;                             \
+    uint8_t *code = closure->function->chunk.code;                    \
+    Value *constants = closure->function->chunk.constants.values;     \
+    Value *slots = frame->slots;                                      \
+    Value *sp = vm->stack_top;                                        \
+    (void)constants;                                                  \
+    (void)slots
+
+#define AOT_FALLBACK(at)          \
+    do                            \
+    {                             \
+        vm->stack_top = sp;       \
+        frame->ip = code + (at);  \
+        return;                   \
+    } while (false)
+
+#define AOT_IS_FALSEY(value) (IS_NIL(value) || (IS_BOOLEAN(value) && !AS_BOOLEAN(value)))
+#define AOT_NAME(constant) AS_STRING(constants[constant])
+
+#define AOT_CONSTANT(constant) (*sp++ = constants[constant])
+#define AOT_NIL() (*sp++ = NIL_VAL)
+#define AOT_TRUE() (*sp++ = BOOLEAN_VAL(true))
+#define AOT_FALSE() (*sp++ = BOOLEAN_VAL(false))
+#define AOT_POP() (--sp)
+#define AOT_GET_LOCAL(slot) (*sp++ = slots[slot])
+#define AOT_SET_LOCAL(slot) (slots[slot] = sp[-1])
+#define AOT_GET_UPVALUE(slot) (*sp++ = *closure->upvalues[slot]->location)
+#define AOT_SET_UPVALUE(slot) (*closure->upvalues[slot]->location = sp[-1])
+#define AOT_GET_CAPTURE(slot) (*sp++ = closure->captures[slot])
+
+#define AOT_GET_GLOBAL(at, constant)                                   \
+    do                                                                 \
+    {                                                                  \
+        if (!table_get(&vm->globals, AOT_NAME(constant), sp))          \
+        {                                                              \
+            AOT_FALLBACK(at);                                          \
+        }                                                              \
+        ++sp;                                                          \
+    } while (false)
+
+// A global not found yet is left to the interpreter to look up or report.
+#define AOT_GET_HOISTED(at, constant, slot)                                            \
+    do                                                                                 \
+    {                                                                                  \
+        if (IS_NIL(slots[slot]) &&                                                     \
+            !table_get(&vm->globals, AOT_NAME(constant), &slots[slot]))                \
+        {                                                                              \
+            AOT_FALLBACK(at);                                                          \
+        }                                                                              \
+        *sp++ = slots[slot];                                                           \
+    } while (false)
+
+#define AOT_DEFINE_GLOBAL(constant)                                    \
+    do                                                                 \
+    {                                                                  \
+        vm->stack_top = sp;                                            \
+        table_put(&vm->globals, AOT_NAME(constant), sp[-1]);           \
+        --sp;                                                          \
+    } while (false)
+
+// An undefined global is put back the way it was for the interpreter to report.
+#define AOT_SET_GLOBAL(at, constant)                                   \
+    do                                                                 \
+    {                                                                  \
+        vm->stack_top = sp;                                            \
+        if (table_put(&vm->globals, AOT_NAME(constant), sp[-1]))       \
+        {                                                              \
+            table_remove(&vm->globals, AOT_NAME(constant));            \
+            AOT_FALLBACK(at);                                          \
+        }                                                              \
+    } while (false)
+
+// Only fields are read here. Methods are bound by the interpreter.
+#define AOT_GET_PROPERTY(at, constant)                                                     \
+    do                                                                                     \
+    {                                                                                      \
+        if (!IS_INSTANCE(sp[-1]) ||                                                        \
+            !table_get(&AS_INSTANCE(sp[-1])->fields, AOT_NAME(constant), &sp[-1]))        \
+        {                                                                                  \
+            AOT_FALLBACK(at);                                                              \
+        }                                                                                  \
+    } while (false)
+
+#define AOT_SET_PROPERTY(at, constant)                                                     \
+    do                                                                                     \
+    {                                                                                      \
+        if (!IS_INSTANCE(sp[-2]))                                                          \
+        {                                                                                  \
+            AOT_FALLBACK(at);                                                              \
+        }                                                                                  \
+        vm->stack_top = sp;                                                                \
+        table_put(&AS_INSTANCE(sp[-2])->fields, AOT_NAME(constant), sp[-1]);              \
+        sp[-2] = sp[-1];                                                                   \
+        --sp;                                                                              \
+    } while (false)
+
+#define AOT_EQUAL() (sp[-2] = BOOLEAN_VAL(values_equal(sp[-2], sp[-1])), --sp)
+
+// Adding strings is left to the interpreter along with the errors.
+#define AOT_BINARY(at, value_type, op)                                     \
+    do                                                                     \
+    {                                                                      \
+        if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))                      \
+        {                                                                  \
+            AOT_FALLBACK(at);                                              \
+        }                                                                  \
+        sp[-2] = value_type(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]));       \
+        --sp;                                                              \
+    } while (false)
+
+#define AOT_NUMBER(value_type, op) (sp[-2] = value_type(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1])), --sp)
+#define AOT_NEGATE_NUM() (sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])))
+#define AOT_NOT() (sp[-1] = BOOLEAN_VAL(AOT_IS_FALSEY(sp[-1])))
+
+#define AOT_NEGATE(at)                                 \
+    do                                                 \
+    {                                                  \
+        if (!IS_NUMBER(sp[-1]))                        \
+        {                                              \
+            AOT_FALLBACK(at);                          \
+        }                                              \
+        sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));       \
+    } while (false)
+
+#define AOT_PRINT() (flockfile(stdout), print_value(*--sp), printf("\n"), funlockfile(stdout))
+
+#define AOT_JUMP(target) goto L##target
+
+#define AOT_JUMP_IF_FALSE(target)          \
+    do                                     \
+    {                                      \
+        if (AOT_IS_FALSEY(sp[-1]))         \
+        {                                  \
+            goto L##target;                \
+        }                                  \
+    } while (false)
+
+// The counter's slot is followed by the limit's. in_range compares the two.
+#define AOT_COUNTER(slot) AS_NUMBER(slots[slot])
+#define AOT_LIMIT(slot) AS_NUMBER(slots[(slot) + 1])
+
+#define AOT_FOR_PREP(at, slot, in_range, target)                       \
+    do                                                                 \
+    {                                                                  \
+        if (!IS_NUMBER(slots[slot]) || !IS_NUMBER(slots[(slot) + 1]))  \
+        {                                                              \
+            AOT_FALLBACK(at);                                          \
+        }                                                              \
+        if (!(in_range))                                               \
+        {                                                              \
+            goto L##target;                                            \
+        }                                                              \
+    } while (false)
+
+#define AOT_FOR_ITER(at, slot, step, in_range, target)                 \
+    do                                                                 \
+    {                                                                  \
+        if (!IS_NUMBER(slots[slot]))                                   \
+        {                                                              \
+            AOT_FALLBACK(at);                                          \
+        }                                                              \
+        slots[slot].as.number += (step);                               \
+        if (in_range)                                                  \
+        {                                                              \
+            goto L##target;                                            \
+        }                                                              \
+    } while (false)
+
+#define AOT_UNWIND(count) (sp[-1 - (count)] = sp[-1], sp -= (count))
+
+#endif
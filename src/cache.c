@@ -0,0 +1,126 @@
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "serialize.h"
+#include "vm.h"
+
+// "CLXC" in little-endian order, so a file from a machine with the other byte order is rejected.
+#define CACHE_MAGIC 0x43584c43
+#define CACHE_VERSION 5
+
+// A cache file is a header followed by the script's function as written by write_function():
+//
+//     magic, version, opt level      u32 each
+//     whole program                  u8
+//     source length, source hash     u64 each
+//     payload length, payload hash   u64 each
+//
+// The cache only applies to the exact source and optimization settings it was compiled with.
+static void write_header(Writer *writer, const char *source, size_t length, Writer *payload)
+{
+    write_u32(writer, CACHE_MAGIC);
+    write_u32(writer, CACHE_VERSION);
+    write_u32(writer, (uint32_t)vm->opt_level);
+    write_u8(writer, vm->whole_program);
+    write_u64(writer, length);
+    write_u64(writer, hash_bytes(source, length));
+    write_u64(writer, payload->count);
+    write_u64(writer, hash_bytes(payload->bytes, payload->count));
+}
+
+static bool check_header(Reader *reader, const char *source, size_t length)
+{
+    if (read_u32(reader) != CACHE_MAGIC || read_u32(reader) != CACHE_VERSION ||
+        read_u32(reader) != (uint32_t)vm->opt_level || read_u8(reader) != vm->whole_program ||
+        read_u64(reader) != length ||
+        read_u64(reader) != hash_bytes(source, length))
+    {
+        return false;
+    }
+
+    uint64_t payload_length = read_u64(reader);
+    uint64_t payload_hash = read_u64(reader);
+    return !reader->failed && payload_length == reader->count - reader->offset &&
+           payload_hash == hash_bytes(reader->bytes + reader->offset, payload_length);
+}
+
+// Maps the cache file and reads the script's function out of it. Returns NULL when there is no
+// cache, or when it was written for a different source, optimization settings or format.
+ObjFunction *load_cache(const char *path, const char *source, size_t length)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1 || info.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    Reader reader;
+    init_reader(&reader, bytes, size);
+
+    ObjFunction *function = NULL;
+    if (check_header(&reader, source, length))
+    {
+        function = read_function(&reader);
+    }
+
+    // The script runs as a closure with nothing to capture.
+    if (function != NULL && (function->arity != 0 || function->upvalue_count != 0 ||
+                             function->capture_count != 0))
+    {
+        function = NULL;
+    }
+
+    munmap(bytes, size);
+    return function;
+}
+
+// Writes the cache next to a temporary name and renames it into place, so a process loading
+// it at the same time never sees half a file. Failing to write it isn't an error.
+void save_cache(const char *path, const char *source, size_t length, ObjFunction *function)
+{
+    Writer payload;
+    init_writer(&payload);
+    write_function(&payload, function);
+
+    Writer header;
+    init_writer(&header);
+    write_header(&header, source, length, &payload);
+
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file != NULL)
+    {
+        bool written = fwrite(header.bytes, 1, header.count, file) == header.count &&
+                       fwrite(payload.bytes, 1, payload.count, file) == payload.count;
+        if (fclose(file) != 0 || !written || rename(temp_path, path) != 0)
+        {
+            remove(temp_path);
+        }
+    }
+
+    free_writer(&header);
+    free_writer(&payload);
+}
@@ -0,0 +1,9 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "obj.h"
+
+ObjFunction *load_cache(const char *path, const char *source, size_t length);
+void save_cache(const char *path, const char *source, size_t length, ObjFunction *function);
+
+#endif
@@ -1,5 +1,7 @@
 #include "chunk.h"
+#include <string.h>
 #include "memory.h"
+#include "obj.h"
 #include "vm.h"
 
 void init_chunk(Chunk *chunk)
@@ -7,15 +9,24 @@ void init_chunk(Chunk *chunk)
     chunk->capacity = 0;
     chunk->count = 0;
     chunk->code = NULL;
-    chunk->line_nos = NULL;
+    chunk->line_capacity = 0;
+    chunk->line_count = 0;
+    chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->caches = NULL;
+    chunk->site_count = 0;
+    chunk->site_capacity = 0;
+    chunk->sites = NULL;
 }
 
 void free_chunk(Chunk *chunk)
 {
     FREE_ARRAY(chunk->code, uint8_t, chunk->capacity);
-    FREE_ARRAY(chunk->line_nos, int, chunk->capacity);
+    FREE_ARRAY(chunk->lines, LineStart, chunk->line_capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(chunk->caches, InlineCache, chunk->cache_count);
+    FREE_ARRAY(chunk->sites, InlineSite, chunk->site_capacity);
     init_chunk(chunk);
 }
 
@@ -26,12 +37,26 @@ void append_to_chunk(Chunk *chunk, uint8_t byte, int line_no)
         int old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
         chunk->code = GROW_ARRAY(chunk->code, uint8_t, old_capacity, chunk->capacity);
-        chunk->line_nos = GROW_ARRAY(chunk->line_nos, int, old_capacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->line_nos[chunk->count] = line_no;
     ++chunk->count;
+
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line_no == line_no)
+    {
+        return;
+    }
+
+    if (chunk->line_capacity < chunk->line_count + 1)
+    {
+        int old_capacity = chunk->line_capacity;
+        chunk->line_capacity = GROW_CAPACITY(old_capacity);
+        chunk->lines = GROW_ARRAY(chunk->lines, LineStart, old_capacity, chunk->line_capacity);
+    }
+
+    LineStart *line = &chunk->lines[chunk->line_count++];
+    line->offset = chunk->count - 1;
+    line->line_no = line_no;
 }
 
 int add_constant(Chunk *chunk, Value value)
@@ -41,3 +66,258 @@ int add_constant(Chunk *chunk, Value value)
     pop();
     return chunk->constants.count - 1;
 }
+
+// Whether two constants can share a slot: the same value, down to the sign of zero.
+bool is_same_constant(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+
+    return values_equal(a, b);
+}
+
+int find_constant(Chunk *chunk, Value value)
+{
+    ValueArray *constants = &chunk->constants;
+    for (int i = 0; i < constants->count; ++i)
+    {
+        if (is_same_constant(constants->values[i], value))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int add_cache(Chunk *chunk)
+{
+    chunk->caches = GROW_ARRAY(chunk->caches, InlineCache, chunk->cache_count, chunk->cache_count + 1);
+    chunk->caches[chunk->cache_count].klass = NULL;
+    chunk->caches[chunk->cache_count].method = NULL;
+    return chunk->cache_count++;
+}
+
+void add_inline_site(Chunk *chunk, int start, int end, int line_no, ObjString *name)
+{
+    if (chunk->site_capacity < chunk->site_count + 1)
+    {
+        int old_capacity = chunk->site_capacity;
+        chunk->site_capacity = GROW_CAPACITY(old_capacity);
+        chunk->sites = GROW_ARRAY(chunk->sites, InlineSite, old_capacity, chunk->site_capacity);
+    }
+
+    chunk->sites[chunk->site_count++] = (InlineSite){start, end, line_no, name};
+}
+
+int get_line_no(Chunk *chunk, int offset)
+{
+    int lo = 0;
+    int hi = chunk->line_count - 1;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (chunk->lines[mid].offset <= offset)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return chunk->lines[lo].line_no;
+}
+
+// The length of an instruction behind OP_WIDE, counting the prefix.
+static int wide_length(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset + 1])
+    {
+    case OP_INVOKE:
+        return 6;
+    case OP_SUPER_INVOKE:
+        return 7;
+    case OP_CLOSURE:
+    {
+        int constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+        return 4 + 3 * (function->upvalue_count + function->capture_count);
+    }
+    default:
+        return 4;
+    }
+}
+
+int instr_length(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_UNWIND:
+        return 2;
+    case OP_GET_HOISTED:
+    case OP_INVOKE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        return 3;
+    case OP_SUPER_INVOKE:
+        return 4;
+    case OP_FOR_PREP:
+        return 5;
+    case OP_FOR_ITER:
+        return 6;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + 2 * (function->upvalue_count + function->capture_count);
+    }
+    case OP_WIDE:
+        return wide_length(chunk, offset);
+    default:
+        return 1;
+    }
+}
+
+// Where the jump at offset goes, or -1 if it isn't a jump. Every jump keeps its distance in its
+// last two bytes, counted from the end of the instruction.
+int jump_target(Chunk *chunk, int offset)
+{
+    uint8_t op = chunk->code[offset];
+    if (op != OP_JUMP && op != OP_JUMP_IF_FALSE && op != OP_LOOP && op != OP_FOR_PREP &&
+        op != OP_FOR_ITER)
+    {
+        return -1;
+    }
+
+    int end = offset + instr_length(chunk, offset);
+    int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return op == OP_LOOP || op == OP_FOR_ITER ? end - distance : end + distance;
+}
+
+// How many values the instruction leaves on the stack minus how many it takes off.
+int stack_effect(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_GET_HOISTED:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return -1;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_UNWIND:
+        return -chunk->code[offset + 1];
+    case OP_INVOKE:
+        return -chunk->code[offset + 2];
+    case OP_SUPER_INVOKE:
+        return -chunk->code[offset + 2] - 1;
+    case OP_WIDE:
+    {
+        uint8_t *code = &chunk->code[offset];
+        switch (code[1])
+        {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -((code[2] << 8) | code[3]);
+        case OP_INVOKE:
+            return -((code[4] << 8) | code[5]);
+        case OP_SUPER_INVOKE:
+            return -((code[4] << 8) | code[5]) - 1;
+        default:
+            return stack_effect(chunk, offset + 1);
+        }
+    }
+    default:
+        return 0;
+    }
+}
+
+void truncate_chunk(Chunk *chunk, int count)
+{
+    chunk->count = count;
+
+    while (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].offset >= count)
+    {
+        --chunk->line_count;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < chunk->site_count; ++i)
+    {
+        if (chunk->sites[i].end <= count)
+        {
+            chunk->sites[kept++] = chunk->sites[i];
+        }
+    }
+    chunk->site_count = kept;
+}
+
+void shrink_chunk(Chunk *chunk)
+{
+    chunk->code = GROW_ARRAY(chunk->code, uint8_t, chunk->capacity, chunk->count);
+    chunk->capacity = chunk->count;
+
+    chunk->lines = GROW_ARRAY(chunk->lines, LineStart, chunk->line_capacity, chunk->line_count);
+    chunk->line_capacity = chunk->line_count;
+
+    chunk->sites = GROW_ARRAY(chunk->sites, InlineSite, chunk->site_capacity, chunk->site_count);
+    chunk->site_capacity = chunk->site_count;
+
+    ValueArray *constants = &chunk->constants;
+    constants->values = GROW_ARRAY(constants->values, Value, constants->capacity, constants->count);
+    constants->capacity = constants->count;
+}
@@ -18,6 +18,9 @@ typedef enum
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_CAPTURE,
+    // A global read from a loop that can't change it, with the slot the loop keeps it in.
+    OP_GET_HOISTED,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_EQUAL,
@@ -29,29 +32,101 @@ typedef enum
     OP_DIV,
     OP_NOT,
     OP_NEGATE,
+    OP_ADD_NUM,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_DIV_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_NEGATE_NUM,
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
+    OP_FOR_PREP,
+    OP_FOR_ITER,
     OP_CALL,
+    OP_TAIL_CALL,
+    OP_INVOKE,
+    OP_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
+    OP_UNWIND,
     OP_RETURN,
     OP_CLASS,
+    OP_INHERIT,
+    OP_METHOD,
+    OP_GET_SUPER,
+    // Prefix that makes the following instruction's operands two bytes wide. For OP_INVOKE and
+    // OP_SUPER_INVOKE that's the name and the argument count, and for OP_CLOSURE the function
+    // and the index of every variable it closes over.
+    OP_WIDE,
 } OpCode;
 
+// Operand of OP_FOR_PREP and OP_FOR_ITER: how the counter is compared with the limit, plus
+// whether the step is subtracted from the counter instead of added.
+typedef enum
+{
+    FOR_LESS,
+    FOR_LESS_EQUAL,
+    FOR_GREATER,
+    FOR_GREATER_EQUAL,
+    FOR_SUBTRACT = 4,
+} ForKind;
+
+// Start of a run of bytecode that all comes from the same source line.
+typedef struct
+{
+    int offset;
+    int line_no;
+} LineStart;
+
+// Code the compiler copied in from a call it inlined: [start, end) runs the body of the named
+// function, called from line_no. Sites nested in another come before it.
+typedef struct
+{
+    int start;
+    int end;
+    int line_no;
+    ObjString *name;
+} InlineSite;
+
+// What a super call last found, for the superclass it looked in.
+typedef struct
+{
+    Obj *klass;
+    Obj *method;
+} InlineCache;
+
 typedef struct
 {
     int capacity;
     int count;
     uint8_t *code;
-    int *line_nos;
+    int line_capacity;
+    int line_count;
+    LineStart *lines;
     ValueArray constants;
+    int cache_count;
+    InlineCache *caches;
+    int site_count;
+    int site_capacity;
+    InlineSite *sites;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
 void append_to_chunk(Chunk *chunk, uint8_t byte, int line_no);
 int add_constant(Chunk *chunk, Value value);
+bool is_same_constant(Value a, Value b);
+int find_constant(Chunk *chunk, Value value);
+int add_cache(Chunk *chunk);
+void add_inline_site(Chunk *chunk, int start, int end, int line_no, ObjString *name);
+int get_line_no(Chunk *chunk, int offset);
+int instr_length(Chunk *chunk, int offset);
+int jump_target(Chunk *chunk, int offset);
+int stack_effect(Chunk *chunk, int offset);
+void truncate_chunk(Chunk *chunk, int count);
+void shrink_chunk(Chunk *chunk);
 
 #endif
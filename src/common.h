@@ -11,5 +11,9 @@
 // #define DEBUG_TRACE_EXECUTION
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// For rare paths that would otherwise be inlined into run() and slow down its hot loop.
+#define NOINLINE __attribute__((noinline))
 
 #endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -40,22 +41,38 @@ typedef struct
     Precedence precedence;
 } ParseRule;
 
+// How a counted loop's limit can change while the loop runs, from least to most.
+typedef enum
+{
+    LIMIT_INVARIANT,
+    LIMIT_GLOBAL,
+    LIMIT_VARIABLE,
+    LIMIT_NONE,
+} LimitKind;
+
 typedef struct
 {
     Token name;
     int depth;
     bool is_captured;
+    // Set for locals initialized with a constant and never assigned; reads load the value directly.
+    bool is_constant;
+    Value value;
+    // Set for local functions that are never reassigned and small enough to inline.
+    ObjFunction *function;
 } Local;
 
 typedef struct
 {
-    uint8_t index;
+    uint16_t index;
     bool is_local;
 } Upvalue;
 
 typedef enum
 {
     TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
     TYPE_SCRIPT,
 } FunctionType;
 
@@ -64,14 +81,55 @@ typedef struct Compiler
     struct Compiler *enclosing;
     ObjFunction *function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int local_count;
-    Upvalue upvalues[UINT8_COUNT];
+    int local_capacity;
+    Upvalue *upvalues;
+    int upvalue_capacity;
+    // Variables that are never reassigned, copied into the closure when it's created.
+    Upvalue *captures;
+    int capture_capacity;
+    // Hash index of the number and string constants in the chunk, so each value is only added
+    // once. Buckets hold a constant's index plus one, or zero when empty.
+    int *constant_index;
+    int constant_entries;
+    int constant_capacity;
+    // The local that will hold the function whose body is being compiled, or -1. Its slot isn't
+    // filled until the closure has been created, so it can't be captured by value.
+    int function_slot;
     int scope_depth;
+    // Where the left operand of the infix expression being parsed starts, for constant folding.
+    int operand_start;
+    int operand_constants;
+    // The first token of the body, so it can be rescanned for assignments.
+    Token body_start;
+    Scanner body_scanner;
+    bool has_assigned;
+    Table assigned;
+    // Where the current statement starts and how deep the stack is there, for inlining.
+    int stmt_start;
+    int stmt_depth;
+    // Top-level functions that can be inlined, by name. Only used by the script's compiler.
+    Table inlinable;
+    // Where the last OP_CALL was emitted, to spot calls in tail position.
+    int last_call;
 } Compiler;
 
-Parser parser;
-Compiler *current = NULL;
+typedef struct ClassCompiler
+{
+    struct ClassCompiler *enclosing;
+    bool has_superclass;
+} ClassCompiler;
+
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
+_Thread_local ClassCompiler *current_class = NULL;
+
+// The source being compiled, so lazily compiled bodies can record where they start. It's copied
+// into a string when the first one is found, since the caller's buffer doesn't outlive compile().
+static _Thread_local const char *source_start = NULL;
+static _Thread_local size_t source_length = 0;
+static _Thread_local ObjString *source_string = NULL;
 
 static Chunk *curr_chunk()
 {
@@ -162,6 +220,20 @@ static void emit_2_byte(uint8_t byte1, uint8_t byte2)
     emit_1_byte(byte2);
 }
 
+static void emit_return()
+{
+    // Initializers always return the instance.
+    if (current->type == TYPE_INITIALIZER)
+    {
+        emit_2_byte(OP_GET_LOCAL, 0);
+    }
+    else
+    {
+        emit_1_byte(OP_NIL);
+    }
+    emit_1_byte(OP_RETURN);
+}
+
 static void emit_loop(int loop_start)
 {
     emit_1_byte(OP_LOOP);
@@ -185,21 +257,159 @@ static int emit_jump(uint8_t instr)
     return curr_chunk()->count - 2;
 }
 
-static uint8_t make_constant(Value value)
+static void emit_short(int value)
+{
+    emit_2_byte((value >> 8) & 0xff, value & 0xff);
+}
+
+// Emits an instruction with one index operand, behind OP_WIDE when it doesn't fit in a byte.
+static void emit_indexed(uint8_t instr, int index)
+{
+    if (index > UINT8_MAX)
+    {
+        emit_2_byte(OP_WIDE, instr);
+        emit_short(index);
+    }
+    else
+    {
+        emit_2_byte(instr, (uint8_t)index);
+    }
+}
+
+// Emits OP_INVOKE or OP_SUPER_INVOKE up to its argument count.
+static void emit_invoke(uint8_t instr, int name, int arg_count)
+{
+    if (name > UINT8_MAX || arg_count > UINT8_MAX)
+    {
+        emit_2_byte(OP_WIDE, instr);
+        emit_short(name);
+        emit_short(arg_count);
+    }
+    else
+    {
+        emit_2_byte(instr, (uint8_t)name);
+        emit_1_byte((uint8_t)arg_count);
+    }
+}
+
+static uint32_t hash_constant(Value value)
+{
+    if (IS_STRING(value))
+    {
+        return AS_STRING(value)->hash;
+    }
+
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+// The bucket holding value, or the empty one it would go in. Folding can drop constants from the
+// end of the chunk, so buckets are only trusted when the constant they point at still matches.
+static int *find_constant_bucket(Compiler *compiler, Value value)
+{
+    if (compiler->constant_capacity == 0)
+    {
+        return NULL;
+    }
+
+    ValueArray *constants = &compiler->function->chunk.constants;
+    uint32_t mask = (uint32_t)compiler->constant_capacity - 1;
+    for (uint32_t i = hash_constant(value) & mask;; i = (i + 1) & mask)
+    {
+        int *bucket = &compiler->constant_index[i];
+        if (*bucket == 0 ||
+            (*bucket <= constants->count && is_same_constant(constants->values[*bucket - 1], value)))
+        {
+            return bucket;
+        }
+    }
+}
+
+// Rebuilds the index with room to grow, from the constants the chunk has now.
+static void index_constants(Compiler *compiler)
+{
+    ValueArray *constants = &compiler->function->chunk.constants;
+    int capacity = compiler->constant_capacity < 8 ? 8 : compiler->constant_capacity;
+    while (constants->count * 4 > capacity * 3)
+    {
+        capacity *= 2;
+    }
+
+    FREE_ARRAY(compiler->constant_index, int, compiler->constant_capacity);
+    compiler->constant_index = ALLOCATE(int, capacity);
+    compiler->constant_capacity = capacity;
+    compiler->constant_entries = 0;
+    memset(compiler->constant_index, 0, sizeof(int) * capacity);
+
+    for (int i = 0; i < constants->count; ++i)
+    {
+        Value value = constants->values[i];
+        if (IS_NUMBER(value) || IS_STRING(value))
+        {
+            int *bucket = find_constant_bucket(compiler, value);
+            if (*bucket == 0)
+            {
+                *bucket = i + 1;
+                ++compiler->constant_entries;
+            }
+        }
+    }
+}
+
+// Adds the value to the chunk's constants, unless it's a number or string that's already there.
+static int make_constant(Value value)
 {
+    bool is_shared = IS_NUMBER(value) || IS_STRING(value);
+    int *bucket = is_shared ? find_constant_bucket(current, value) : NULL;
+    if (bucket != NULL && *bucket != 0)
+    {
+        return *bucket - 1;
+    }
+
     int constant = add_constant(curr_chunk(), value);
-    if (constant > UINT8_MAX)
+    if (constant > UINT16_MAX)
     {
         error_at_prev("Too many constants in chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    if (is_shared)
+    {
+        if ((current->constant_entries + 1) * 4 > current->constant_capacity * 3)
+        {
+            index_constants(current);
+        }
+        else
+        {
+            *bucket = constant + 1;
+            ++current->constant_entries;
+        }
+    }
+
+    return constant;
 }
 
 static void emit_constant(Value value)
 {
-    emit_2_byte(OP_CONSTANT, make_constant(value));
+    emit_indexed(OP_CONSTANT, make_constant(value));
+}
+
+static void emit_value(Value value)
+{
+    if (IS_NIL(value))
+    {
+        emit_1_byte(OP_NIL);
+    }
+    else if (IS_BOOLEAN(value))
+    {
+        emit_1_byte(AS_BOOLEAN(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        emit_constant(value);
+    }
 }
 
 static void patch_jump(int offset)
@@ -215,32 +425,73 @@ static void patch_jump(int offset)
     curr_chunk()->code[offset + 1] = jump & 0xff;
 }
 
-static void init_compiler(Compiler *compiler, FunctionType type)
+static Token synthetic_token(const char *text);
+static void add_local(Token name);
+
+// Starts compiling into the given function, or into a new one named after the previous token.
+static void init_compiler(Compiler *compiler, FunctionType type, ObjFunction *function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalue_capacity = 0;
+    compiler->captures = NULL;
+    compiler->capture_capacity = 0;
+    compiler->constant_index = NULL;
+    compiler->constant_entries = 0;
+    compiler->constant_capacity = 0;
+    compiler->function_slot = -1;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
+    compiler->operand_start = 0;
+    compiler->operand_constants = 0;
+    compiler->has_assigned = false;
+    init_table(&compiler->assigned);
+    compiler->stmt_start = 0;
+    compiler->stmt_depth = 0;
+    init_table(&compiler->inlinable);
+    compiler->last_call = -1;
+    compiler->function = function != NULL ? function : new_function();
     current = compiler;
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && function == NULL)
     {
         current->function->name = copy_string(parser.prev.start, parser.prev.length);
     }
 
-    Local *local = &current->locals[current->local_count++];
-    local->depth = 0;
-    local->is_captured = false;
-    local->name.start = "";
-    local->name.length = 0;
+    add_local(synthetic_token(type == TYPE_METHOD || type == TYPE_INITIALIZER ? "this" : ""));
+    current->locals[0].depth = 0;
+}
+
+static void begin_body(Compiler *compiler)
+{
+    compiler->body_start = parser.curr;
+    compiler->body_scanner = save_scanner();
 }
 
 static ObjFunction *end_compiler()
 {
-    emit_2_byte(OP_NIL, OP_RETURN);
+    emit_return();
     ObjFunction *function = current->function;
+    if (vm->opt_level > 0 && !parser.had_error)
+    {
+        optimize_chunk(function);
+        specialize_arithmetic(function);
+        hoist_invariants(function);
+    }
+    shrink_chunk(&function->chunk);
+    if (!parser.had_error)
+    {
+        function->max_stack = max_stack_depth(function);
+    }
+    free_table(&current->assigned);
+    free_table(&current->inlinable);
+    // The upvalues and captures are left for function() to emit.
+    FREE_ARRAY(current->locals, Local, current->local_capacity);
+    FREE_ARRAY(current->constant_index, int, current->constant_capacity);
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error)
@@ -280,21 +531,196 @@ static void end_scope()
 static void expression();
 static void statement();
 static void declaration();
-static uint8_t argument_list();
+static int argument_list();
 static void and (bool can_assign);
 static ParseRule *get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
-static uint8_t identifier_constant(Token *name);
+static int identifier_constant(Token *name);
 static int resolve_local(Compiler *compiler, Token *name);
-static int resolve_upvalue(Compiler *compiler, Token *name);
+static int resolve_upvalue(Compiler *compiler, Token *name, bool *by_value);
+static bool resolve_constant(Compiler *compiler, Token *name, Value *value);
+
+// Reads the value loaded by the code in [start, end) if that is exactly one constant load.
+static bool read_constant(int start, int end, Value *value)
+{
+    uint8_t *code = curr_chunk()->code;
+
+    if (end - start == 1)
+    {
+        switch (code[start])
+        {
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOLEAN_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOLEAN_VAL(false);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    if (end - start == 2 && code[start] == OP_CONSTANT)
+    {
+        *value = curr_chunk()->constants.values[code[start + 1]];
+        return true;
+    }
+
+    if (end - start == 4 && code[start] == OP_WIDE && code[start + 1] == OP_CONSTANT)
+    {
+        *value = curr_chunk()->constants.values[(code[start + 2] << 8) | code[start + 3]];
+        return true;
+    }
+
+    return false;
+}
+
+// Replaces the operand code starting at start with a load of value. Constants added by the
+// discarded code are dropped too; anything older may be shared with earlier code.
+static void replace_with_value(int start, int constants_start, Value value)
+{
+    truncate_chunk(curr_chunk(), start);
+
+    ValueArray *constants = &curr_chunk()->constants;
+    if (IS_OBJ(value))
+    {
+        push(value);
+    }
+    constants->count = constants_start;
+    emit_value(value);
+    if (IS_OBJ(value))
+    {
+        pop();
+    }
+}
+
+static bool fold_binary(TokenType operator_type, int lhs_start, int rhs_start, int constants_start)
+{
+    Value a;
+    Value b;
+    if (!read_constant(lhs_start, rhs_start, &a) || !read_constant(rhs_start, curr_chunk()->count, &b))
+    {
+        return false;
+    }
+
+    Value result;
+    bool are_numbers = IS_NUMBER(a) && IS_NUMBER(b);
+
+    switch (operator_type)
+    {
+    case TK_BANG_EQUAL:
+        result = BOOLEAN_VAL(!values_equal(a, b));
+        break;
+    case TK_EQUAL_EQUAL:
+        result = BOOLEAN_VAL(values_equal(a, b));
+        break;
+    case TK_GREATER:
+        if (!are_numbers)
+            return false;
+        result = BOOLEAN_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+        break;
+    case TK_GREATER_EQUAL:
+        if (!are_numbers)
+            return false;
+        result = BOOLEAN_VAL(!(AS_NUMBER(a) < AS_NUMBER(b)));
+        break;
+    case TK_LESS:
+        if (!are_numbers)
+            return false;
+        result = BOOLEAN_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+        break;
+    case TK_LESS_EQUAL:
+        if (!are_numbers)
+            return false;
+        result = BOOLEAN_VAL(!(AS_NUMBER(a) > AS_NUMBER(b)));
+        break;
+    case TK_PLUS:
+        if (are_numbers)
+        {
+            result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        }
+        else if (IS_STRING(a) && IS_STRING(b))
+        {
+            ObjString *lhs = AS_STRING(a);
+            ObjString *rhs = AS_STRING(b);
+            int length = lhs->length + rhs->length;
+            char *chars = ALLOCATE(char, length + 1);
+            memcpy(chars, lhs->chars, lhs->length);
+            memcpy(chars + lhs->length, rhs->chars, rhs->length);
+            chars[length] = '\0';
+            result = OBJ_VAL(take_string(chars, length));
+        }
+        else
+        {
+            return false;
+        }
+        break;
+    case TK_MINUS:
+        if (!are_numbers)
+            return false;
+        result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+        break;
+    case TK_STAR:
+        if (!are_numbers)
+            return false;
+        result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+        break;
+    case TK_SLASH:
+        if (!are_numbers)
+            return false;
+        result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+        break;
+    default:
+        return false;
+    }
+
+    replace_with_value(lhs_start, constants_start, result);
+    return true;
+}
+
+static bool fold_unary(TokenType operator_type, int operand_start, int constants_start)
+{
+    Value operand;
+    if (!read_constant(operand_start, curr_chunk()->count, &operand))
+    {
+        return false;
+    }
+
+    switch (operator_type)
+    {
+    case TK_BANG:
+        replace_with_value(operand_start, constants_start, BOOLEAN_VAL(IS_NIL(operand) || (IS_BOOLEAN(operand) && !AS_BOOLEAN(operand))));
+        return true;
+    case TK_MINUS:
+        if (!IS_NUMBER(operand))
+        {
+            return false;
+        }
+        replace_with_value(operand_start, constants_start, NUMBER_VAL(-AS_NUMBER(operand)));
+        return true;
+    default:
+        return false;
+    }
+}
 
 static void binary(bool can_assign)
 {
     TokenType operator_type = parser.prev.type;
+    int lhs_start = current->operand_start;
+    int constants_start = current->operand_constants;
+    int rhs_start = curr_chunk()->count;
 
     ParseRule *rule = get_rule(operator_type);
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    if (fold_binary(operator_type, lhs_start, rhs_start, constants_start))
+    {
+        return;
+    }
+
     switch (operator_type)
     {
     case TK_BANG_EQUAL:
@@ -332,27 +758,89 @@ static void binary(bool can_assign)
     }
 }
 
+// The function loaded by the code in [start, end) if that's a single load of a function known to
+// be inlinable.
+static ObjFunction *inline_candidate(int start, int end)
+{
+    uint8_t *code = curr_chunk()->code;
+    if (vm->opt_level == 0 || parser.had_error || end - start != 2)
+    {
+        return NULL;
+    }
+
+    if (code[start] == OP_GET_LOCAL)
+    {
+        return current->locals[code[start + 1]].function;
+    }
+
+    if (code[start] == OP_GET_GLOBAL)
+    {
+        Compiler *script = current;
+        while (script->enclosing != NULL)
+        {
+            script = script->enclosing;
+        }
+
+        Value function;
+        ObjString *name = AS_STRING(curr_chunk()->constants.values[code[start + 1]]);
+        if (table_get(&script->inlinable, name, &function))
+        {
+            return AS_FUNCTION(function);
+        }
+    }
+
+    return NULL;
+}
+
 static void call(bool can_assign)
 {
-    uint8_t arg_count = argument_list();
-    emit_2_byte(OP_CALL, arg_count);
+    int callee_start = current->operand_start;
+    int args_start = curr_chunk()->count;
+    int arg_count = argument_list();
+
+    ObjFunction *callee = inline_candidate(callee_start, args_start);
+    if (callee != NULL && callee->arity == arg_count)
+    {
+        Chunk *chunk = curr_chunk();
+        int base = stack_depth_at(chunk, current->stmt_start, current->stmt_depth, callee_start);
+        int body_start = chunk->count;
+        if (base > 0 && inline_function(chunk, callee, base))
+        {
+            // Errors in the copied code still show the call in their stack traces.
+            add_inline_site(chunk, body_start, chunk->count, parser.prev.line_no, callee->name);
+            // The callee's slot still needs filling, just not with a global lookup.
+            if (chunk->code[callee_start] == OP_GET_GLOBAL)
+            {
+                chunk->code[callee_start] = OP_CONSTANT;
+            }
+            return;
+        }
+    }
+
+    current->last_call = curr_chunk()->count;
+    emit_indexed(OP_CALL, arg_count);
 }
 
 static void dot(bool can_assign)
 {
     consume(TK_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&parser.prev);
+    int name = identifier_constant(&parser.prev);
 
     if (can_assign && match(TK_EQUAL))
     {
         expression();
-        emit_2_byte(OP_SET_PROPERTY, name);
+        emit_indexed(OP_SET_PROPERTY, name);
+    }
+    else if (match(TK_LEFT_PAREN))
+    {
+        // Calling a method right away doesn't need the bound method in between.
+        int arg_count = argument_list();
+        emit_invoke(OP_INVOKE, name, arg_count);
     }
     else
     {
-        emit_2_byte(OP_GET_PROPERTY, name);
+        emit_indexed(OP_GET_PROPERTY, name);
     }
-    
 }
 
 static void literal(bool can_assign)
@@ -404,7 +892,15 @@ static void string(bool can_assign)
 
 static void named_variable(Token name, bool can_assign)
 {
+    Value value;
+    if (resolve_constant(current, &name, &value))
+    {
+        emit_value(value);
+        return;
+    }
+
     uint8_t get_op, set_op;
+    bool by_value;
     int arg = resolve_local(current, &name);
 
     if (arg != -1)
@@ -412,9 +908,10 @@ static void named_variable(Token name, bool can_assign)
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
     }
-    else if ((arg = resolve_upvalue(current, &name)) != -1)
+    else if ((arg = resolve_upvalue(current, &name, &by_value)) != -1)
     {
-        get_op = OP_GET_UPVALUE;
+        // Captures by value are never assigned, so there's no set for them.
+        get_op = by_value ? OP_GET_CAPTURE : OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     }
     else
@@ -427,11 +924,11 @@ static void named_variable(Token name, bool can_assign)
     if (can_assign && match(TK_EQUAL))
     {
         expression();
-        emit_2_byte(set_op, arg);
+        emit_indexed(set_op, arg);
     }
     else
     {
-        emit_2_byte(get_op, arg);
+        emit_indexed(get_op, arg);
     }
 }
 
@@ -440,12 +937,67 @@ static void variable(bool can_assign)
     named_variable(parser.prev, can_assign);
 }
 
+static void super (bool can_assign)
+{
+    if (current_class == NULL)
+    {
+        error_at_prev("Cannot use 'super' outside of a class.");
+    }
+    else if (!current_class->has_superclass)
+    {
+        error_at_prev("Cannot use 'super' in a class with no superclass.");
+    }
+
+    consume(TK_DOT, "Expect '.' after 'super'.");
+    consume(TK_IDENTIFIER, "Expect superclass method name.");
+    int name = identifier_constant(&parser.prev);
+
+    named_variable(synthetic_token("this"), false);
+    if (match(TK_LEFT_PAREN))
+    {
+        int arg_count = argument_list();
+        named_variable(synthetic_token("super"), false);
+
+        Chunk *chunk = curr_chunk();
+        if (chunk->cache_count == UINT8_COUNT)
+        {
+            error_at_prev("Too many super calls in one function.");
+            return;
+        }
+        emit_invoke(OP_SUPER_INVOKE, name, arg_count);
+        emit_1_byte(add_cache(chunk));
+    }
+    else
+    {
+        named_variable(synthetic_token("super"), false);
+        emit_indexed(OP_GET_SUPER, name);
+    }
+}
+
+static void this (bool can_assign)
+{
+    if (current_class == NULL)
+    {
+        error_at_prev("Cannot use 'this' outside of a class.");
+        return;
+    }
+
+    variable(false);
+}
+
 static void unary(bool can_assign)
 {
     TokenType operator_type = parser.prev.type;
+    int operand_start = curr_chunk()->count;
+    int constants_start = curr_chunk()->constants.count;
 
     parse_precedence(PREC_UNARY);
 
+    if (fold_unary(operator_type, operand_start, constants_start))
+    {
+        return;
+    }
+
     switch (operator_type)
     {
     case TK_BANG:
@@ -493,8 +1045,8 @@ ParseRule rules[] = {
     {NULL, or, PREC_OR},             // TK_OR
     {NULL, NULL, PREC_NONE},         // TK_PRINT
     {NULL, NULL, PREC_NONE},         // TK_RETURN
-    {NULL, NULL, PREC_NONE},         // TK_SUPER
-    {NULL, NULL, PREC_NONE},         // TK_THIS
+    {super, NULL, PREC_NONE},        // TK_SUPER
+    {this, NULL, PREC_NONE},         // TK_THIS
     {literal, NULL, PREC_NONE},      // TK_TRUE
     {NULL, NULL, PREC_NONE},         // TK_VAR
     {NULL, NULL, PREC_NONE},         // TK_WHILE
@@ -513,12 +1065,16 @@ static void parse_precedence(Precedence precedence)
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
+    int operand_start = curr_chunk()->count;
+    int operand_constants = curr_chunk()->constants.count;
     prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.curr.type)->precedence)
     {
         advance();
         ParseFn infix_rule = get_rule(parser.prev.type)->infix;
+        current->operand_start = operand_start;
+        current->operand_constants = operand_constants;
         infix_rule(can_assign);
     }
 
@@ -528,11 +1084,21 @@ static void parse_precedence(Precedence precedence)
     }
 }
 
-static uint8_t identifier_constant(Token *name)
+static int identifier_constant(Token *name)
 {
     return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
+static Token synthetic_token(const char *text)
+{
+    Token token;
+    token.type = TK_IDENTIFIER;
+    token.start = text;
+    token.length = (int)strlen(text);
+    token.line_no = parser.prev.line_no;
+    return token;
+}
+
 static bool identifiers_equal(Token *a, Token *b)
 {
     if (a->length != b->length)
@@ -561,31 +1127,129 @@ static int resolve_local(Compiler *compiler, Token *name)
     return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local)
+// Looks the name up the same way resolve_local() and resolve_upvalue() do, but only succeeds when
+// the variable it finds is a constant local.
+static bool resolve_constant(Compiler *compiler, Token *name, Value *value)
 {
-    int upvalue_count = compiler->function->upvalue_count;
-
-    for (int i = 0; i < upvalue_count; ++i)
+    for (; compiler != NULL; compiler = compiler->enclosing)
     {
-        Upvalue *upvalue = &compiler->upvalues[i];
-        if (upvalue->index == index && upvalue->is_local == is_local)
+        for (int i = compiler->local_count - 1; i >= 0; --i)
         {
-            return i;
+            Local *local = &compiler->locals[i];
+            if (identifiers_equal(name, &local->name))
+            {
+                *value = local->value;
+                return local->is_constant;
+            }
         }
     }
 
-    if (upvalue_count == UINT8_COUNT)
-    {
-        error_at_curr("Too many closure variables in function.");
-        return 0;
-    }
+    return false;
+}
+
+// Records a name seen by is_assigned(). Declaring a name counts as assigning it the second time.
+static void note_name(Compiler *compiler, Token *name, bool is_assignment)
+{
+    ObjString *key = copy_string(name->start, name->length);
+    push(OBJ_VAL(key));
+
+    Value seen;
+    bool is_reassigned = is_assignment || table_get(&compiler->assigned, key, &seen);
+    table_put(&compiler->assigned, key, BOOLEAN_VAL(is_reassigned));
+
+    pop();
+}
+
+// Rescans the body of the function for every 'name =' that isn't a declaration or a property set,
+// nested functions included, and for names declared more than once at its top level. A variable
+// whose name never shows up can't change after it has been initialized.
+static bool is_assigned(Compiler *compiler, Token *name)
+{
+    if (!compiler->has_assigned)
+    {
+        compiler->has_assigned = true;
+
+        Scanner resume = save_scanner();
+        restore_scanner(compiler->body_scanner);
+
+        Token before = {TK_SEMICOLON, NULL, 0, 0};
+        Token previous = before;
+        int depth = 0;
+
+        for (Token token = compiler->body_start; token.type != TK_EOF; token = scan_token())
+        {
+            if (token.type == TK_LEFT_BRACE)
+            {
+                ++depth;
+            }
+            else if (token.type == TK_RIGHT_BRACE && --depth < 0)
+            {
+                break;
+            }
+            else if (token.type == TK_EQUAL && previous.type == TK_IDENTIFIER &&
+                     before.type != TK_DOT && before.type != TK_VAR)
+            {
+                note_name(compiler, &previous, true);
+            }
+
+            if (depth == 0 && previous.type == TK_IDENTIFIER &&
+                (before.type == TK_VAR || before.type == TK_FUN || before.type == TK_CLASS))
+            {
+                note_name(compiler, &previous, false);
+            }
+
+            before = previous;
+            previous = token;
+        }
+
+        restore_scanner(resume);
+    }
 
-    compiler->upvalues[upvalue_count].is_local = is_local;
-    compiler->upvalues[upvalue_count].index = index;
-    return compiler->function->upvalue_count++;
+    Value value;
+    return table_get(&compiler->assigned, copy_string(name->start, name->length), &value) &&
+           AS_BOOLEAN(value);
 }
 
-static int resolve_upvalue(Compiler *compiler, Token *name)
+static int add_upvalue(Compiler *compiler, int index, bool is_local, bool by_value)
+{
+    Upvalue **upvalues = by_value ? &compiler->captures : &compiler->upvalues;
+    int *capacity = by_value ? &compiler->capture_capacity : &compiler->upvalue_capacity;
+    int *count = by_value ? &compiler->function->capture_count : &compiler->function->upvalue_count;
+
+    for (int i = 0; i < *count; ++i)
+    {
+        Upvalue *upvalue = &(*upvalues)[i];
+        if (upvalue->index == index && upvalue->is_local == is_local)
+        {
+            return i;
+        }
+    }
+
+    if (*count == UINT16_COUNT)
+    {
+        error_at_curr("Too many closure variables in function.");
+        return 0;
+    }
+
+    if (*capacity < *count + 1)
+    {
+        int old_capacity = *capacity;
+        *capacity = GROW_CAPACITY(old_capacity);
+        *upvalues = GROW_ARRAY(*upvalues, Upvalue, old_capacity, *capacity);
+    }
+
+    (*upvalues)[*count].is_local = is_local;
+    (*upvalues)[*count].index = (uint16_t)index;
+    return (*count)++;
+}
+
+// Finds the variable in an enclosing function. One that is never reassigned after it's captured
+// is copied into the closure instead of being shared through an upvalue, and by_value is set.
+//
+// Every other capture gets a heap ObjUpvalue, even one whose closure never outlives the frame it
+// was made in. There's no cheaper form for those: nothing here proves that a closure doesn't
+// escape, and a raw pointer to the slot wouldn't survive the stack moving when it grows.
+static int resolve_upvalue(Compiler *compiler, Token *name, bool *by_value)
 {
     if (compiler->enclosing == NULL)
     {
@@ -595,14 +1259,18 @@ static int resolve_upvalue(Compiler *compiler, Token *name)
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1)
     {
-        compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        *by_value = local != compiler->enclosing->function_slot && !is_assigned(compiler->enclosing, name);
+        if (!*by_value)
+        {
+            compiler->enclosing->locals[local].is_captured = true;
+        }
+        return add_upvalue(compiler, local, true, *by_value);
     }
 
-    int upvalue = resolve_upvalue(compiler->enclosing, name);
+    int upvalue = resolve_upvalue(compiler->enclosing, name, by_value);
     if (upvalue != -1)
     {
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(compiler, upvalue, false, *by_value);
     }
 
     return -1;
@@ -610,16 +1278,25 @@ static int resolve_upvalue(Compiler *compiler, Token *name)
 
 static void add_local(Token name)
 {
-    if (current->local_count == UINT8_COUNT)
+    if (current->local_count == UINT16_COUNT)
     {
         error_at_curr("Too many local variables in function.");
         return;
     }
 
+    if (current->local_capacity < current->local_count + 1)
+    {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(current->locals, Local, old_capacity, current->local_capacity);
+    }
+
     Local *local = &current->locals[current->local_count++];
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
+    local->is_constant = false;
+    local->function = NULL;
 }
 
 static void declare_variable()
@@ -648,7 +1325,7 @@ static void declare_variable()
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char *error_message)
+static int parse_variable(const char *error_message)
 {
     consume(TK_IDENTIFIER, error_message);
 
@@ -671,7 +1348,7 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(int global)
 {
     if (current->scope_depth > 0)
     {
@@ -679,21 +1356,21 @@ static void define_variable(uint8_t global)
         return;
     }
 
-    emit_2_byte(OP_DEFINE_GLOBAL, global);
+    emit_indexed(OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argument_list()
+static int argument_list()
 {
-    uint8_t arg_count = 0;
+    int arg_count = 0;
     if (!check(TK_RIGHT_PAREN))
     {
         do
         {
             expression();
 
-            if (arg_count == 255)
+            if (arg_count == UINT16_MAX)
             {
-                error_at_curr("Cannot have more than 255 arguments.");
+                error_at_curr("Cannot have more than 65535 arguments.");
             }
 
             ++arg_count;
@@ -734,10 +1411,110 @@ static void block()
     consume(TK_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+static bool is_enclosing_local(Token *name)
+{
+    for (Compiler *compiler = current; compiler != NULL; compiler = compiler->enclosing)
+    {
+        for (int i = 0; i < compiler->local_count; ++i)
+        {
+            if (identifiers_equal(name, &compiler->locals[i].name))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Scans ahead over the parameter list and body of the function whose name was just parsed. If
+// they don't mention any enclosing local, the parser is left after the body and true is returned.
+// Otherwise the scanner is rewound so the function can be compiled now, with its captures.
+// 'super' always needs the enclosing class, and so does 'this' outside of a method.
+static bool skip_body(FunctionType type)
+{
+    if (!check(TK_LEFT_PAREN))
+    {
+        return false;
+    }
+
+    Scanner resume = save_scanner();
+    Token token = scan_token();
+
+    // Names and commas, alternating.
+    int param_tokens = 0;
+    for (; token.type == (param_tokens % 2 == 0 ? TK_IDENTIFIER : TK_COMMA); token = scan_token())
+    {
+        if (token.type == TK_IDENTIFIER && is_enclosing_local(&token))
+        {
+            break;
+        }
+        ++param_tokens;
+    }
+
+    if (token.type != TK_RIGHT_PAREN || (param_tokens > 0 && param_tokens % 2 == 0))
+    {
+        restore_scanner(resume);
+        return false;
+    }
+
+    token = scan_token();
+    for (int depth = 0; token.type == TK_LEFT_BRACE || depth > 0; token = scan_token())
+    {
+        if (token.type == TK_EOF || token.type == TK_ERROR || token.type == TK_SUPER ||
+            (token.type == TK_THIS && type == TYPE_FUNCTION) ||
+            (token.type == TK_IDENTIFIER && is_enclosing_local(&token)))
+        {
+            break;
+        }
+
+        if (token.type == TK_LEFT_BRACE)
+        {
+            ++depth;
+        }
+        else if (token.type == TK_RIGHT_BRACE && --depth == 0)
+        {
+            parser.curr = token;
+            advance();
+            return true;
+        }
+    }
+
+    restore_scanner(resume);
+    return false;
+}
+
+// Emits a closure over a function whose parameters and body are only compiled on its first call,
+// or returns NULL if they can't be skipped.
+static ObjFunction *lazy_function(FunctionType type)
+{
+    Token name = parser.prev;
+    Token start = parser.curr;
+    if (!skip_body(type))
+    {
+        return NULL;
+    }
+
+    if (source_string == NULL)
+    {
+        source_string = copy_string(source_start, (int)source_length);
+    }
+
+    ObjFunction *function = new_function();
+    push(OBJ_VAL(function));
+    function->name = copy_string(name.start, name.length);
+    function->source = source_string;
+    function->source_offset = (int)(start.start - source_start);
+    function->source_line = start.line_no;
+    function->is_method = type != TYPE_FUNCTION;
+    emit_indexed(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    pop();
+
+    return function;
+}
+
+static void function_body(Compiler *compiler)
 {
-    Compiler compiler;
-    init_compiler(&compiler, type);
     begin_scope();
 
     consume(TK_LEFT_PAREN, "Expect '(' after function name.");
@@ -747,12 +1524,12 @@ static void function(FunctionType type)
         do
         {
             ++current->function->arity;
-            if (current->function->arity > 255)
+            if (current->function->arity > UINT16_MAX)
             {
-                error_at_curr("Cannot have more than 255 parameters.");
+                error_at_curr("Cannot have more than 65535 parameters.");
             }
 
-            uint8_t param_constant = parse_variable("Expect parameter name.");
+            int param_constant = parse_variable("Expect parameter name.");
             define_variable(param_constant);
         } while (match(TK_COMMA));
     }
@@ -760,42 +1537,180 @@ static void function(FunctionType type)
     consume(TK_RIGHT_PAREN, "Expect ')' after parameters.");
 
     consume(TK_LEFT_BRACE, "Expect '{' before function body.");
+    begin_body(compiler);
     block();
+}
+
+// Emits where a closure gets one of its variables from, after OP_CLOSURE.
+static void emit_closure_variable(Upvalue *variable, bool is_wide)
+{
+    emit_1_byte(variable->is_local ? 1 : 0);
+    if (is_wide)
+    {
+        emit_short(variable->index);
+    }
+    else
+    {
+        emit_1_byte((uint8_t)variable->index);
+    }
+}
+
+static ObjFunction *function(FunctionType type)
+{
+    if (vm->lazy)
+    {
+        ObjFunction *lazy = lazy_function(type);
+        if (lazy != NULL)
+        {
+            return lazy;
+        }
+    }
+
+    Compiler compiler;
+    init_compiler(&compiler, type, NULL);
+    function_body(&compiler);
 
     ObjFunction *function = end_compiler();
-    emit_2_byte(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    int constant = make_constant(OBJ_VAL(function));
 
+    bool is_wide = constant > UINT8_MAX;
     for (int i = 0; i < function->upvalue_count; ++i)
     {
-        emit_1_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_1_byte(compiler.upvalues[i].index);
+        is_wide |= compiler.upvalues[i].index > UINT8_MAX;
     }
+    for (int i = 0; i < function->capture_count; ++i)
+    {
+        is_wide |= compiler.captures[i].index > UINT8_MAX;
+    }
+
+    if (is_wide)
+    {
+        emit_2_byte(OP_WIDE, OP_CLOSURE);
+        emit_short(constant);
+    }
+    else
+    {
+        emit_2_byte(OP_CLOSURE, (uint8_t)constant);
+    }
+    for (int i = 0; i < function->upvalue_count; ++i)
+    {
+        emit_closure_variable(&compiler.upvalues[i], is_wide);
+    }
+    for (int i = 0; i < function->capture_count; ++i)
+    {
+        emit_closure_variable(&compiler.captures[i], is_wide);
+    }
+
+    FREE_ARRAY(compiler.upvalues, Upvalue, compiler.upvalue_capacity);
+    FREE_ARRAY(compiler.captures, Upvalue, compiler.capture_capacity);
+    return function;
+}
+
+static void method()
+{
+    consume(TK_IDENTIFIER, "Expect method name.");
+    int constant = identifier_constant(&parser.prev);
+
+    FunctionType type = TYPE_METHOD;
+    if (parser.prev.length == 4 && memcmp(parser.prev.start, "init", 4) == 0)
+    {
+        type = TYPE_INITIALIZER;
+    }
+
+    function(type);
+    emit_indexed(OP_METHOD, constant);
 }
 
 static void class_declaration()
 {
     consume(TK_IDENTIFIER, "Expect class name.");
-    uint8_t name_constant = identifier_constant(&parser.prev);
+    Token class_name = parser.prev;
+    int name_constant = identifier_constant(&parser.prev);
     declare_variable();
 
-    emit_2_byte(OP_CLASS, name_constant);
+    emit_indexed(OP_CLASS, name_constant);
     define_variable(name_constant);
 
+    ClassCompiler class_compiler;
+    class_compiler.enclosing = current_class;
+    class_compiler.has_superclass = false;
+    current_class = &class_compiler;
+
+    if (match(TK_LESS))
+    {
+        consume(TK_IDENTIFIER, "Expect superclass name.");
+        variable(false);
+
+        if (identifiers_equal(&class_name, &parser.prev))
+        {
+            error_at_prev("A class cannot inherit from itself.");
+        }
+
+        // Methods reach the superclass through a local that's never reassigned, so they capture
+        // it by value.
+        begin_scope();
+        add_local(synthetic_token("super"));
+        define_variable(0);
+
+        named_variable(class_name, false);
+        emit_1_byte(OP_INHERIT);
+        class_compiler.has_superclass = true;
+    }
+
+    // The class stays on the stack while its methods are attached.
+    named_variable(class_name, false);
     consume(TK_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TK_RIGHT_BRACE) && !check(TK_EOF))
+    {
+        method();
+    }
     consume(TK_RIGHT_BRACE, "Expect '}' after class body.");
+    emit_1_byte(OP_POP);
+
+    if (class_compiler.has_superclass)
+    {
+        end_scope();
+    }
+
+    current_class = current_class->enclosing;
 }
 
 static void fun_declaration()
 {
-    uint8_t global = parse_variable("Expect function name.");
+    int global = parse_variable("Expect function name.");
+    Token name = parser.prev;
     mark_initialized();
-    function(TYPE_FUNCTION);
+    if (current->scope_depth > 0)
+    {
+        current->function_slot = current->local_count - 1;
+    }
+    ObjFunction *body = function(TYPE_FUNCTION);
+    current->function_slot = -1;
+
+    // Top-level functions can only be inlined when no other script can redefine them later.
+    if (vm->opt_level > 0 && !parser.had_error && can_inline(body) && !is_assigned(current, &name))
+    {
+        if (current->scope_depth > 0)
+        {
+            current->locals[current->local_count - 1].function = body;
+        }
+        else if (vm->whole_program)
+        {
+            ObjString *key = copy_string(name.start, name.length);
+            push(OBJ_VAL(key));
+            table_put(&current->inlinable, key, OBJ_VAL(body));
+            pop();
+        }
+    }
+
     define_variable(global);
 }
 
 static void var_declaration()
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
+    Token name = parser.prev;
+    int initializer_start = curr_chunk()->count;
 
     if (match(TK_EQUAL))
     {
@@ -808,6 +1723,16 @@ static void var_declaration()
 
     consume(TK_SEMICOLON, "Expect ';' after variable declaration.");
 
+    Value value;
+    if (current->scope_depth > 0 && !parser.had_error &&
+        read_constant(initializer_start, curr_chunk()->count, &value) &&
+        !is_assigned(current, &name))
+    {
+        Local *local = &current->locals[current->local_count - 1];
+        local->is_constant = true;
+        local->value = value;
+    }
+
     define_variable(global);
 }
 
@@ -818,41 +1743,268 @@ static void expression_statement()
     emit_1_byte(OP_POP);
 }
 
+// Classifies the code in [start, end) as a loop limit. It has to be a single expression made of
+// loads and arithmetic, which can then be evaluated anywhere the counter is in scope.
+static LimitKind classify_limit(int start, int end, int counter)
+{
+    Chunk *chunk = curr_chunk();
+    LimitKind kind = LIMIT_INVARIANT;
+    int depth = 0;
+
+    for (int offset = start; offset < end; offset += instr_length(chunk, offset))
+    {
+        int operands = 0;
+
+        switch (chunk->code[offset])
+        {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            break;
+        case OP_GET_LOCAL:
+        {
+            uint8_t slot = chunk->code[offset + 1];
+            if (slot == counter || is_assigned(current, &current->locals[slot].name))
+            {
+                kind = kind > LIMIT_VARIABLE ? kind : LIMIT_VARIABLE;
+            }
+            break;
+        }
+        case OP_GET_GLOBAL:
+            kind = kind > LIMIT_GLOBAL ? kind : LIMIT_GLOBAL;
+            break;
+        case OP_GET_UPVALUE:
+            kind = LIMIT_VARIABLE;
+            break;
+        case OP_GET_PROPERTY:
+            kind = LIMIT_VARIABLE;
+            operands = 1;
+            break;
+        case OP_NEGATE:
+            operands = 1;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            operands = 2;
+            break;
+        default:
+            return LIMIT_NONE;
+        }
+
+        if (depth < operands)
+        {
+            return LIMIT_NONE;
+        }
+        depth += stack_effect(chunk, offset);
+    }
+
+    return depth == 1 ? kind : LIMIT_NONE;
+}
+
+// Whether the code from start on could change a global.
+static bool may_set_globals(int start)
+{
+    Chunk *chunk = curr_chunk();
+    for (int offset = start; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        uint8_t op = chunk->code[offset] == OP_WIDE ? chunk->code[offset + 1] : chunk->code[offset];
+        if (op == OP_CALL || op == OP_TAIL_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE ||
+            op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Recognizes 'for (var i = ...; i < limit; i = i + step)' and the like from the code compiled
+// for its clauses, and recompiles the loop around OP_FOR_PREP and OP_FOR_ITER. The limit goes
+// into a hidden local next to the counter. If the limit can change while the loop runs, the
+// loop is rotated instead so it's still evaluated before every iteration.
+static bool counted_for(int counter, int condition_start, int condition_end, int increment_start)
+{
+    Chunk *chunk = curr_chunk();
+    uint8_t *increment = &chunk->code[increment_start];
+
+    // The increment, its pop and the loop back to the condition.
+    if (chunk->count != increment_start + 11 || increment[0] != OP_GET_LOCAL || increment[1] != counter ||
+        increment[2] != OP_CONSTANT || !IS_NUMBER(chunk->constants.values[increment[3]]) ||
+        (increment[4] != OP_ADD && increment[4] != OP_SUB) || increment[5] != OP_SET_LOCAL ||
+        increment[6] != counter)
+    {
+        return false;
+    }
+
+    int last = -1;
+    int before_last = -1;
+    for (int offset = condition_start; offset < condition_end; offset += instr_length(chunk, offset))
+    {
+        before_last = last;
+        last = offset;
+    }
+
+    int compare = last;
+    bool is_negated = false;
+    if (last >= 0 && chunk->code[last] == OP_NOT)
+    {
+        compare = before_last;
+        is_negated = true;
+    }
+    if (compare < 0 || (chunk->code[compare] != OP_LESS && chunk->code[compare] != OP_GREATER) ||
+        chunk->code[condition_start] != OP_GET_LOCAL || chunk->code[condition_start + 1] != counter)
+    {
+        return false;
+    }
+
+    int limit_start = condition_start + 2;
+    int limit_length = compare - limit_start;
+    LimitKind limit = classify_limit(limit_start, compare, counter);
+    if (limit == LIMIT_NONE || limit_length > UINT8_COUNT)
+    {
+        return false;
+    }
+
+    uint8_t kind;
+    if (chunk->code[compare] == OP_LESS)
+    {
+        kind = is_negated ? FOR_GREATER_EQUAL : FOR_LESS;
+    }
+    else
+    {
+        kind = is_negated ? FOR_LESS_EQUAL : FOR_GREATER;
+    }
+    if (increment[4] == OP_SUB)
+    {
+        kind |= FOR_SUBTRACT;
+    }
+
+    uint8_t limit_code[UINT8_COUNT];
+    int limit_lines[UINT8_COUNT];
+    for (int i = 0; i < limit_length; ++i)
+    {
+        limit_code[i] = chunk->code[limit_start + i];
+        limit_lines[i] = get_line_no(chunk, limit_start + i);
+    }
+
+    uint8_t increment_code[8];
+    memcpy(increment_code, increment, sizeof(increment_code));
+    int condition_line = get_line_no(chunk, condition_start);
+    int increment_line = get_line_no(chunk, increment_start);
+    uint8_t compare_code[2] = {chunk->code[compare], OP_NOT};
+
+    truncate_chunk(chunk, condition_start);
+
+    for (int i = 0; i < limit_length; ++i)
+    {
+        append_to_chunk(chunk, limit_code[i], limit_lines[i]);
+    }
+    Token hidden = {TK_IDENTIFIER, "", 0, condition_line};
+    add_local(hidden);
+    mark_initialized();
+
+    append_to_chunk(chunk, OP_FOR_PREP, condition_line);
+    append_to_chunk(chunk, counter, condition_line);
+    append_to_chunk(chunk, kind, condition_line);
+    append_to_chunk(chunk, 0xff, condition_line);
+    append_to_chunk(chunk, 0xff, condition_line);
+    int exit_jump = chunk->count - 2;
+
+    int body_start = chunk->count;
+    statement();
+
+    if (limit == LIMIT_GLOBAL && may_set_globals(body_start))
+    {
+        limit = LIMIT_VARIABLE;
+    }
+
+    if (limit == LIMIT_VARIABLE)
+    {
+        for (int i = 0; i < (int)sizeof(increment_code); ++i)
+        {
+            append_to_chunk(chunk, increment_code[i], increment_line);
+        }
+        append_to_chunk(chunk, OP_GET_LOCAL, condition_line);
+        append_to_chunk(chunk, counter, condition_line);
+        for (int i = 0; i < limit_length; ++i)
+        {
+            append_to_chunk(chunk, limit_code[i], limit_lines[i]);
+        }
+        for (int i = 0; i < (is_negated ? 2 : 1); ++i)
+        {
+            append_to_chunk(chunk, compare_code[i], condition_line);
+        }
+
+        int tail_exit = emit_jump(OP_JUMP_IF_FALSE);
+        emit_1_byte(OP_POP);
+        emit_loop(body_start);
+        patch_jump(tail_exit);
+        emit_1_byte(OP_POP);
+    }
+    else
+    {
+        int offset = chunk->count + 6 - body_start;
+        if (offset > UINT16_MAX)
+        {
+            error_at_curr("Loop body too large.");
+        }
+
+        append_to_chunk(chunk, OP_FOR_ITER, increment_line);
+        append_to_chunk(chunk, counter, increment_line);
+        append_to_chunk(chunk, kind, increment_line);
+        append_to_chunk(chunk, increment_code[3], increment_line);
+        append_to_chunk(chunk, (offset >> 8) & 0xff, increment_line);
+        append_to_chunk(chunk, offset & 0xff, increment_line);
+    }
+
+    patch_jump(exit_jump);
+    return true;
+}
+
 static void for_statement()
 {
     begin_scope();
 
     consume(TK_LEFT_PAREN, "Expect '(' after 'for'.");
 
+    int counter = -1;
     if (match(TK_SEMICOLON))
     {
     }
     else if (match(TK_VAR))
     {
         var_declaration();
+        counter = current->local_count - 1;
     }
     else
     {
         expression_statement();
     }
 
-    int loop_start = curr_chunk()->count;
+    int condition_start = curr_chunk()->count;
+    int condition_end = -1;
+    int loop_start = condition_start;
 
     int exit_jump = -1;
     if (!match(TK_SEMICOLON))
     {
         expression();
+        condition_end = curr_chunk()->count;
         consume(TK_SEMICOLON, "Expect ';' after loop condition.");
 
         exit_jump = emit_jump(OP_JUMP_IF_FALSE);
         emit_1_byte(OP_POP);
     }
 
+    int increment_start = -1;
     if (!match(TK_RIGHT_PAREN))
     {
         int body_jump = emit_jump(OP_JUMP);
 
-        int increment_start = curr_chunk()->count;
+        increment_start = curr_chunk()->count;
         expression();
         emit_1_byte(OP_POP);
         consume(TK_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -862,6 +2014,13 @@ static void for_statement()
         patch_jump(body_jump);
     }
 
+    if (counter >= 0 && condition_end >= 0 && increment_start >= 0 && !parser.had_error &&
+        counted_for(counter, condition_start, condition_end, increment_start))
+    {
+        end_scope();
+        return;
+    }
+
     statement();
 
     emit_loop(loop_start);
@@ -914,12 +2073,34 @@ static void return_statement()
 
     if (match(TK_SEMICOLON))
     {
-        emit_2_byte(OP_NIL, OP_RETURN);
+        emit_return();
         return;
     }
 
+    if (current->type == TYPE_INITIALIZER)
+    {
+        error_at_curr("Cannot return a value from an initializer.");
+    }
+
     expression();
     consume(TK_SEMICOLON, "Expect ';' after return value.");
+
+    // A call whose result is returned right away can reuse this function's frame. The return
+    // stays behind it for callees that aren't closures.
+    Chunk *chunk = curr_chunk();
+    int call = current->last_call;
+    if (call == -1)
+    {
+        // No call has been compiled yet.
+    }
+    else if (call == chunk->count - 2 && chunk->code[call] == OP_CALL)
+    {
+        chunk->code[call] = OP_TAIL_CALL;
+    }
+    else if (call == chunk->count - 4 && chunk->code[call] == OP_WIDE && chunk->code[call + 1] == OP_CALL)
+    {
+        chunk->code[call + 1] = OP_TAIL_CALL;
+    }
     emit_1_byte(OP_RETURN);
 }
 
@@ -971,8 +2152,16 @@ static void synchronize()
     }
 }
 
+static void begin_statement()
+{
+    current->stmt_start = curr_chunk()->count;
+    current->stmt_depth = current->local_count;
+}
+
 static void declaration()
 {
+    begin_statement();
+
     if (match(TK_CLASS))
     {
         class_declaration();
@@ -998,6 +2187,8 @@ static void declaration()
 
 static void statement()
 {
+    begin_statement();
+
     if (match(TK_PRINT))
     {
         print_statement();
@@ -1030,17 +2221,21 @@ static void statement()
     }
 }
 
-ObjFunction *compile(const char *source)
+ObjFunction *compile(const char *source, size_t length, int line_no)
 {
-    init_scanner(source);
+    init_scanner(source, length, line_no);
+    source_start = source;
+    source_length = length;
+    source_string = NULL;
 
     Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+    init_compiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.had_error = false;
     parser.in_panic_mode = false;
 
     advance();
+    begin_body(&compiler);
 
     while (!match(TK_EOF))
     {
@@ -1048,15 +2243,68 @@ ObjFunction *compile(const char *source)
     }
 
     ObjFunction *function = end_compiler();
+    source_string = NULL;
     return parser.had_error ? NULL : function;
 }
 
+// Compiles the parameters and body of a function that was left for its first call. Methods get
+// a class to compile in, though not its superclass, since bodies using 'super' are never left.
+bool compile_body(ObjFunction *function)
+{
+    source_start = function->source->chars;
+    source_length = (size_t)function->source->length;
+    source_string = function->source;
+    init_scanner(source_start + function->source_offset, source_length - function->source_offset,
+                 function->source_line);
+
+    parser.had_error = false;
+    parser.in_panic_mode = false;
+    advance();
+
+    FunctionType type = TYPE_FUNCTION;
+    ClassCompiler class_compiler = {NULL, false};
+    if (function->is_method)
+    {
+        bool is_init = function->name->length == 4 && memcmp(function->name->chars, "init", 4) == 0;
+        type = is_init ? TYPE_INITIALIZER : TYPE_METHOD;
+        current_class = &class_compiler;
+    }
+
+    Compiler compiler;
+    init_compiler(&compiler, type, function);
+    function_body(&compiler);
+    end_compiler();
+
+    current_class = NULL;
+    source_string = NULL;
+
+    if (parser.had_error)
+    {
+        free_chunk(&function->chunk);
+        function->arity = 0;
+        return false;
+    }
+
+    function->source = NULL;
+    return true;
+}
+
 void mark_compiler_roots()
 {
+    mark_obj((Obj *)source_string);
     Compiler *compiler = current;
     while (compiler != NULL)
     {
         mark_obj((Obj *)compiler->function);
+        mark_table(&compiler->assigned);
+        mark_table(&compiler->inlinable);
+        for (int i = 0; i < compiler->local_count; ++i)
+        {
+            if (compiler->locals[i].is_constant)
+            {
+                mark_value(compiler->locals[i].value);
+            }
+        }
         compiler = compiler->enclosing;
     }
 }
@@ -4,7 +4,8 @@
 #include "obj.h"
 #include "vm.h"
 
-ObjFunction *compile(const char *source);
+ObjFunction *compile(const char *source, size_t length, int line_no);
+bool compile_body(ObjFunction *function);
 void mark_compiler_roots();
 
 #endif
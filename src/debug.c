@@ -12,13 +12,58 @@ void disassemble_chunk(Chunk *chunk, const char *name)
     }
 }
 
-static int constant_instr(const char *name, Chunk *chunk, int offset)
+// Reads the operand at *at and moves past it. Behind OP_WIDE it's two bytes instead of one.
+static int read_operand(Chunk *chunk, int *at, bool is_wide)
 {
-    uint8_t constant = chunk->code[offset + 1];
+    int operand = chunk->code[(*at)++];
+    if (is_wide)
+    {
+        operand = (operand << 8) | chunk->code[(*at)++];
+    }
+    return operand;
+}
+
+static int constant_instr(const char *name, Chunk *chunk, int offset, bool is_wide)
+{
+    int at = offset + 1 + is_wide;
+    int constant = read_operand(chunk, &at, is_wide);
     printf("%-16s %4d '", name, constant);
     print_value(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return at;
+}
+
+static int invoke_instr(const char *name, Chunk *chunk, int offset, bool is_wide)
+{
+    int at = offset + 1 + is_wide;
+    int constant = read_operand(chunk, &at, is_wide);
+    int arg_count = read_operand(chunk, &at, is_wide);
+    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return at;
+}
+
+static int super_invoke_instr(const char *name, Chunk *chunk, int offset, bool is_wide)
+{
+    int at = offset + 1 + is_wide;
+    int constant = read_operand(chunk, &at, is_wide);
+    int arg_count = read_operand(chunk, &at, is_wide);
+    uint8_t cache = chunk->code[at++];
+    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return at;
+}
+
+static int hoisted_instr(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t slot = chunk->code[offset + 2];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' in %d\n", slot);
+    return offset + 3;
 }
 
 static int simple_instr(const char *name, int offset)
@@ -27,11 +72,12 @@ static int simple_instr(const char *name, int offset)
     return offset + 1;
 }
 
-static int byte_instr(const char *name, Chunk *chunk, int offset)
+static int byte_instr(const char *name, Chunk *chunk, int offset, bool is_wide)
 {
-    uint8_t slot = chunk->code[offset + 1];
+    int at = offset + 1 + is_wide;
+    int slot = read_operand(chunk, &at, is_wide);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return at;
 }
 
 static int jump_instr(const char *name, int sign, Chunk *chunk, int offset)
@@ -42,24 +88,52 @@ static int jump_instr(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int for_instr(const char *name, int sign, Chunk *chunk, int offset)
+{
+    int length = chunk->code[offset] == OP_FOR_ITER ? 6 : 5;
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t kind = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + length - 2] << 8);
+    jump |= chunk->code[offset + length - 1];
+
+    static const char *comparisons[] = {"<", "<=", ">", ">="};
+    printf("%-16s %4d %s ", name, slot, comparisons[kind & 3]);
+    if (length == 6)
+    {
+        printf("%c= '", kind & FOR_SUBTRACT ? '-' : '+');
+        print_value(chunk->constants.values[chunk->code[offset + 3]]);
+        printf("' ");
+    }
+    printf("-> %d\n", offset + length + sign * jump);
+    return offset + length;
+}
+
 int disassemble_instr(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->line_nos[offset] == chunk->line_nos[offset - 1])
+    int line_no = get_line_no(chunk, offset);
+    if (offset > 0 && line_no == get_line_no(chunk, offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", chunk->line_nos[offset]);
+        printf("%4d ", line_no);
     }
 
     uint8_t instr = chunk->code[offset];
+    bool is_wide = instr == OP_WIDE;
+    if (is_wide)
+    {
+        printf("OP_WIDE ");
+        instr = chunk->code[offset + 1];
+    }
+
     switch (instr)
     {
     case OP_CONSTANT:
-        return constant_instr("OP_CONSTANT", chunk, offset);
+        return constant_instr("OP_CONSTANT", chunk, offset, is_wide);
     case OP_NIL:
         return simple_instr("OP_NIL", offset);
     case OP_TRUE:
@@ -69,23 +143,27 @@ int disassemble_instr(Chunk *chunk, int offset)
     case OP_POP:
         return simple_instr("OP_POP", offset);
     case OP_GET_LOCAL:
-        return byte_instr("OP_GET_LOCAL", chunk, offset);
+        return byte_instr("OP_GET_LOCAL", chunk, offset, is_wide);
     case OP_SET_LOCAL:
-        return byte_instr("OP_SET_LOCAL", chunk, offset);
+        return byte_instr("OP_SET_LOCAL", chunk, offset, is_wide);
     case OP_GET_GLOBAL:
-        return constant_instr("OP_GET_GLOBAL", chunk, offset);
+        return constant_instr("OP_GET_GLOBAL", chunk, offset, is_wide);
     case OP_DEFINE_GLOBAL:
-        return simple_instr("OP_DEFINE_GLOBAL", offset);
+        return constant_instr("OP_DEFINE_GLOBAL", chunk, offset, is_wide);
     case OP_SET_GLOBAL:
-        return constant_instr("OP_SET_GLOBAL", chunk, offset);
+        return constant_instr("OP_SET_GLOBAL", chunk, offset, is_wide);
     case OP_GET_UPVALUE:
-        return byte_instr("OP_GET_UPVALUE", chunk, offset);
+        return byte_instr("OP_GET_UPVALUE", chunk, offset, is_wide);
     case OP_SET_UPVALUE:
-        return byte_instr("OP_SET_UPVALUE", chunk, offset);
+        return byte_instr("OP_SET_UPVALUE", chunk, offset, is_wide);
+    case OP_GET_CAPTURE:
+        return byte_instr("OP_GET_CAPTURE", chunk, offset, is_wide);
+    case OP_GET_HOISTED:
+        return hoisted_instr("OP_GET_HOISTED", chunk, offset);
     case OP_GET_PROPERTY:
-        return constant_instr("OP_GET_PROPERTY", chunk, offset);
+        return constant_instr("OP_GET_PROPERTY", chunk, offset, is_wide);
     case OP_SET_PROPERTY:
-        return constant_instr("OP_SET_PROPERTY", chunk, offset);
+        return constant_instr("OP_SET_PROPERTY", chunk, offset, is_wide);
     case OP_EQUAL:
         return simple_instr("OP_EQUAL", offset);
     case OP_GREATER:
@@ -104,6 +182,20 @@ int disassemble_instr(Chunk *chunk, int offset)
         return simple_instr("OP_NOT", offset);
     case OP_NEGATE:
         return simple_instr("OP_NEGATE", offset);
+    case OP_ADD_NUM:
+        return simple_instr("OP_ADD_NUM", offset);
+    case OP_SUB_NUM:
+        return simple_instr("OP_SUB_NUM", offset);
+    case OP_MUL_NUM:
+        return simple_instr("OP_MUL_NUM", offset);
+    case OP_DIV_NUM:
+        return simple_instr("OP_DIV_NUM", offset);
+    case OP_GREATER_NUM:
+        return simple_instr("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simple_instr("OP_LESS_NUM", offset);
+    case OP_NEGATE_NUM:
+        return simple_instr("OP_NEGATE_NUM", offset);
     case OP_PRINT:
         return simple_instr("OP_PRINT", offset);
     case OP_JUMP:
@@ -112,11 +204,22 @@ int disassemble_instr(Chunk *chunk, int offset)
         return jump_instr("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
         return jump_instr("OP_LOOP", -1, chunk, offset);
+    case OP_FOR_PREP:
+        return for_instr("OP_FOR_PREP", 1, chunk, offset);
+    case OP_FOR_ITER:
+        return for_instr("OP_FOR_ITER", -1, chunk, offset);
     case OP_CALL:
-        return byte_instr("OP_CALL", chunk, offset);
+        return byte_instr("OP_CALL", chunk, offset, is_wide);
+    case OP_TAIL_CALL:
+        return byte_instr("OP_TAIL_CALL", chunk, offset, is_wide);
+    case OP_INVOKE:
+        return invoke_instr("OP_INVOKE", chunk, offset, is_wide);
+    case OP_SUPER_INVOKE:
+        return super_invoke_instr("OP_SUPER_INVOKE", chunk, offset, is_wide);
     case OP_CLOSURE:
-        ++offset;
-        uint8_t constant = chunk->code[offset++];
+    {
+        int at = offset + 1 + is_wide;
+        int constant = read_operand(chunk, &at, is_wide);
         printf("%-16s %4d ", "OP_CLOSURE", constant);
         print_value(chunk->constants.values[constant]);
         printf("\n");
@@ -125,18 +228,35 @@ int disassemble_instr(Chunk *chunk, int offset)
 
         for (int i = 0; i < function->upvalue_count; ++i)
         {
-            int is_local = chunk->code[offset++];
-            int index = chunk->code[offset++];
-            printf("%04d      |                    %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
+            int start = at;
+            int is_local = chunk->code[at++];
+            int index = read_operand(chunk, &at, is_wide);
+            printf("%04d      |                    %s %d\n", start, is_local ? "local" : "upvalue", index);
+        }
+        for (int i = 0; i < function->capture_count; ++i)
+        {
+            int start = at;
+            int is_local = chunk->code[at++];
+            int index = read_operand(chunk, &at, is_wide);
+            printf("%04d      |                    copy %s %d\n", start, is_local ? "local" : "capture", index);
         }
 
-        return offset;
+        return at;
+    }
     case OP_CLOSE_UPVALUE:
         return simple_instr("OP_CLOSE_UPVALUE", offset);
+    case OP_UNWIND:
+        return byte_instr("OP_UNWIND", chunk, offset, is_wide);
     case OP_RETURN:
         return simple_instr("OP_RETURN", offset);
     case OP_CLASS:
-        return constant_instr("OP_CLASS", chunk, offset);
+        return constant_instr("OP_CLASS", chunk, offset, is_wide);
+    case OP_INHERIT:
+        return simple_instr("OP_INHERIT", offset);
+    case OP_METHOD:
+        return constant_instr("OP_METHOD", chunk, offset, is_wide);
+    case OP_GET_SUPER:
+        return constant_instr("OP_GET_SUPER", chunk, offset, is_wide);
     default:
         printf("Unknown opcode %d\n", instr);
         return offset + 1;
@@ -0,0 +1,759 @@
+#define _GNU_SOURCE
+
+#include "io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "memory.h"
+#include "native.h"
+#include "vm.h"
+
+#define READ_CHUNK 65536
+
+void init_io(IoLoop *io)
+{
+    io->epoll_fd = -1;
+    io->parked = NULL;
+    io->parked_count = 0;
+    io->parked_capacity = 0;
+    io->ready_head = 0;
+    io->ready_count = 0;
+    io->main_parked = false;
+    io->main_idle = false;
+    io->awaited = NULL;
+}
+
+void free_io()
+{
+    if (vm->io.epoll_fd != -1)
+    {
+        close(vm->io.epoll_fd);
+    }
+    free(vm->io.parked);
+}
+
+void mark_io_roots()
+{
+    IoLoop *io = &vm->io;
+    for (int i = 0; i < io->parked_count; ++i)
+    {
+        mark_obj((Obj *)io->parked[i]);
+    }
+    for (int i = io->ready_head; i < io->ready_count; ++i)
+    {
+        mark_obj((Obj *)io->ready[i].stream);
+    }
+    mark_obj((Obj *)io->awaited);
+}
+
+void close_stream(ObjStream *stream)
+{
+    if (stream->read_fd != -1)
+    {
+        close(stream->read_fd);
+    }
+    if (stream->write_fd != -1 && stream->write_fd != stream->read_fd)
+    {
+        close(stream->write_fd);
+    }
+    stream->read_fd = -1;
+    stream->write_fd = -1;
+}
+
+// Registers a descriptor with the VM's epoll instance, for edges only, since every operation
+// tries its system call before it parks. Regular files can't be polled, and never block anyway.
+static void watch(ObjStream *stream, int fd, uint32_t events)
+{
+    if (vm->io.epoll_fd == -1)
+    {
+        vm->io.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    struct epoll_event event;
+    event.events = events | EPOLLET;
+    event.data.ptr = stream;
+    epoll_ctl(vm->io.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Pipes and sockets report a closed other end through their writes' results instead.
+static void ignore_sigpipe()
+{
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static ObjStream *open_socket(int fd)
+{
+    ignore_sigpipe();
+    ObjStream *stream = new_stream(fd, fd);
+    watch(stream, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    return stream;
+}
+
+static void add_parked(ObjStream *stream)
+{
+    IoLoop *io = &vm->io;
+    if (stream->parked_index != -1)
+    {
+        return;
+    }
+
+    if (io->parked_count == io->parked_capacity)
+    {
+        io->parked_capacity = GROW_CAPACITY(io->parked_capacity);
+        io->parked = realloc(io->parked, sizeof(ObjStream *) * io->parked_capacity);
+    }
+    stream->parked_index = io->parked_count;
+    io->parked[io->parked_count++] = stream;
+}
+
+// Takes the stream off the parked ones once nothing is parked on either side.
+static void remove_parked(ObjStream *stream)
+{
+    IoLoop *io = &vm->io;
+    if (stream->reader.parked || stream->writer.parked || stream->parked_index == -1)
+    {
+        return;
+    }
+
+    ObjStream *last = io->parked[--io->parked_count];
+    io->parked[stream->parked_index] = last;
+    last->parked_index = stream->parked_index;
+    stream->parked_index = -1;
+}
+
+// Parks what's running on a side of the stream until the event loop finds that side ready.
+static void park(ObjStream *stream, bool writing)
+{
+    Waiter *waiter = writing ? &stream->writer : &stream->reader;
+    waiter->parked = true;
+    waiter->fiber = vm->fiber;
+    add_parked(stream);
+
+    if (vm->fiber == NULL)
+    {
+        vm->io.main_parked = true;
+    }
+    park_running();
+}
+
+// Drops what the VM's own stacks were parked on, once an error has unwound them.
+void unpark_main()
+{
+    IoLoop *io = &vm->io;
+    if (!io->main_parked)
+    {
+        return;
+    }
+
+    for (int i = io->parked_count - 1; i >= 0; --i)
+    {
+        ObjStream *stream = io->parked[i];
+        if (stream->reader.parked && stream->reader.fiber == NULL)
+        {
+            stream->reader.parked = false;
+        }
+        if (stream->writer.parked && stream->writer.fiber == NULL)
+        {
+            stream->writer.parked = false;
+            stream->out = NULL;
+        }
+        remove_parked(stream);
+    }
+
+    io->main_parked = false;
+    io->main_idle = false;
+    io->awaited = NULL;
+}
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// The operations below each return false if they'd block, and otherwise finish with the result
+// for whatever started them.
+
+// Reads whatever there is, up to a chunk. The result is nil at the end of the stream, or on an
+// error.
+static bool try_read(ObjStream *stream, Value *result)
+{
+    char buffer[READ_CHUNK];
+    ssize_t count;
+    do
+    {
+        count = read(stream->read_fd, buffer, sizeof(buffer));
+    } while (count == -1 && errno == EINTR);
+
+    if (count == -1 && would_block())
+    {
+        return false;
+    }
+    *result = count > 0 ? OBJ_VAL(copy_string(buffer, (int)count)) : NIL_VAL;
+    return true;
+}
+
+// The result is the new connection's stream, or nil on an error.
+static bool try_accept(ObjStream *listener, Value *result)
+{
+    int fd;
+    do
+    {
+        fd = accept4(listener->read_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd == -1 && (errno == EINTR || errno == ECONNABORTED));
+
+    if (fd == -1 && would_block())
+    {
+        return false;
+    }
+    *result = fd != -1 ? OBJ_VAL(open_socket(fd)) : NIL_VAL;
+    return true;
+}
+
+// Writes what's left of the stream's pending output. The result is true once it's all written,
+// or false on an error.
+static bool try_write(ObjStream *stream, Value *result)
+{
+    ObjString *out = stream->out;
+    while (stream->out_offset < out->length)
+    {
+        ssize_t count = write(stream->write_fd, out->chars + stream->out_offset,
+                              (size_t)(out->length - stream->out_offset));
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count == -1 && would_block())
+        {
+            return false;
+        }
+        if (count == -1)
+        {
+            break;
+        }
+        stream->out_offset += (int)count;
+    }
+
+    *result = BOOLEAN_VAL(stream->out_offset == out->length);
+    stream->out = NULL;
+    return true;
+}
+
+// Only called once epoll has reported the socket writable. The result is the stream, or nil if
+// the connection failed.
+static bool try_connect(ObjStream *stream, Value *result)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(stream->write_fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+    {
+        error = errno;
+    }
+
+    stream->connecting = false;
+    *result = error == 0 ? OBJ_VAL(stream) : NIL_VAL;
+    return true;
+}
+
+static bool try_operation(ObjStream *stream, bool writing, Value *result)
+{
+    if (writing)
+    {
+        return stream->connecting ? try_connect(stream, result) : try_write(stream, result);
+    }
+    return stream->listening ? try_accept(stream, result) : try_read(stream, result);
+}
+
+// Waits for events, and queues the parked sides they make ready.
+static void poll_events()
+{
+    IoLoop *io = &vm->io;
+    struct epoll_event events[EVENT_BATCH];
+    int count = epoll_wait(io->epoll_fd, events, EVENT_BATCH, -1);
+
+    io->ready_head = 0;
+    io->ready_count = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        ObjStream *stream = events[i].data.ptr;
+        uint32_t flags = events[i].events;
+        if (stream->reader.parked && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        {
+            io->ready[io->ready_count++] = (Ready){stream, false};
+        }
+        if (stream->writer.parked && (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+        {
+            io->ready[io->ready_count++] = (Ready){stream, true};
+        }
+    }
+}
+
+// Picks what runs next while the VM's own stacks are parked: whatever was parked on the first
+// side found ready, with its operation's result. Blocks until there's something.
+void wait_for_io(ObjFiber **fiber, Value *value)
+{
+    IoLoop *io = &vm->io;
+    while (true)
+    {
+        // wait() is over once nothing else could run.
+        if (io->main_idle &&
+            (io->parked_count == 0 || (io->awaited != NULL && io->awaited->state == FIBER_DONE)))
+        {
+            io->main_parked = false;
+            io->main_idle = false;
+            io->awaited = NULL;
+            *fiber = NULL;
+            *value = NIL_VAL;
+            return;
+        }
+
+        while (io->ready_head < io->ready_count)
+        {
+            Ready ready = io->ready[io->ready_head++];
+            Waiter *waiter = ready.writing ? &ready.stream->writer : &ready.stream->reader;
+            // Readiness can be spurious, so a side that would still block stays parked.
+            if (!waiter->parked || !try_operation(ready.stream, ready.writing, value))
+            {
+                continue;
+            }
+
+            *fiber = waiter->fiber;
+            waiter->parked = false;
+            waiter->fiber = NULL;
+            remove_parked(ready.stream);
+
+            if (*fiber == NULL)
+            {
+                io->main_parked = false;
+            }
+            else
+            {
+                (*fiber)->state = FIBER_RUNNING;
+                (*fiber)->caller = NULL;
+            }
+            return;
+        }
+
+        poll_events();
+    }
+}
+
+// Does an operation right away if it can be done, or parks until it can. Either way the native
+// returns, and what runs next gets the result.
+static bool start_operation(ObjStream *stream, bool writing, Value *args)
+{
+    Value result;
+    if (try_operation(stream, writing, &result))
+    {
+        args[-1] = result;
+        return true;
+    }
+
+    args[-1] = NIL_VAL;
+    park(stream, writing);
+    return true;
+}
+
+static bool stream_arg(const char *name, Value *args, int index, ObjStream **stream)
+{
+    if (!IS_STREAM(args[index]))
+    {
+        runtime_error("%s() expects a stream as argument %d.", name, index + 1);
+        return false;
+    }
+
+    *stream = AS_STREAM(args[index]);
+    return true;
+}
+
+// Strings can be views, which aren't NUL-terminated, so system calls get a copy.
+static char *c_string(ObjString *string)
+{
+    char *chars = malloc((size_t)string->length + 1);
+    memcpy(chars, string->chars, (size_t)string->length);
+    chars[string->length] = '\0';
+    return chars;
+}
+
+static bool address_args(const char *name, Value *args, char **host, char *port)
+{
+    if (!IS_STRING(args[0]))
+    {
+        runtime_error("%s() expects a string as argument 1.", name);
+        return false;
+    }
+    if (!IS_NUMBER(args[1]) || !is_int(AS_NUMBER(args[1])) || AS_NUMBER(args[1]) < 0 ||
+        AS_NUMBER(args[1]) > 65535)
+    {
+        runtime_error("%s() expects a port number as argument 2.", name);
+        return false;
+    }
+
+    *host = c_string(AS_STRING(args[0]));
+    snprintf(port, 8, "%d", (int)AS_NUMBER(args[1]));
+    return true;
+}
+
+// Looks the host up, which blocks: resolvers have no descriptor to poll.
+static struct addrinfo *resolve(const char *host, const char *port, int flags)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    struct addrinfo *addresses;
+    return getaddrinfo(host, port, &hints, &addresses) == 0 ? addresses : NULL;
+}
+
+// openFile(path, mode) opens a file to read ("r"), write ("w") or append to ("a"). Returns nil if
+// it can't be opened.
+bool open_file_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("openFile", arg_count, 2, 2))
+    {
+        return false;
+    }
+    if (!IS_STRING(args[0]))
+    {
+        runtime_error("openFile() expects a string as argument 1.");
+        return false;
+    }
+
+    ObjString *mode = IS_STRING(args[1]) ? AS_STRING(args[1]) : NULL;
+    int flags;
+    if (mode != NULL && mode->length == 1 && mode->chars[0] == 'r')
+    {
+        flags = O_RDONLY;
+    }
+    else if (mode != NULL && mode->length == 1 && mode->chars[0] == 'w')
+    {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    else if (mode != NULL && mode->length == 1 && mode->chars[0] == 'a')
+    {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    else
+    {
+        runtime_error("openFile() expects \"r\", \"w\" or \"a\" as argument 2.");
+        return false;
+    }
+
+    char *path = c_string(AS_STRING(args[0]));
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    free(path);
+
+    args[-1] = NIL_VAL;
+    if (fd != -1)
+    {
+        bool reading = flags == O_RDONLY;
+        ObjStream *stream = new_stream(reading ? fd : -1, reading ? -1 : fd);
+        watch(stream, fd, reading ? EPOLLIN : EPOLLOUT);
+        args[-1] = OBJ_VAL(stream);
+    }
+    return true;
+}
+
+// pipe() makes a stream that reads back what's written to it.
+bool pipe_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("pipe", arg_count, 0, 0))
+    {
+        return false;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        runtime_error("Cannot open a pipe.");
+        return false;
+    }
+
+    ignore_sigpipe();
+    ObjStream *stream = new_stream(fds[0], fds[1]);
+    watch(stream, fds[0], EPOLLIN);
+    watch(stream, fds[1], EPOLLOUT);
+    args[-1] = OBJ_VAL(stream);
+    return true;
+}
+
+// listen(host, port) returns a stream to accept() TCP connections from, or nil. Port 0 picks a
+// free one, which localPort() tells.
+bool listen_native(int arg_count, Value *args)
+{
+    char *host;
+    char port[8];
+    if (!check_arg_count("listen", arg_count, 2, 2) || !address_args("listen", args, &host, port))
+    {
+        return false;
+    }
+
+    struct addrinfo *addresses = resolve(host, port, AI_PASSIVE);
+    free(host);
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address != NULL && fd == -1; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    address->ai_protocol);
+        int reuse = 1;
+        if (fd != -1 &&
+            (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+             bind(fd, address->ai_addr, address->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addresses != NULL)
+    {
+        freeaddrinfo(addresses);
+    }
+
+    args[-1] = NIL_VAL;
+    if (fd != -1)
+    {
+        ObjStream *stream = open_socket(fd);
+        stream->listening = true;
+        args[-1] = OBJ_VAL(stream);
+    }
+    return true;
+}
+
+// accept(listener) waits for the next connection and returns its stream.
+bool accept_native(int arg_count, Value *args)
+{
+    ObjStream *listener;
+    if (!check_arg_count("accept", arg_count, 1, 1) || !stream_arg("accept", args, 0, &listener))
+    {
+        return false;
+    }
+    if (!listener->listening || listener->read_fd == -1)
+    {
+        runtime_error("accept() expects a listening stream as argument 1.");
+        return false;
+    }
+    if (listener->reader.parked)
+    {
+        runtime_error("Cannot accept from a stream something else is waiting on.");
+        return false;
+    }
+
+    return start_operation(listener, false, args);
+}
+
+// connect(host, port) waits for a TCP connection and returns its stream, or nil.
+bool connect_native(int arg_count, Value *args)
+{
+    char *host;
+    char port[8];
+    if (!check_arg_count("connect", arg_count, 2, 2) || !address_args("connect", args, &host, port))
+    {
+        return false;
+    }
+
+    struct addrinfo *addresses = resolve(host, port, 0);
+    free(host);
+
+    int fd = -1;
+    bool pending = false;
+    for (struct addrinfo *address = addresses; address != NULL && fd == -1; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    address->ai_protocol);
+        if (fd != -1 && connect(fd, address->ai_addr, address->ai_addrlen) == -1)
+        {
+            pending = errno == EINPROGRESS;
+            if (!pending)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    if (addresses != NULL)
+    {
+        freeaddrinfo(addresses);
+    }
+
+    args[-1] = NIL_VAL;
+    if (fd == -1)
+    {
+        return true;
+    }
+
+    ObjStream *stream = open_socket(fd);
+    if (!pending)
+    {
+        args[-1] = OBJ_VAL(stream);
+        return true;
+    }
+    // A connection in progress reads as no error, so this can't try before it parks.
+    stream->connecting = true;
+    park(stream, true);
+    return true;
+}
+
+// localPort(stream) returns the port a socket is bound to, or nil for other streams.
+bool local_port_native(int arg_count, Value *args)
+{
+    ObjStream *stream;
+    if (!check_arg_count("localPort", arg_count, 1, 1) || !stream_arg("localPort", args, 0, &stream))
+    {
+        return false;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    args[-1] = NIL_VAL;
+    if (stream->read_fd != -1 &&
+        getsockname(stream->read_fd, (struct sockaddr *)&address, &length) == 0)
+    {
+        if (address.ss_family == AF_INET)
+        {
+            args[-1] = NUMBER_VAL(ntohs(((struct sockaddr_in *)&address)->sin_port));
+        }
+        else if (address.ss_family == AF_INET6)
+        {
+            args[-1] = NUMBER_VAL(ntohs(((struct sockaddr_in6 *)&address)->sin6_port));
+        }
+    }
+    return true;
+}
+
+// read(stream) waits for data and returns what there is of it as a string, or nil at the end of
+// the stream.
+bool read_native(int arg_count, Value *args)
+{
+    ObjStream *stream;
+    if (!check_arg_count("read", arg_count, 1, 1) || !stream_arg("read", args, 0, &stream))
+    {
+        return false;
+    }
+    if (stream->listening || stream->read_fd == -1)
+    {
+        runtime_error("Cannot read from a stream that isn't open for reading.");
+        return false;
+    }
+    if (stream->reader.parked)
+    {
+        runtime_error("Cannot read from a stream something else is waiting to read.");
+        return false;
+    }
+
+    return start_operation(stream, false, args);
+}
+
+// write(stream, string) waits until all of the string is written. Returns false if it can't be.
+bool write_native(int arg_count, Value *args)
+{
+    ObjStream *stream;
+    if (!check_arg_count("write", arg_count, 2, 2) || !stream_arg("write", args, 0, &stream))
+    {
+        return false;
+    }
+    if (!IS_STRING(args[1]))
+    {
+        runtime_error("write() expects a string as argument 2.");
+        return false;
+    }
+    if (stream->listening || stream->write_fd == -1)
+    {
+        runtime_error("Cannot write to a stream that isn't open for writing.");
+        return false;
+    }
+    if (stream->writer.parked)
+    {
+        runtime_error("Cannot write to a stream something else is waiting to write to.");
+        return false;
+    }
+
+    stream->out = AS_STRING(args[1]);
+    stream->out_offset = 0;
+    return start_operation(stream, true, args);
+}
+
+// shutdown(stream) stops writing to it, so the other end reads the end of the stream.
+bool shutdown_native(int arg_count, Value *args)
+{
+    ObjStream *stream;
+    if (!check_arg_count("shutdown", arg_count, 1, 1) || !stream_arg("shutdown", args, 0, &stream))
+    {
+        return false;
+    }
+    if (stream->writer.parked)
+    {
+        runtime_error("Cannot shut down a stream something is waiting to write to.");
+        return false;
+    }
+
+    if (stream->write_fd == stream->read_fd)
+    {
+        shutdown(stream->write_fd, SHUT_WR);
+    }
+    else if (stream->write_fd != -1)
+    {
+        close(stream->write_fd);
+    }
+    stream->write_fd = -1;
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+bool close_native(int arg_count, Value *args)
+{
+    ObjStream *stream;
+    if (!check_arg_count("close", arg_count, 1, 1) || !stream_arg("close", args, 0, &stream))
+    {
+        return false;
+    }
+    if (stream->reader.parked || stream->writer.parked)
+    {
+        runtime_error("Cannot close a stream something is waiting on.");
+        return false;
+    }
+
+    close_stream(stream);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// wait(fiber) runs the event loop until the fiber has finished, or without one, until nothing is
+// parked on I/O any more. Either way it stops once nothing parked is left to run.
+bool wait_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("wait", arg_count, 0, 1))
+    {
+        return false;
+    }
+    if (arg_count == 1 && !IS_FIBER(args[0]))
+    {
+        runtime_error("wait() expects a fiber as argument 1.");
+        return false;
+    }
+    if (vm->fiber != NULL)
+    {
+        runtime_error("Cannot wait() inside a fiber.");
+        return false;
+    }
+
+    args[-1] = NIL_VAL;
+    ObjFiber *awaited = arg_count == 1 ? AS_FIBER(args[0]) : NULL;
+    if (vm->io.parked_count > 0 && (awaited == NULL || awaited->state != FIBER_DONE))
+    {
+        vm->io.main_parked = true;
+        vm->io.main_idle = true;
+        vm->io.awaited = awaited;
+        park_running();
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef CLOX_IO_H
+#define CLOX_IO_H
+
+#include "common.h"
+#include "obj.h"
+#include "value.h"
+
+#define EVENT_BATCH 64
+
+// A side of a parked stream that epoll reported ready.
+typedef struct
+{
+    ObjStream *stream;
+    bool writing;
+} Ready;
+
+// Each VM's event loop. It only runs while the VM's own stacks are parked, and resumes whatever
+// is parked on a stream once the stream is ready.
+typedef struct
+{
+    // Opened with the first stream that can be polled.
+    int epoll_fd;
+    // The streams something is parked on, which keeps them and what's parked alive.
+    ObjStream **parked;
+    int parked_count;
+    int parked_capacity;
+    // What the last poll found, from ready_head on.
+    Ready ready[2 * EVENT_BATCH];
+    int ready_head;
+    int ready_count;
+    // Whether the VM's own stacks are parked, on a stream or, when idle is set, in wait(). That
+    // waits for the awaited fiber to finish, if there is one.
+    bool main_parked;
+    bool main_idle;
+    ObjFiber *awaited;
+} IoLoop;
+
+void init_io(IoLoop *io);
+void free_io();
+void mark_io_roots();
+void close_stream(ObjStream *stream);
+void unpark_main();
+void wait_for_io(ObjFiber **fiber, Value *value);
+
+bool open_file_native(int arg_count, Value *args);
+bool pipe_native(int arg_count, Value *args);
+bool listen_native(int arg_count, Value *args);
+bool accept_native(int arg_count, Value *args);
+bool connect_native(int arg_count, Value *args);
+bool local_port_native(int arg_count, Value *args);
+bool read_native(int arg_count, Value *args);
+bool write_native(int arg_count, Value *args);
+bool shutdown_native(int arg_count, Value *args);
+bool close_native(int arg_count, Value *args);
+bool wait_native(int arg_count, Value *args);
+
+#endif
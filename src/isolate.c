@@ -0,0 +1,340 @@
+#define _DEFAULT_SOURCE
+
+#include "isolate.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "native.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// A copy of a value made by write_copy(), waiting in a channel.
+typedef struct Message
+{
+    struct Message *next;
+    uint8_t *bytes;
+    size_t count;
+} Message;
+
+// An intrusive queue that senders never lock: each one swaps its message in at head, then links
+// the message that was there to it. Receivers take messages off at tail, one at a time. The stub
+// stays in the queue so it's never empty of nodes.
+struct Channel
+{
+    Message *head;
+    Message *tail;
+    Message stub;
+    // Receivers sleep on this while there's nothing to take. Sends bump it, and so does each
+    // receive, for receivers that found another one taking its turn.
+    uint32_t version;
+    int sleepers;
+    bool receiving;
+    int refs;
+};
+
+// A closure and its arguments, copied with the globals, and the channel its result goes to.
+typedef struct
+{
+    Writer copy;
+    Channel *result;
+} Isolate;
+
+static void wake(Channel *channel)
+{
+    __atomic_add_fetch(&channel->version, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&channel->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        syscall(SYS_futex, &channel->version, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Returns as soon as the channel's version isn't seen, or a wake() comes.
+static void sleep_on(Channel *channel, uint32_t seen)
+{
+    __atomic_add_fetch(&channel->sleepers, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &channel->version, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(&channel->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void push_message(Channel *channel, Message *message)
+{
+    message->next = NULL;
+    Message *prev = __atomic_exchange_n(&channel->head, message, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, message, __ATOMIC_RELEASE);
+}
+
+// Returns NULL when the queue is empty, or when the next message's sender hasn't linked it yet.
+static Message *pop_message(Channel *channel)
+{
+    Message *tail = channel->tail;
+    Message *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &channel->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        channel->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL)
+    {
+        channel->tail = next;
+        return tail;
+    }
+
+    // The last message can only be taken once the stub is queued behind it.
+    if (tail != __atomic_load_n(&channel->head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    push_message(channel, &channel->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        channel->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static Message *take_message(Channel *channel)
+{
+    while (true)
+    {
+        uint32_t seen = __atomic_load_n(&channel->version, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_exchange_n(&channel->receiving, true, __ATOMIC_ACQUIRE))
+        {
+            Message *message = pop_message(channel);
+            __atomic_store_n(&channel->receiving, false, __ATOMIC_RELEASE);
+            if (message != NULL)
+            {
+                wake(channel);
+                return message;
+            }
+        }
+
+        sleep_on(channel, seen);
+    }
+}
+
+Channel *open_channel()
+{
+    Channel *channel = malloc(sizeof(Channel));
+    channel->stub.next = NULL;
+    channel->head = &channel->stub;
+    channel->tail = &channel->stub;
+    channel->version = 0;
+    channel->sleepers = 0;
+    channel->receiving = false;
+    channel->refs = 1;
+    return channel;
+}
+
+void retain_channel(Channel *channel)
+{
+    __atomic_add_fetch(&channel->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Messages nobody received are dropped with the channel.
+void release_channel(Channel *channel)
+{
+    if (__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+
+    Message *message;
+    while ((message = pop_message(channel)) != NULL)
+    {
+        release_copy(message->bytes, message->count);
+        free(message->bytes);
+        free(message);
+    }
+    free(channel);
+}
+
+// Queues a copy made by write_copy(), taking over its bytes.
+void send_copy(Channel *channel, Writer *copy)
+{
+    Message *message = malloc(sizeof(Message));
+    message->bytes = copy->bytes;
+    message->count = copy->count;
+    push_message(channel, message);
+    wake(channel);
+}
+
+// Fails when the value reaches a function whose body doesn't compile.
+bool send_value(Channel *channel, Value value)
+{
+    Writer writer;
+    init_writer(&writer);
+    if (!write_copy(&writer, &value, 1, NULL))
+    {
+        free_writer(&writer);
+        return false;
+    }
+
+    send_copy(channel, &writer);
+    return true;
+}
+
+// Waits for a message and copies its value into this VM.
+bool receive_value(Channel *channel, Value *value)
+{
+    Message *message = take_message(channel);
+
+    Reader reader;
+    init_reader(&reader, message->bytes, message->count);
+    int count;
+    bool copied = read_copy(&reader, &count);
+    release_copy(message->bytes, message->count);
+    free(message->bytes);
+    free(message);
+
+    if (!copied || count != 1)
+    {
+        return false;
+    }
+    *value = pop();
+    return true;
+}
+
+// Runs in the isolate's own thread, with its own VM. A call that fails reports its error and
+// sends nil.
+static void *run_isolate(void *arg)
+{
+    Isolate *isolate = arg;
+    Vm own;
+    init_vm(&own);
+
+    Reader reader;
+    init_reader(&reader, isolate->copy.bytes, isolate->copy.count);
+    int count;
+    Value result = NIL_VAL;
+    if (read_copy(&reader, &count) && call_function(count - 1, &result) != INTERPRET_OK)
+    {
+        result = NIL_VAL;
+    }
+
+    if (!send_value(isolate->result, result))
+    {
+        send_value(isolate->result, NIL_VAL);
+    }
+
+    free_vm();
+    release_channel(isolate->result);
+    release_copy(isolate->copy.bytes, isolate->copy.count);
+    free_writer(&isolate->copy);
+    free(isolate);
+    return NULL;
+}
+
+// spawn(fn, args...) calls fn with the arguments in a new isolate on a thread of its own. The
+// isolate starts with copies of the globals and the arguments. Returns a channel the result is
+// sent to.
+bool spawn_native(int arg_count, Value *args)
+{
+    if (arg_count == 0 || !IS_CLOSURE(args[0]))
+    {
+        runtime_error("spawn() expects a function as argument 1.");
+        return false;
+    }
+
+    Isolate *isolate = malloc(sizeof(Isolate));
+    init_writer(&isolate->copy);
+    if (!write_copy(&isolate->copy, args, arg_count, &vm->globals))
+    {
+        free_writer(&isolate->copy);
+        free(isolate);
+        runtime_error("Cannot copy the function to a new isolate.");
+        return false;
+    }
+
+    ObjChannel *result = new_channel(open_channel());
+    args[-1] = OBJ_VAL(result);
+    isolate->result = result->channel;
+    retain_channel(isolate->result);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int failed = pthread_create(&thread, &attr, run_isolate, isolate);
+    pthread_attr_destroy(&attr);
+
+    if (failed)
+    {
+        release_channel(isolate->result);
+        release_copy(isolate->copy.bytes, isolate->copy.count);
+        free_writer(&isolate->copy);
+        free(isolate);
+        runtime_error("Cannot start a new isolate.");
+        return false;
+    }
+    return true;
+}
+
+bool channel_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("channel", arg_count, 0, 0))
+    {
+        return false;
+    }
+
+    args[-1] = OBJ_VAL(new_channel(open_channel()));
+    return true;
+}
+
+bool send_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("send", arg_count, 2, 2))
+    {
+        return false;
+    }
+    if (!IS_CHANNEL(args[0]))
+    {
+        runtime_error("send() expects a channel as argument 1.");
+        return false;
+    }
+
+    if (!send_value(AS_CHANNEL(args[0]), args[1]))
+    {
+        runtime_error("Cannot copy the value to another isolate.");
+        return false;
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+bool receive_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("receive", arg_count, 1, 1))
+    {
+        return false;
+    }
+    if (!IS_CHANNEL(args[0]))
+    {
+        runtime_error("receive() expects a channel as argument 1.");
+        return false;
+    }
+
+    Value value;
+    if (!receive_value(AS_CHANNEL(args[0]), &value))
+    {
+        runtime_error("Cannot copy the value from another isolate.");
+        return false;
+    }
+    // Reading the copy can grow the stack, which moves the arguments.
+    vm->stack_top[-1 - arg_count] = value;
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef CLOX_ISOLATE_H
+#define CLOX_ISOLATE_H
+
+#include "common.h"
+#include "obj.h"
+#include "serialize.h"
+#include "value.h"
+
+Channel *open_channel();
+void retain_channel(Channel *channel);
+void release_channel(Channel *channel);
+void send_copy(Channel *channel, Writer *copy);
+bool send_value(Channel *channel, Value value);
+bool receive_value(Channel *channel, Value *value);
+
+bool spawn_native(int arg_count, Value *args);
+bool channel_native(int arg_count, Value *args);
+bool send_native(int arg_count, Value *args);
+bool receive_native(int arg_count, Value *args);
+
+#endif
@@ -1,10 +1,47 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "scanner.h"
+#include "snapshot.h"
 #include "vm.h"
 
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+typedef struct
+{
+    char *buffer;
+    size_t capacity;
+    size_t length;
+    size_t scanned;
+    int depth;
+    size_t boundary;
+    int line_no;
+} Stream;
+
+static void check_result(InterpretResult result)
+{
+    if (result == INTERPRET_COMPILE_ERROR)
+    {
+        exit(65);
+    }
+    if (result == INTERPRET_RUNTIME_ERROR)
+    {
+        exit(70);
+    }
+}
+
 static void repl()
 {
     char line[1024];
@@ -18,65 +55,310 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        interpret(line, strlen(line), 1);
+    }
+}
+
+// Scans the buffered input for the last point where a top-level declaration ends: a ';' or '}'
+// with no open brackets that is followed by a complete token other than 'else'. Scanning resumes
+// at the last token start of the previous call, since that token may have been cut by the chunk.
+static void find_boundary(Stream *stream)
+{
+    init_scanner(stream->buffer + stream->scanned, stream->length - stream->scanned, 1);
+
+    const char *end = stream->buffer + stream->length;
+    int depth = stream->depth;
+    bool closes_declaration = false;
+
+    while (true)
+    {
+        Token token = scan_token();
+
+        // Error tokens don't point into the buffer; anything after one waits for the final segment.
+        if (token.type == TK_EOF || token.type == TK_ERROR || token.start + token.length >= end)
+        {
+            break;
+        }
+
+        if (closes_declaration && token.type != TK_ELSE)
+        {
+            stream->boundary = token.start - stream->buffer;
+        }
+
+        stream->scanned = token.start + token.length - stream->buffer;
+
+        switch (token.type)
+        {
+        case TK_LEFT_PAREN:
+        case TK_LEFT_BRACE:
+            ++depth;
+            break;
+        case TK_RIGHT_PAREN:
+        case TK_RIGHT_BRACE:
+            --depth;
+            break;
+        default:
+            break;
+        }
+        stream->depth = depth;
+
+        closes_declaration = depth == 0 && (token.type == TK_SEMICOLON || token.type == TK_RIGHT_BRACE);
+    }
+}
+
+static void run_segment(Stream *stream, size_t length)
+{
+    char saved = stream->buffer[length];
+    stream->buffer[length] = '\0';
+    check_result(interpret(stream->buffer, length, stream->line_no));
+    stream->buffer[length] = saved;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        stream->line_no += stream->buffer[i] == '\n';
+    }
+
+    memmove(stream->buffer, stream->buffer + length, stream->length - length + 1);
+    stream->length -= length;
+    stream->scanned = stream->scanned > length ? stream->scanned - length : 0;
+    stream->boundary = 0;
+}
+
+// Compiles and runs input from a pipe one top-level declaration group at a time, so only the
+// declaration currently being read needs to be buffered.
+static void run_stream(FILE *file)
+{
+    Stream stream = {NULL, 0, 0, 0, 0, 0, 1};
+
+    while (true)
+    {
+        if (stream.capacity < stream.length + STREAM_CHUNK_SIZE + 1)
+        {
+            stream.capacity = (stream.length + STREAM_CHUNK_SIZE + 1) * 2;
+            stream.buffer = realloc(stream.buffer, stream.capacity);
+        }
+
+        size_t bytes_read = fread(stream.buffer + stream.length, sizeof(char), STREAM_CHUNK_SIZE, file);
+        stream.length += bytes_read;
+        stream.buffer[stream.length] = '\0';
+
+        if (bytes_read == 0)
+        {
+            run_segment(&stream, stream.length);
+            break;
+        }
+
+        find_boundary(&stream);
+        if (stream.boundary > 0)
+        {
+            run_segment(&stream, stream.boundary);
+        }
     }
+
+    free(stream.buffer);
 }
 
-static char *read_file(const char *path)
+// Maps the script read-only so the scanner reads it in place. The mapping is laid over a
+// reserved region one byte longer than the file, so there's always a zero byte past the end
+// even when the file fills its last page exactly.
+static char *map_file(int fd, size_t size)
 {
-    FILE *file = fopen(path, "rb");
+    char *region = mmap(NULL, size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
 
-    if (file == NULL)
+    if (size > 0 && mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(region, size + 1);
+        return NULL;
+    }
+
+    return region;
+}
+
+// Runs the script from the bytecode cache kept next to it, compiling it and writing the cache
+// first when there's none for this exact source. The cache for 'script.lox' is 'script.loxc'.
+// It only holds bytecode, so nothing is left to be compiled lazily.
+static InterpretResult run_cached(const char *path, const char *source, size_t size)
+{
+    vm->lazy = false;
+
+    size_t length = strlen(path);
+    char *cache_path = malloc(length + 2);
+    memcpy(cache_path, path, length);
+    cache_path[length] = 'c';
+    cache_path[length + 1] = '\0';
+
+    ObjFunction *function = load_cache(cache_path, source, size);
+    if (function == NULL)
+    {
+        function = compile(source, size, 1);
+        if (function != NULL)
+        {
+            save_cache(cache_path, source, size, function);
+        }
+    }
+    free(cache_path);
+
+    return function != NULL ? interpret_function(function) : INTERPRET_COMPILE_ERROR;
+}
+
+// Runs the script in the file. Unless it is being saved into an image, nothing else can redefine
+// its functions, so the compiler may treat it as the whole program.
+static void run_file(const char *path, bool use_cache, bool saving_image)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd == -1 || fstat(fd, &info) == -1)
     {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+    if (!S_ISREG(info.st_mode))
+    {
+        FILE *file = fdopen(fd, "rb");
+        run_stream(file);
+        fclose(file);
+        return;
+    }
+
+    size_t size = (size_t)info.st_size;
+    char *source = map_file(fd, size);
+    close(fd);
 
-    char *buffer = (char *)malloc(file_size + 1);
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    buffer[bytes_read] = '\0';
+    if (source == NULL)
+    {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
 
-    fclose(file);
-    return buffer;
+    vm->whole_program = !saving_image;
+    InterpretResult result = use_cache ? run_cached(path, source, size) : interpret(source, size, 1);
+    munmap(source, size + 1);
+    check_result(result);
 }
 
-static void run_file(const char *path)
+// Compiles the script and writes it out as a C program instead of running it.
+static void emit_file(const char *path, const char *c_path)
 {
-    char *source = read_file(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    int fd = open(path, O_RDONLY);
+    struct stat info;
 
-    if (result == INTERPRET_COMPILE_ERROR)
+    if (fd == -1 || fstat(fd, &info) == -1 || !S_ISREG(info.st_mode))
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    size_t size = (size_t)info.st_size;
+    char *source = map_file(fd, size);
+    close(fd);
+
+    if (source == NULL)
+    {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+
+    vm->whole_program = true;
+    vm->lazy = false;
+    ObjFunction *function = compile(source, size, 1);
+    munmap(source, size + 1);
+
+    if (function == NULL)
     {
         exit(65);
     }
-    if (result == INTERPRET_RUNTIME_ERROR)
+    if (!emit_c(c_path, function))
     {
-        exit(70);
+        fprintf(stderr, "Could not write file \"%s\".\n", c_path);
+        exit(74);
     }
 }
 
 int main(int argc, char **argv)
 {
-    init_vm();
+    Vm main_vm;
+    init_vm(&main_vm);
 
-    if (argc == 1)
+    int arg = 1;
+    bool use_cache = false;
+    const char *image_path = NULL;
+    const char *snapshot_path = NULL;
+    const char *c_path = NULL;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; ++arg)
+    {
+        if (strcmp(argv[arg], "-O") == 0)
+        {
+            vm->opt_level = 1;
+        }
+        else if (strcmp(argv[arg], "--cache") == 0)
+        {
+            use_cache = true;
+        }
+        else if (strcmp(argv[arg], "--lazy") == 0)
+        {
+            vm->lazy = true;
+        }
+        else if (strcmp(argv[arg], "--type-stats") == 0)
+        {
+            vm->type_stats = true;
+        }
+        else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+        {
+            image_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc)
+        {
+            snapshot_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc)
+        {
+            c_path = argv[++arg];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (image_path != NULL && !load_snapshot(image_path))
+    {
+        fprintf(stderr, "Could not load image \"%s\".\n", image_path);
+        exit(74);
+    }
+
+    if (c_path != NULL && argc == arg + 1)
+    {
+        emit_file(argv[arg], c_path);
+    }
+    else if (argc == arg)
     {
         repl();
     }
-    else if (argc == 2)
+    else if (argc == arg + 1 && strcmp(argv[arg], "-") == 0)
+    {
+        run_stream(stdin);
+    }
+    else if (argc == arg + 1)
     {
-        run_file(argv[1]);
+        run_file(argv[arg], use_cache, snapshot_path != NULL);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [-O] [--cache] [--lazy] [--type-stats] [--image file] [--snapshot file] [--emit-c file] [path | -]\n");
         exit(64);
     }
 
+    if (snapshot_path != NULL && !save_snapshot(snapshot_path))
+    {
+        fprintf(stderr, "Could not write image \"%s\".\n", snapshot_path);
+        exit(74);
+    }
+
     free_vm();
 }
@@ -1,6 +1,9 @@
 #include "memory.h"
 #include <stdlib.h>
 #include "compiler.h"
+#include "io.h"
+#include "isolate.h"
+#include "snapshot.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
@@ -12,18 +15,18 @@
 
 void *reallocate(void *arr, size_t old_capacity, size_t new_capacity)
 {
-    vm.bytes_allocated += new_capacity - old_capacity;
+    vm->bytes_allocated += new_capacity - old_capacity;
 
     if (new_capacity > old_capacity)
     {
 #ifdef DEBUG_STRESS_GC
         collect_garbage();
 #endif
-    }
 
-    if (vm.bytes_allocated > vm.next_gc)
-    {
-        collect_garbage();
+        if (vm->bytes_allocated > vm->next_gc)
+        {
+            collect_garbage();
+        }
     }
 
     if (new_capacity == 0)
@@ -50,13 +53,13 @@ void mark_obj(Obj *obj)
 
     obj->is_marked = true;
 
-    if (vm.gray_capacity < vm.gray_count + 1)
+    if (vm->gray_capacity < vm->gray_count + 1)
     {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack = realloc(vm.gray_stack, sizeof(Obj *) * vm.gray_capacity);
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack = realloc(vm->gray_stack, sizeof(Obj *) * vm->gray_capacity);
     }
 
-    vm.gray_stack[vm.gray_count++] = obj;
+    vm->gray_stack[vm->gray_count++] = obj;
 }
 
 void mark_value(Value value)
@@ -77,6 +80,31 @@ static void mark_array(ValueArray *array)
     }
 }
 
+static void mark_stacks(CallFrame *frames, int frame_count, Value *stack, Value *stack_top,
+                        ObjUpvalue *open_upvalues)
+{
+    for (Value *slot = stack; slot < stack_top; ++slot)
+    {
+        mark_value(*slot);
+    }
+
+    for (int i = 0; i < frame_count; ++i)
+    {
+        mark_obj((Obj *)frames[i].closure);
+    }
+
+    for (ObjUpvalue *upvalue = open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        mark_obj((Obj *)upvalue);
+    }
+}
+
+static void mark_context(Context *context)
+{
+    mark_stacks(context->frames, context->frame_count, context->stack, context->stack_top,
+                context->open_upvalues);
+}
+
 static void blacken_obj(Obj *obj)
 {
 #ifdef DEBUG_LOG_GC
@@ -86,10 +114,18 @@ static void blacken_obj(Obj *obj)
 #endif
     switch (obj->type)
     {
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        mark_value(bound->receiver);
+        mark_obj((Obj *)bound->method);
+        break;
+    }
     case OBJ_CLASS:
     {
         ObjClass *klass = (ObjClass *)obj;
         mark_obj((Obj *)klass->name);
+        mark_table(&klass->methods);
         break;
     }
     case OBJ_CLOSURE:
@@ -100,27 +136,73 @@ static void blacken_obj(Obj *obj)
         {
             mark_obj((Obj *)closure->upvalues[i]);
         }
+        for (int i = 0; i < closure->capture_count; ++i)
+        {
+            mark_value(closure->captures[i]);
+        }
+        break;
+    }
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)obj;
+        mark_value(fiber->function);
+        mark_obj((Obj *)fiber->caller);
+        // The running fiber's stacks are the VM's, which are roots.
+        if (fiber != vm->fiber)
+        {
+            mark_context(&fiber->context);
+        }
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)obj;
         mark_obj((Obj *)function->name);
+        mark_obj((Obj *)function->source);
         mark_array(&function->chunk.constants);
+        for (int i = 0; i < function->chunk.cache_count; ++i)
+        {
+            mark_obj(function->chunk.caches[i].klass);
+            mark_obj(function->chunk.caches[i].method);
+        }
+        for (int i = 0; i < function->chunk.site_count; ++i)
+        {
+            mark_obj((Obj *)function->chunk.sites[i].name);
+        }
         break;
     }
     case OBJ_INSTANCE:
     {
         ObjInstance *instance = (ObjInstance *)obj;
         mark_obj((Obj *)instance->klass);
+        table_compact(&instance->fields);
         mark_table(&instance->fields);
         break;
     }
     case OBJ_UPVALUE:
-        mark_value(((ObjUpvalue *)obj)->closed);
+    {
+        ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+        mark_value(upvalue->closed);
+        // An open upvalue keeps the stack it points into alive.
+        if (upvalue->location != &upvalue->closed)
+        {
+            mark_obj((Obj *)upvalue->fiber);
+        }
         break;
-    case OBJ_NATIVE:
+    }
+    case OBJ_STREAM:
+    {
+        ObjStream *stream = (ObjStream *)obj;
+        mark_obj((Obj *)stream->reader.fiber);
+        mark_obj((Obj *)stream->writer.fiber);
+        mark_obj((Obj *)stream->out);
+        break;
+    }
     case OBJ_STRING:
+        mark_obj((Obj *)((ObjString *)obj)->owner);
+        break;
+    case OBJ_CHANNEL:
+    case OBJ_NATIVE:
         break;
     }
 }
@@ -129,12 +211,33 @@ static void free_obj(Obj *obj)
 {
     switch (obj->type)
     {
+    case OBJ_BOUND_METHOD:
+        FREE(obj, ObjBoundMethod);
+        break;
+    case OBJ_CHANNEL:
+        release_channel(((ObjChannel *)obj)->channel);
+        FREE(obj, ObjChannel);
+        break;
     case OBJ_CLASS:
+        free_table(&((ObjClass *)obj)->methods);
         FREE(obj, ObjClass);
         break;
     case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        FREE_ARRAY(closure->upvalues, ObjUpvalue *, closure->upvalue_count);
+        FREE_ARRAY(closure->captures, Value, closure->capture_count);
         FREE(obj, ObjClosure);
         break;
+    }
+    case OBJ_FIBER:
+    {
+        ObjFiber *fiber = (ObjFiber *)obj;
+        free(fiber->context.frames);
+        free(fiber->context.stack);
+        FREE(obj, ObjFiber);
+        break;
+    }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)obj;
@@ -150,53 +253,50 @@ static void free_obj(Obj *obj)
         break;
     }
     case OBJ_NATIVE:
-        FREE(obj, OBJ_NATIVE);
+        FREE(obj, ObjNative);
+        break;
+    case OBJ_STREAM:
+        close_stream((ObjStream *)obj);
+        FREE(obj, ObjStream);
         break;
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)obj;
-        FREE_ARRAY(string->chars, char, string->length + 1);
+        if (string->owner == NULL)
+        {
+            FREE_ARRAY(string->chars, char, string->length + 1);
+        }
         FREE(obj, ObjString);
         break;
     }
     case OBJ_UPVALUE:
-    {
-        ObjClosure *closure = (ObjClosure *)obj;
-        FREE_ARRAY(closure->upvalues, ObjUpvalue *, closure->upvalue_count);
-        FREE(obj, OBJ_UPVALUE);
+        FREE(obj, ObjUpvalue);
         break;
     }
-    }
-
-    free(vm.gray_stack);
 }
 
 static void mark_roots()
 {
-    for (Value *slot = vm.stack; slot < vm.stack_top; ++slot)
+    mark_stacks(vm->frames, vm->frame_count, vm->stack, vm->stack_top, vm->open_upvalues);
+    mark_obj((Obj *)vm->fiber);
+    if (vm->fiber != NULL)
     {
-        mark_value(*slot);
+        mark_context(&vm->main_context);
     }
 
-    for (int i = 0; i < vm.frame_count; ++i)
-    {
-        mark_obj((Obj *)vm.frames[i].closure);
-    }
-
-    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next)
-    {
-        mark_obj((Obj *)upvalue);
-    }
-
-    mark_table(&vm.globals);
+    table_compact(&vm->globals);
+    mark_table(&vm->globals);
     mark_compiler_roots();
+    mark_snapshot_roots();
+    mark_io_roots();
+    mark_obj((Obj *)vm->init_string);
 }
 
 static void trace_references()
 {
-    while (vm.gray_count > 0)
+    while (vm->gray_count > 0)
     {
-        Obj *obj = vm.gray_stack[--vm.gray_count];
+        Obj *obj = vm->gray_stack[--vm->gray_count];
         blacken_obj(obj);
     }
 }
@@ -204,13 +304,14 @@ static void trace_references()
 static void sweep()
 {
     Obj *previous = NULL;
-    Obj *obj = vm.objs;
+    Obj *obj = vm->objs;
     while (obj != NULL)
     {
         if (obj->is_marked)
         {
             obj->is_marked = false;
             previous = obj;
+            obj = obj->next;
         }
         else
         {
@@ -223,7 +324,7 @@ static void sweep()
             }
             else
             {
-                vm.objs = obj;
+                vm->objs = obj;
             }
 
             free_obj(unreached);
@@ -235,32 +336,35 @@ void collect_garbage()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    size_t before = vm->bytes_allocated;
 #endif
 
     mark_roots();
     trace_references();
-    table_remove_white(&vm.strings);
+    table_remove_white(&vm->strings);
+    table_compact(&vm->strings);
     sweep();
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %ld bytes (from %ld to %ld) next at %ld\n", before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+    printf("   collected %ld bytes (from %ld to %ld) next at %ld\n", before - vm->bytes_allocated, before, vm->bytes_allocated, vm->next_gc);
 #endif
 }
 
 void free_objs()
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void *)obj, obj->type);
-#endif
-    Obj *obj = vm.objs;
+    Obj *obj = vm->objs;
     while (obj != NULL)
     {
         Obj *next = obj->next;
+#ifdef DEBUG_LOG_GC
+        printf("%p free type %d\n", (void *)obj, obj->type);
+#endif
         free_obj(obj);
         obj = next;
     }
+
+    free(vm->gray_stack);
 }
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+
+#include "native.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "io.h"
+#include "isolate.h"
+#include "obj.h"
+#include "pool.h"
+#include "vm.h"
+
+#define NUMBER_BUFFER_MAX 64
+
+bool check_arg_count(const char *name, int arg_count, int min, int max)
+{
+    if (arg_count < min || arg_count > max)
+    {
+        if (min == max)
+        {
+            runtime_error("%s() expects %d arguments but got %d.", name, min, arg_count);
+        }
+        else
+        {
+            runtime_error("%s() expects %d to %d arguments but got %d.", name, min, max, arg_count);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static bool string_arg(const char *name, Value *args, int index, ObjString **string)
+{
+    if (!IS_STRING(args[index]))
+    {
+        runtime_error("%s() expects a string as argument %d.", name, index + 1);
+        return false;
+    }
+
+    *string = AS_STRING(args[index]);
+    return true;
+}
+
+// Checks the range before converting, since converting NaN, the infinities or anything else
+// outside an int is undefined.
+bool is_int(double number)
+{
+    return number >= INT_MIN && number <= INT_MAX && number == (int)number;
+}
+
+static bool index_arg(const char *name, Value *args, int index, int *result)
+{
+    if (!IS_NUMBER(args[index]) || !is_int(AS_NUMBER(args[index])))
+    {
+        runtime_error("%s() expects an integer as argument %d.", name, index + 1);
+        return false;
+    }
+
+    *result = (int)AS_NUMBER(args[index]);
+    return true;
+}
+
+// Returns the offset of the first occurrence of needle in haystack, or -1. glibc's memmem scans
+// for short needles with vector instructions and searches longer ones with the two-way
+// algorithm, so it stays linear where comparing at each candidate wouldn't.
+static int find(const char *haystack, int haystack_length, const char *needle, int needle_length)
+{
+    const char *found = memmem(haystack, haystack_length, needle, needle_length);
+    return found != NULL ? (int)(found - haystack) : -1;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool clock_native(int arg_count, Value *args)
+{
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+bool length_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    if (!check_arg_count("length", arg_count, 1, 1) ||
+        !string_arg("length", args, 0, &string))
+    {
+        return false;
+    }
+
+    args[-1] = NUMBER_VAL(string->length);
+    return true;
+}
+
+bool substring_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    int start;
+    int end;
+    if (!check_arg_count("substring", arg_count, 2, 3) ||
+        !string_arg("substring", args, 0, &string) ||
+        !index_arg("substring", args, 1, &start))
+    {
+        return false;
+    }
+
+    end = string->length;
+    if (arg_count == 3 && !index_arg("substring", args, 2, &end))
+    {
+        return false;
+    }
+
+    if (start < 0 || end > string->length || start > end)
+    {
+        runtime_error("Substring range [%d, %d) out of bounds for length %d.", start, end, string->length);
+        return false;
+    }
+
+    args[-1] = OBJ_VAL(view_string(string, start, end - start));
+    return true;
+}
+
+bool index_of_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    ObjString *needle;
+    int from = 0;
+    if (!check_arg_count("indexOf", arg_count, 2, 3) ||
+        !string_arg("indexOf", args, 0, &string) ||
+        !string_arg("indexOf", args, 1, &needle) ||
+        (arg_count == 3 && !index_arg("indexOf", args, 2, &from)))
+    {
+        return false;
+    }
+
+    if (from < 0 || from > string->length)
+    {
+        args[-1] = NUMBER_VAL(-1);
+        return true;
+    }
+
+    int index = find(string->chars + from, string->length - from, needle->chars, needle->length);
+    args[-1] = NUMBER_VAL(index == -1 ? -1 : from + index);
+    return true;
+}
+
+bool count_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    ObjString *needle;
+    if (!check_arg_count("count", arg_count, 2, 2) ||
+        !string_arg("count", args, 0, &string) ||
+        !string_arg("count", args, 1, &needle))
+    {
+        return false;
+    }
+
+    if (needle->length == 0)
+    {
+        runtime_error("count() expects a non-empty needle.");
+        return false;
+    }
+
+    int count = 0;
+    int offset = 0;
+    int index;
+    while ((index = find(string->chars + offset, string->length - offset, needle->chars, needle->length)) != -1)
+    {
+        ++count;
+        offset += index + needle->length;
+    }
+
+    args[-1] = NUMBER_VAL(count);
+    return true;
+}
+
+bool split_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    ObjString *separator;
+    int field;
+    if (!check_arg_count("split", arg_count, 3, 3) ||
+        !string_arg("split", args, 0, &string) ||
+        !string_arg("split", args, 1, &separator) ||
+        !index_arg("split", args, 2, &field))
+    {
+        return false;
+    }
+
+    if (separator->length == 0)
+    {
+        runtime_error("split() expects a non-empty separator.");
+        return false;
+    }
+
+    args[-1] = NIL_VAL;
+    if (field < 0)
+    {
+        return true;
+    }
+
+    int start = 0;
+    for (int i = 0; i < field; ++i)
+    {
+        int index = find(string->chars + start, string->length - start, separator->chars, separator->length);
+        if (index == -1)
+        {
+            return true;
+        }
+        start += index + separator->length;
+    }
+
+    int length = find(string->chars + start, string->length - start, separator->chars, separator->length);
+    if (length == -1)
+    {
+        length = string->length - start;
+    }
+
+    args[-1] = OBJ_VAL(view_string(string, start, length));
+    return true;
+}
+
+bool starts_with_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    ObjString *prefix;
+    if (!check_arg_count("startsWith", arg_count, 2, 2) ||
+        !string_arg("startsWith", args, 0, &string) ||
+        !string_arg("startsWith", args, 1, &prefix))
+    {
+        return false;
+    }
+
+    args[-1] = BOOLEAN_VAL(prefix->length <= string->length &&
+                           memcmp(string->chars, prefix->chars, prefix->length) == 0);
+    return true;
+}
+
+bool ends_with_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    ObjString *suffix;
+    if (!check_arg_count("endsWith", arg_count, 2, 2) ||
+        !string_arg("endsWith", args, 0, &string) ||
+        !string_arg("endsWith", args, 1, &suffix))
+    {
+        return false;
+    }
+
+    args[-1] = BOOLEAN_VAL(suffix->length <= string->length &&
+                           memcmp(string->chars + string->length - suffix->length, suffix->chars, suffix->length) == 0);
+    return true;
+}
+
+bool trim_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    if (!check_arg_count("trim", arg_count, 1, 1) ||
+        !string_arg("trim", args, 0, &string))
+    {
+        return false;
+    }
+
+    int start = 0;
+    int end = string->length;
+    while (start < end && is_space(string->chars[start]))
+    {
+        ++start;
+    }
+    while (end > start && is_space(string->chars[end - 1]))
+    {
+        --end;
+    }
+
+    args[-1] = OBJ_VAL(view_string(string, start, end - start));
+    return true;
+}
+
+bool parse_number_native(int arg_count, Value *args)
+{
+    ObjString *string;
+    if (!check_arg_count("parseNumber", arg_count, 1, 1) ||
+        !string_arg("parseNumber", args, 0, &string))
+    {
+        return false;
+    }
+
+    args[-1] = NIL_VAL;
+    if (string->length == 0 || string->length >= NUMBER_BUFFER_MAX)
+    {
+        return true;
+    }
+
+    // Views aren't NUL-terminated, so strtod needs its own copy.
+    char buffer[NUMBER_BUFFER_MAX];
+    memcpy(buffer, string->chars, string->length);
+    buffer[string->length] = '\0';
+
+    char *end;
+    double number = strtod(buffer, &end);
+    if (end == buffer + string->length)
+    {
+        args[-1] = NUMBER_VAL(number);
+    }
+
+    return true;
+}
+
+bool fiber_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("fiber", arg_count, 1, 1))
+    {
+        return false;
+    }
+    if (!IS_CLOSURE(args[0]) && !IS_BOUND_METHOD(args[0]))
+    {
+        runtime_error("fiber() expects a function as argument 1.");
+        return false;
+    }
+
+    args[-1] = OBJ_VAL(new_fiber(args[0]));
+    return true;
+}
+
+// resume(fiber, value) runs the fiber until it yields or returns, and returns what it yielded or
+// returned. The value, or nil, is what its yield() returns, or its function's argument the first
+// time.
+bool resume_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("resume", arg_count, 1, 2))
+    {
+        return false;
+    }
+    if (!IS_FIBER(args[0]))
+    {
+        runtime_error("resume() expects a fiber as argument 1.");
+        return false;
+    }
+
+    args[-1] = arg_count == 2 ? args[1] : NIL_VAL;
+    return resume_fiber(AS_FIBER(args[0]));
+}
+
+// yield(value) suspends the running fiber, and has the resume() that ran it return the value, or
+// nil.
+bool yield_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("yield", arg_count, 0, 1))
+    {
+        return false;
+    }
+
+    args[-1] = arg_count == 1 ? args[0] : NIL_VAL;
+    return yield_fiber();
+}
+
+bool is_done_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("isDone", arg_count, 1, 1))
+    {
+        return false;
+    }
+    if (!IS_FIBER(args[0]))
+    {
+        runtime_error("isDone() expects a fiber as argument 1.");
+        return false;
+    }
+
+    args[-1] = BOOLEAN_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+const NativeEntry natives[] = {
+    {"clock", clock_native},
+    {"length", length_native},
+    {"substring", substring_native},
+    {"indexOf", index_of_native},
+    {"count", count_native},
+    {"split", split_native},
+    {"startsWith", starts_with_native},
+    {"endsWith", ends_with_native},
+    {"trim", trim_native},
+    {"parseNumber", parse_number_native},
+    {"spawn", spawn_native},
+    {"channel", channel_native},
+    {"send", send_native},
+    {"receive", receive_native},
+    {"parallelMap", parallel_map_native},
+    {"fiber", fiber_native},
+    {"resume", resume_native},
+    {"yield", yield_native},
+    {"isDone", is_done_native},
+    {"openFile", open_file_native},
+    {"pipe", pipe_native},
+    {"listen", listen_native},
+    {"accept", accept_native},
+    {"connect", connect_native},
+    {"localPort", local_port_native},
+    {"read", read_native},
+    {"write", write_native},
+    {"shutdown", shutdown_native},
+    {"close", close_native},
+    {"wait", wait_native},
+};
+
+const int native_count = sizeof(natives) / sizeof(natives[0]);
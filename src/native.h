@@ -0,0 +1,36 @@
+#ifndef CLOX_NATIVE_H
+#define CLOX_NATIVE_H
+
+#include "common.h"
+#include "obj.h"
+#include "value.h"
+
+// The natives every VM starts with, under their global names.
+typedef struct
+{
+    const char *name;
+    NativeFn function;
+} NativeEntry;
+
+extern const NativeEntry natives[];
+extern const int native_count;
+
+bool check_arg_count(const char *name, int arg_count, int min, int max);
+bool is_int(double number);
+
+bool clock_native(int arg_count, Value *args);
+bool length_native(int arg_count, Value *args);
+bool substring_native(int arg_count, Value *args);
+bool index_of_native(int arg_count, Value *args);
+bool count_native(int arg_count, Value *args);
+bool split_native(int arg_count, Value *args);
+bool starts_with_native(int arg_count, Value *args);
+bool ends_with_native(int arg_count, Value *args);
+bool trim_native(int arg_count, Value *args);
+bool parse_number_native(int arg_count, Value *args);
+bool fiber_native(int arg_count, Value *args);
+bool resume_native(int arg_count, Value *args);
+bool yield_native(int arg_count, Value *args);
+bool is_done_native(int arg_count, Value *args);
+
+#endif
@@ -13,8 +13,8 @@ static Obj *allocate_obj(size_t size, ObjType type)
     Obj *obj = (Obj *)reallocate(NULL, 0, size);
     obj->type = type;
     obj->is_marked = false;
-    obj->next = vm.objs;
-    vm.objs = obj;
+    obj->next = vm->objs;
+    vm->objs = obj;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void *)obj, size, type);
@@ -23,13 +23,29 @@ static Obj *allocate_obj(size_t size, ObjType type)
     return obj;
 }
 
+ObjChannel *new_channel(Channel *channel)
+{
+    ObjChannel *handle = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    handle->channel = channel;
+    return handle;
+}
+
 ObjClass *new_class(ObjString *name)
 {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
+    init_table(&klass->methods);
     return klass;
 }
 
+ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method)
+{
+    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+    bound->receiver = receiver;
+    bound->method = method;
+    return bound;
+}
+
 ObjClosure *new_closure(ObjFunction *function)
 {
     ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalue_count);
@@ -39,20 +55,46 @@ ObjClosure *new_closure(ObjFunction *function)
         upvalues[i] = NULL;
     }
 
+    Value *captures = ALLOCATE(Value, function->capture_count);
+
+    for (int i = 0; i < function->capture_count; ++i)
+    {
+        captures[i] = NIL_VAL;
+    }
+
     ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    closure->captures = captures;
+    closure->capture_count = function->capture_count;
     return closure;
 }
 
+ObjFiber *new_fiber(Value function)
+{
+    ObjFiber *fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->function = function;
+    fiber->context = (Context){NULL, 0, 0, NULL, NULL, NULL, 0, NULL};
+    fiber->state = FIBER_NEW;
+    fiber->caller = NULL;
+    return fiber;
+}
+
 ObjFunction *new_function()
 {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
     function->arity = 0;
     function->upvalue_count = 0;
+    function->capture_count = 0;
+    function->max_stack = 0;
     function->name = NULL;
+    function->source = NULL;
+    function->source_offset = 0;
+    function->source_line = 0;
+    function->is_method = false;
+    function->aot = NULL;
     init_chunk(&function->chunk);
 
     return function;
@@ -73,15 +115,31 @@ ObjNative *new_native(NativeFn function)
     return native;
 }
 
+ObjStream *new_stream(int read_fd, int write_fd)
+{
+    ObjStream *stream = ALLOCATE_OBJ(ObjStream, OBJ_STREAM);
+    stream->read_fd = read_fd;
+    stream->write_fd = write_fd;
+    stream->listening = false;
+    stream->connecting = false;
+    stream->reader = (Waiter){false, NULL};
+    stream->writer = (Waiter){false, NULL};
+    stream->out = NULL;
+    stream->out_offset = 0;
+    stream->parked_index = -1;
+    return stream;
+}
+
 static ObjString *allocate_string(char *chars, int length, uint32_t hash)
 {
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->owner = NULL;
 
     push(OBJ_VAL(string));
-    table_put(&vm.strings, string, NIL_VAL);
+    table_put(&vm->strings, string, NIL_VAL);
     pop();
 
     return string;
@@ -104,7 +162,7 @@ ObjString *take_string(char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
 
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL)
     {
         FREE_ARRAY(chars, char, length + 1);
@@ -118,7 +176,7 @@ ObjString *copy_string(const char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
 
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL)
     {
         return interned;
@@ -131,12 +189,30 @@ ObjString *copy_string(const char *chars, int length)
     return allocate_string(heap_chars, length, hash);
 }
 
+ObjString *view_string(ObjString *string, int start, int length)
+{
+    const char *chars = string->chars + start;
+    uint32_t hash = hash_string(chars, length);
+
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
+    if (interned != NULL)
+    {
+        return interned;
+    }
+
+    ObjString *owner = string->owner != NULL ? string->owner : string;
+    ObjString *view = allocate_string((char *)chars, length, hash);
+    view->owner = owner;
+    return view;
+}
+
 ObjUpvalue *new_upvalue(Value *slot)
 {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->fiber = NULL;
     return upvalue;
 }
 
@@ -147,30 +223,42 @@ static void print_function(ObjFunction *function)
         printf("<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    printf("<fn %.*s>", function->name->length, function->name->chars);
 }
 
 void print_obj(Value value)
 {
     switch (OBJ_TYPE(value))
     {
+    case OBJ_BOUND_METHOD:
+        print_function(AS_BOUND_METHOD(value)->method->function);
+        break;
+    case OBJ_CHANNEL:
+        printf("<channel>");
+        break;
     case OBJ_CLASS:
-        printf("%s", AS_CLASS(value)->name->chars);
+        printf("%.*s", AS_CLASS(value)->name->length, AS_CLASS(value)->name->chars);
         break;
     case OBJ_CLOSURE:
         print_function(AS_CLOSURE(value)->function);
         break;
+    case OBJ_FIBER:
+        printf("<fiber>");
+        break;
     case OBJ_FUNCTION:
         print_function(AS_FUNCTION(value));
         break;
     case OBJ_INSTANCE:
-        printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+        printf("%.*s instance", AS_INSTANCE(value)->klass->name->length, AS_INSTANCE(value)->klass->name->chars);
         break;
     case OBJ_NATIVE:
         printf("<native-fn>");
         break;
+    case OBJ_STREAM:
+        printf("<stream>");
+        break;
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
         break;
     case OBJ_UPVALUE:
         printf("upvalue");
@@ -7,28 +7,40 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) (is_obj_type(value, OBJ_BOUND_METHOD))
+#define IS_CHANNEL(value) (is_obj_type(value, OBJ_CHANNEL))
 #define IS_CLASS(value) (is_obj_type(value, OBJ_CLASS))
 #define IS_CLOSURE(value) (is_obj_type(value, OBJ_CLOSURE))
+#define IS_FIBER(value) (is_obj_type(value, OBJ_FIBER))
 #define IS_FUNCTION(value) (is_obj_type(value, OBJ_FUNCTION))
 #define IS_INSTANCE(value) (is_obj_type(value, OBJ_INSTANCE))
 #define IS_NATIVE(value) (is_obj_type(value, OBJ_NATIVE))
+#define IS_STREAM(value) (is_obj_type(value, OBJ_STREAM))
 #define IS_STRING(value) (is_obj_type(value, OBJ_STRING))
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_STREAM(value) ((ObjStream *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum
 {
+    OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_STREAM,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
@@ -40,16 +52,33 @@ typedef struct Obj
     Obj *next;
 } Obj;
 
+struct CallFrame;
+
+// Bytecode translated to C ahead of time. It runs the frame from frame->ip up to the first
+// instruction it leaves to the interpreter, and points frame->ip at that.
+typedef void (*AotFn)(struct CallFrame *frame);
+
 typedef struct
 {
     Obj obj;
     int arity;
     int upvalue_count;
+    int capture_count;
+    // The most values a call to the function keeps on the stack at once, counting its slot zero.
+    int max_stack;
     Chunk chunk;
     ObjString *name;
+    // Set until a lazily compiled function is first called: the source its parameter list starts
+    // in, where, and whether it's a method.
+    ObjString *source;
+    int source_offset;
+    int source_line;
+    bool is_method;
+    AotFn aot;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int arg_count, Value *args);
+// Natives leave their result in args[-1]. Returning false means a runtime error was reported.
+typedef bool (*NativeFn)(int arg_count, Value *args);
 
 typedef struct
 {
@@ -63,6 +92,8 @@ typedef struct ObjString
     int length;
     char *chars;
     uint32_t hash;
+    // Views borrow their chars from the owner's buffer and aren't NUL-terminated.
+    struct ObjString *owner;
 } ObjString;
 
 typedef struct ObjUpvalue
@@ -71,6 +102,8 @@ typedef struct ObjUpvalue
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
+    // The fiber whose stack an open upvalue points into, or NULL for the VM's own.
+    struct ObjFiber *fiber;
 } ObjUpvalue;
 
 typedef struct
@@ -79,12 +112,16 @@ typedef struct
     ObjFunction *function;
     ObjUpvalue **upvalues;
     int upvalue_count;
+    // Copies of enclosing variables that never change.
+    Value *captures;
+    int capture_count;
 } ObjClosure;
 
 typedef struct
 {
     Obj obj;
     ObjString *name;
+    Table methods;
 } ObjClass;
 
 typedef struct
@@ -94,13 +131,98 @@ typedef struct
     Table fields;
 } ObjInstance;
 
+// A method read off an instance as a value, remembering the instance it came from.
+typedef struct
+{
+    Obj obj;
+    Value receiver;
+    ObjClosure *method;
+} ObjBoundMethod;
+
+// Channels live outside every heap. Each isolate holding one has its own handle on it.
+typedef struct Channel Channel;
+
+typedef struct
+{
+    Obj obj;
+    Channel *channel;
+} ObjChannel;
+
+// The stacks code runs on. The running fiber's are in the VM, and every other fiber keeps its own
+// here.
+typedef struct
+{
+    struct CallFrame *frames;
+    int frame_count;
+    int frame_capacity;
+    Value *stack;
+    Value *stack_top;
+    Value *stack_limit;
+    int stack_capacity;
+    ObjUpvalue *open_upvalues;
+} Context;
+
+typedef enum
+{
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    // Running, or waiting on a fiber it resumed.
+    FIBER_RUNNING,
+    // Parked on I/O, until the event loop resumes it.
+    FIBER_WAITING,
+    FIBER_DONE,
+} FiberState;
+
+// A function or bound method running on stacks of its own, which only get allocated once it's
+// first resumed and are freed as soon as it returns.
+typedef struct ObjFiber
+{
+    Obj obj;
+    Value function;
+    Context context;
+    FiberState state;
+    // The fiber that resumed it, which it goes back to when it yields or returns. NULL while it
+    // isn't running, or when the VM's own stacks resumed it.
+    struct ObjFiber *caller;
+} ObjFiber;
+
+// What's parked on one side of a stream: a fiber, or the VM's own stacks when fiber is NULL.
+typedef struct
+{
+    bool parked;
+    ObjFiber *fiber;
+} Waiter;
+
+// A file, pipe or socket. Both descriptors are the same one except for pipes, and either is -1
+// when the stream can't be used that way, or not any more.
+typedef struct
+{
+    Obj obj;
+    int read_fd;
+    int write_fd;
+    bool listening;
+    bool connecting;
+    Waiter reader;
+    Waiter writer;
+    // The write being waited on, which is done up to out_offset.
+    ObjString *out;
+    int out_offset;
+    // Where it is among the streams something's parked on, or -1.
+    int parked_index;
+} ObjStream;
+
+ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method);
+ObjChannel *new_channel(Channel *channel);
 ObjClass *new_class(ObjString *name);
 ObjClosure *new_closure(ObjFunction *function);
+ObjFiber *new_fiber(Value function);
 ObjFunction *new_function();
 ObjInstance *new_instance(ObjClass *klass);
 ObjNative *new_native(NativeFn function);
+ObjStream *new_stream(int read_fd, int write_fd);
 ObjString *take_string(char *chars, int length);
 ObjString *copy_string(const char *chars, int length);
+ObjString *view_string(ObjString *string, int start, int length);
 ObjUpvalue *new_upvalue(Value *slot);
 void print_obj(Value value);
 
@@ -0,0 +1,1816 @@
+#include "optimizer.h"
+#include <stdio.h>
+#include <string.h>
+#include "memory.h"
+#include "vm.h"
+
+#define INLINE_MAX_LENGTH 64
+#define VALUE_KEYS_MAX 256
+
+// One decoded instruction. Jump targets are kept as instruction indices so instructions can be
+// deleted and jumps retargeted freely; offsets are only computed again when re-encoding. The
+// target is -1 for anything that isn't a jump.
+typedef struct
+{
+    uint8_t op;
+    int offset;
+    int length;
+    int target;
+    int line_no;
+    // The operand of an instruction rewritten into a one-operand one, or -1 to keep the chunk's.
+    int arg;
+    bool is_dead;
+    bool is_target;
+    bool is_reachable;
+} Instr;
+
+typedef struct
+{
+    Chunk *chunk;
+    Instr *instrs;
+    int count;
+} Body;
+
+static void find_depths(Chunk *chunk, int start, int end, int depth, int *depths);
+
+static bool is_backward(uint8_t op)
+{
+    return op == OP_LOOP || op == OP_FOR_ITER;
+}
+
+static void decode(Body *body)
+{
+    Chunk *chunk = body->chunk;
+    int *index_of = ALLOCATE(int, chunk->count + 1);
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        index_of[offset] = count++;
+    }
+    index_of[chunk->count] = count;
+
+    body->instrs = ALLOCATE(Instr, count);
+    body->count = count;
+
+    int i = 0;
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        Instr *instr = &body->instrs[i++];
+        instr->op = chunk->code[offset];
+        instr->offset = offset;
+        instr->length = instr_length(chunk, offset);
+        int target = jump_target(chunk, offset);
+        instr->target = target != -1 ? index_of[target] : -1;
+        instr->line_no = get_line_no(chunk, offset);
+        instr->arg = -1;
+        instr->is_dead = false;
+    }
+
+    FREE_ARRAY(index_of, int, chunk->count + 1);
+}
+
+// Deleted instructions fall through to whatever follows them, so that's where jumps to them go.
+static int next_live(Body *body, int i)
+{
+    while (i < body->count && body->instrs[i].is_dead)
+    {
+        ++i;
+    }
+    return i;
+}
+
+// Jumps to a deleted instruction now land on the next one, which becomes a target in its place.
+static void kill(Body *body, int i)
+{
+    Instr *instr = &body->instrs[i];
+    instr->is_dead = true;
+
+    int next = next_live(body, i + 1);
+    if (instr->is_target && next < body->count)
+    {
+        body->instrs[next].is_target = true;
+    }
+}
+
+static uint8_t operand(Body *body, int i)
+{
+    Instr *instr = &body->instrs[i];
+    return instr->arg >= 0 ? instr->arg : body->chunk->code[instr->offset + 1];
+}
+
+static void find_targets(Body *body)
+{
+    for (int i = 0; i < body->count; ++i)
+    {
+        body->instrs[i].is_target = false;
+    }
+
+    for (int i = 0; i < body->count; ++i)
+    {
+        Instr *instr = &body->instrs[i];
+        if (!instr->is_dead && instr->target != -1)
+        {
+            instr->target = next_live(body, instr->target);
+            if (instr->target < body->count)
+            {
+                body->instrs[instr->target].is_target = true;
+            }
+        }
+    }
+}
+
+// Follows jumps that land on other jumps. A conditional jump can skip through another conditional
+// jump since the tested value is still on the stack, but it can only ever go forward.
+static bool thread_jumps(Body *body)
+{
+    bool changed = false;
+
+    for (int i = 0; i < body->count; ++i)
+    {
+        Instr *instr = &body->instrs[i];
+        if (instr->is_dead || (instr->op != OP_JUMP && instr->op != OP_JUMP_IF_FALSE && instr->op != OP_LOOP))
+        {
+            continue;
+        }
+
+        for (int hops = 0; hops < body->count && instr->target < body->count; ++hops)
+        {
+            Instr *target = &body->instrs[instr->target];
+            bool can_follow = target->op == OP_JUMP || target->op == OP_LOOP ||
+                              (target->op == OP_JUMP_IF_FALSE && instr->op == OP_JUMP_IF_FALSE);
+            if (!can_follow)
+            {
+                break;
+            }
+
+            int next = next_live(body, target->target);
+            if (next == instr->target || (instr->op == OP_JUMP_IF_FALSE && next <= i))
+            {
+                break;
+            }
+
+            instr->target = next;
+            changed = true;
+        }
+
+        if (instr->op != OP_JUMP_IF_FALSE && instr->target < body->count &&
+            body->instrs[instr->target].op == OP_RETURN)
+        {
+            instr->op = OP_RETURN;
+            instr->length = 1;
+            instr->target = -1;
+            changed = true;
+        }
+        else if (instr->op != OP_JUMP_IF_FALSE && instr->target == next_live(body, i + 1))
+        {
+            instr->is_dead = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static void mark_reachable(Body *body)
+{
+    for (int i = 0; i < body->count; ++i)
+    {
+        body->instrs[i].is_reachable = false;
+    }
+
+    int *work = ALLOCATE(int, body->count);
+    int work_count = 0;
+
+    int entry = next_live(body, 0);
+    if (entry < body->count)
+    {
+        body->instrs[entry].is_reachable = true;
+        work[work_count++] = entry;
+    }
+
+    while (work_count > 0)
+    {
+        int i = work[--work_count];
+        Instr *instr = &body->instrs[i];
+        int successors[2];
+        int successor_count = 0;
+
+        if (instr->target != -1)
+        {
+            successors[successor_count++] = instr->target;
+        }
+        if (instr->op != OP_JUMP && instr->op != OP_LOOP && instr->op != OP_RETURN)
+        {
+            successors[successor_count++] = next_live(body, i + 1);
+        }
+
+        for (int s = 0; s < successor_count; ++s)
+        {
+            int next = successors[s];
+            if (next < body->count && !body->instrs[next].is_reachable)
+            {
+                body->instrs[next].is_reachable = true;
+                work[work_count++] = next;
+            }
+        }
+    }
+
+    FREE_ARRAY(work, int, body->count);
+}
+
+static bool remove_unreachable(Body *body)
+{
+    mark_reachable(body);
+
+    bool changed = false;
+    for (int i = 0; i < body->count; ++i)
+    {
+        Instr *instr = &body->instrs[i];
+        if (!instr->is_dead && !instr->is_reachable)
+        {
+            instr->is_dead = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// Whether the instruction loads a constant that the VM treats as true or as false.
+static bool loads_condition(Body *body, int i, bool condition)
+{
+    switch (body->instrs[i].op)
+    {
+    case OP_NIL:
+    case OP_FALSE:
+        return !condition;
+    case OP_TRUE:
+        return condition;
+    case OP_CONSTANT:
+    {
+        Value value = body->chunk->constants.values[operand(body, i)];
+        bool is_falsey = IS_NIL(value) || (IS_BOOLEAN(value) && !AS_BOOLEAN(value));
+        return is_falsey != condition;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool is_pure_load(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Finds the instruction that reads back what op stores. Returns false if op isn't a store.
+static bool get_for_set(uint8_t op, uint8_t *get)
+{
+    switch (op)
+    {
+    case OP_SET_LOCAL:
+        *get = OP_GET_LOCAL;
+        return true;
+    case OP_SET_UPVALUE:
+        *get = OP_GET_UPVALUE;
+        return true;
+    case OP_SET_GLOBAL:
+        *get = OP_GET_GLOBAL;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Rewrites short runs of instructions within a basic block. Only the first instruction of a run
+// may be a jump target.
+static bool peephole(Body *body)
+{
+    bool changed = false;
+
+    for (int i = next_live(body, 0); i < body->count; i = next_live(body, i + 1))
+    {
+        uint8_t op = body->instrs[i].op;
+        int j = next_live(body, i + 1);
+        if (j >= body->count || body->instrs[j].is_target)
+        {
+            continue;
+        }
+        Instr *b = &body->instrs[j];
+
+        // A value loaded only to be popped.
+        if (is_pure_load(op) && b->op == OP_POP)
+        {
+            kill(body, i);
+            kill(body, j);
+            changed = true;
+            continue;
+        }
+
+        // A branch on a constant condition.
+        if (b->op == OP_JUMP_IF_FALSE && loads_condition(body, i, true))
+        {
+            kill(body, j);
+            changed = true;
+            continue;
+        }
+        if (b->op == OP_JUMP_IF_FALSE && loads_condition(body, i, false))
+        {
+            b->op = OP_JUMP;
+            changed = true;
+            continue;
+        }
+
+        // Reading back a variable right after storing it: the stored value is still on the stack.
+        int k = next_live(body, j + 1);
+        uint8_t get;
+        if (k < body->count && !body->instrs[k].is_target && b->op == OP_POP && get_for_set(op, &get) &&
+            body->instrs[k].op == get && operand(body, k) == operand(body, i))
+        {
+            kill(body, j);
+            kill(body, k);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// What a pure load or operation computes from its operand and the values it takes.
+typedef struct
+{
+    uint8_t op;
+    int arg;
+    int a;
+    int b;
+    int number;
+} ValueKey;
+
+// The values a basic block has computed so far, numbered so that equal numbers mean equal
+// values. numbers[slot] is the number of the value in each stack slot of the frame, and
+// starts[slot] the first instruction of the pure code that computed it there, or -1.
+typedef struct
+{
+    ValueKey keys[VALUE_KEYS_MAX];
+    int key_count;
+    int next_number;
+    int *numbers;
+    int *starts;
+    int width;
+} Values;
+
+static void forget_values(Values *values)
+{
+    values->key_count = 0;
+    for (int slot = 0; slot < values->width; ++slot)
+    {
+        values->numbers[slot] = -1;
+        values->starts[slot] = -1;
+    }
+}
+
+static void forget_slot(Values *values, int slot)
+{
+    values->numbers[slot] = -1;
+    values->starts[slot] = -1;
+}
+
+static int find_value(Values *values, uint8_t op, int arg, int a, int b)
+{
+    for (int i = 0; i < values->key_count; ++i)
+    {
+        ValueKey *key = &values->keys[i];
+        if (key->op == op && key->arg == arg && key->a == a && key->b == b)
+        {
+            return key->number;
+        }
+    }
+    return -1;
+}
+
+// Once the table is full, values are just left unnumbered.
+static void add_value(Values *values, uint8_t op, int arg, int a, int b, int number)
+{
+    if (values->key_count < VALUE_KEYS_MAX)
+    {
+        values->keys[values->key_count++] = (ValueKey){op, arg, a, b, number};
+    }
+}
+
+// A store makes a load of the variable give what was stored. Stores to upvalues forget every
+// upvalue, in case two of them are the same variable.
+static void store_value(Values *values, uint8_t load, int arg, int number)
+{
+    int kept = 0;
+    for (int i = 0; i < values->key_count; ++i)
+    {
+        ValueKey *key = &values->keys[i];
+        if (key->op != load || (key->arg != arg && load != OP_GET_UPVALUE))
+        {
+            values->keys[kept++] = *key;
+        }
+    }
+    values->key_count = kept;
+
+    if (number != -1)
+    {
+        add_value(values, load, arg, -1, -1, number);
+    }
+}
+
+// How many values an instruction that only computes a new one from them takes off the stack, or
+// -1 if it does anything else. Errors these raise would have been raised by the first of two
+// equal computations too.
+static int pure_operands(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURE:
+        return 0;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+        return 1;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+// Numbers the value a pure instruction computes at slot, where depth is the stack depth before
+// it. A local's slot gets a number the first time it's read.
+static int number_value(Values *values, Body *body, int i, int slot, int depth)
+{
+    uint8_t op = body->instrs[i].op;
+    if (op == OP_GET_LOCAL)
+    {
+        int local = operand(body, i);
+        if (values->numbers[local] == -1)
+        {
+            values->numbers[local] = values->next_number++;
+        }
+        return values->numbers[local];
+    }
+
+    int operands = depth - slot;
+    int a = operands > 0 ? values->numbers[slot] : -1;
+    int b = operands > 1 ? values->numbers[slot + 1] : -1;
+    if ((operands > 0 && a == -1) || (operands > 1 && b == -1))
+    {
+        return values->next_number++;
+    }
+
+    bool has_arg = op == OP_CONSTANT || op == OP_GET_GLOBAL || op == OP_GET_UPVALUE || op == OP_GET_CAPTURE;
+    int arg = has_arg ? operand(body, i) : 0;
+    int number = find_value(values, op, arg, a, b);
+    if (number == -1)
+    {
+        number = values->next_number++;
+        add_value(values, op, arg, a, b, number);
+    }
+    return number;
+}
+
+// Replaces pure code whose value is already in a stack slot below it with a read of that slot.
+// There are no registers to keep a common subexpression in, but every slot of the frame can be
+// read with OP_GET_LOCAL, so a value can be reused for as long as it stays on the stack. Within
+// each basic block, values are numbered as they're computed. Stores give the variable the
+// stored value's number, which also makes a local copy stand in for what was copied into it.
+// Calls and anything else that could run code or change variables unseen forget everything.
+// depths[i] is the stack depth before each instruction.
+static bool reuse_values(Body *body, int *depths, int width)
+{
+    Values values;
+    values.next_number = 0;
+    values.width = width;
+    values.numbers = ALLOCATE(int, width);
+    values.starts = ALLOCATE(int, width);
+    forget_values(&values);
+
+    bool changed = false;
+    // The last instruction with an effect of its own, which no rewrite can reach back past.
+    int barrier = -1;
+
+    for (int i = 0; i < body->count; ++i)
+    {
+        Instr *instr = &body->instrs[i];
+        int depth = depths[i];
+        if (instr->is_dead || depth < 0)
+        {
+            continue;
+        }
+        if (instr->is_target)
+        {
+            forget_values(&values);
+        }
+
+        int operands = pure_operands(instr->op);
+        if (operands < 0)
+        {
+            barrier = i;
+            switch (instr->op)
+            {
+            case OP_POP:
+            case OP_PRINT:
+                forget_slot(&values, depth - 1);
+                break;
+            case OP_SET_LOCAL:
+                values.numbers[operand(body, i)] = values.numbers[depth - 1];
+                values.starts[depth - 1] = -1;
+                break;
+            case OP_SET_GLOBAL:
+                store_value(&values, OP_GET_GLOBAL, operand(body, i), values.numbers[depth - 1]);
+                values.starts[depth - 1] = -1;
+                break;
+            case OP_DEFINE_GLOBAL:
+                store_value(&values, OP_GET_GLOBAL, operand(body, i), values.numbers[depth - 1]);
+                forget_slot(&values, depth - 1);
+                break;
+            case OP_SET_UPVALUE:
+                store_value(&values, OP_GET_UPVALUE, operand(body, i), values.numbers[depth - 1]);
+                values.starts[depth - 1] = -1;
+                break;
+            default:
+                forget_values(&values);
+                break;
+            }
+            continue;
+        }
+
+        int slot = depth - operands;
+        int number = number_value(&values, body, i, slot, depth);
+        int start = operands == 0 ? i : values.starts[slot];
+        for (int consumed = slot + 1; consumed < depth; ++consumed)
+        {
+            forget_slot(&values, consumed);
+        }
+
+        int found = -1;
+        for (int held = 0; held < slot && held <= UINT8_MAX && found == -1; ++held)
+        {
+            if (values.numbers[held] == number)
+            {
+                found = held;
+            }
+        }
+
+        // Reading a slot only beats loading a global or upvalue, or computing anything.
+        bool is_worth = start != i || instr->op == OP_GET_GLOBAL || instr->op == OP_GET_UPVALUE;
+        if (found != -1 && start != -1 && start > barrier && is_worth)
+        {
+            for (int j = start; j < i; ++j)
+            {
+                if (!body->instrs[j].is_dead)
+                {
+                    kill(body, j);
+                }
+            }
+            instr->op = OP_GET_LOCAL;
+            instr->length = 2;
+            instr->arg = found;
+            start = i;
+            changed = true;
+        }
+
+        values.numbers[slot] = number;
+        values.starts[slot] = start;
+    }
+
+    FREE_ARRAY(values.starts, int, width);
+    FREE_ARRAY(values.numbers, int, width);
+    return changed;
+}
+
+// The index of the first instruction at or past offset.
+static int instr_at(Body *body, int offset)
+{
+    int lo = 0;
+    int hi = body->count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (body->instrs[mid].offset < offset)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Swaps the chunk's code and lines for the rewritten ones, where new_offset gives where each of
+// the body's instructions went, and the end of the code after the last one.
+static void replace_code(Body *body, Chunk *code, int *new_offset)
+{
+    Chunk *chunk = body->chunk;
+    for (int i = 0; i < chunk->site_count; ++i)
+    {
+        InlineSite *site = &chunk->sites[i];
+        site->start = new_offset[instr_at(body, site->start)];
+        site->end = new_offset[instr_at(body, site->end)];
+    }
+
+    FREE_ARRAY(chunk->code, uint8_t, chunk->capacity);
+    FREE_ARRAY(chunk->lines, LineStart, chunk->line_capacity);
+    chunk->code = code->code;
+    chunk->count = code->count;
+    chunk->capacity = code->capacity;
+    chunk->lines = code->lines;
+    chunk->line_count = code->line_count;
+    chunk->line_capacity = code->line_capacity;
+}
+
+// Writes the surviving instructions back into the chunk. Gives up and leaves the chunk as it was
+// if a retargeted jump no longer fits in 16 bits.
+static void encode(Body *body)
+{
+    Chunk *chunk = body->chunk;
+    int *new_offset = ALLOCATE(int, body->count + 1);
+
+    int offset = 0;
+    for (int i = 0; i < body->count; ++i)
+    {
+        new_offset[i] = offset;
+        if (!body->instrs[i].is_dead)
+        {
+            offset += body->instrs[i].length;
+        }
+    }
+    new_offset[body->count] = offset;
+
+    Chunk optimized;
+    init_chunk(&optimized);
+    bool fits = true;
+
+    for (int i = 0; i < body->count && fits; ++i)
+    {
+        Instr *instr = &body->instrs[i];
+        if (instr->is_dead)
+        {
+            continue;
+        }
+
+        if (instr->arg >= 0)
+        {
+            append_to_chunk(&optimized, instr->op, instr->line_no);
+            append_to_chunk(&optimized, instr->arg, instr->line_no);
+            continue;
+        }
+        if (instr->target == -1)
+        {
+            append_to_chunk(&optimized, instr->op, instr->line_no);
+            for (int b = 1; b < instr->length; ++b)
+            {
+                append_to_chunk(&optimized, chunk->code[instr->offset + b], instr->line_no);
+            }
+            continue;
+        }
+
+        int distance = new_offset[next_live(body, instr->target)] - (new_offset[i] + instr->length);
+        uint8_t op = instr->op;
+        if (op == OP_JUMP && distance < 0)
+        {
+            op = OP_LOOP;
+        }
+        else if (op == OP_LOOP && distance >= 0)
+        {
+            op = OP_JUMP;
+        }
+        if (is_backward(op))
+        {
+            distance = -distance;
+        }
+
+        fits = distance >= 0 && distance <= UINT16_MAX;
+        append_to_chunk(&optimized, op, instr->line_no);
+        for (int b = 1; b < instr->length - 2; ++b)
+        {
+            append_to_chunk(&optimized, chunk->code[instr->offset + b], instr->line_no);
+        }
+        append_to_chunk(&optimized, (distance >> 8) & 0xff, instr->line_no);
+        append_to_chunk(&optimized, distance & 0xff, instr->line_no);
+    }
+
+    if (fits)
+    {
+        replace_code(body, &optimized, new_offset);
+    }
+    else
+    {
+        free_chunk(&optimized);
+    }
+
+    FREE_ARRAY(new_offset, int, body->count + 1);
+}
+
+// Runs jump threading, unreachable code removal and peephole rewrites over the function's
+// control flow until none of them finds anything more to do, then reuses values that are still
+// on the stack, which needs the stack depths of the simplified code.
+void optimize_chunk(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Body body;
+    body.chunk = chunk;
+    decode(&body);
+
+    bool changed = true;
+    while (changed)
+    {
+        find_targets(&body);
+        changed = thread_jumps(&body);
+        changed |= remove_unreachable(&body);
+        find_targets(&body);
+        changed |= peephole(&body);
+    }
+
+    encode(&body);
+    FREE_ARRAY(body.instrs, Instr, body.count);
+
+    decode(&body);
+    find_targets(&body);
+    int *offset_depths = ALLOCATE(int, chunk->count);
+    find_depths(chunk, 0, chunk->count, function->arity + 1, offset_depths);
+    int *depths = ALLOCATE(int, body.count);
+    int width = 1;
+    for (int i = 0; i < body.count; ++i)
+    {
+        depths[i] = offset_depths[body.instrs[i].offset];
+        int after = depths[i] + stack_effect(chunk, body.instrs[i].offset);
+        width = depths[i] >= width ? depths[i] + 1 : width;
+        width = after > width ? after : width;
+    }
+
+    if (reuse_values(&body, depths, width))
+    {
+        encode(&body);
+    }
+
+    FREE_ARRAY(depths, int, body.count);
+    FREE_ARRAY(offset_depths, int, chunk->count);
+    FREE_ARRAY(body.instrs, Instr, body.count);
+}
+
+// Fills depths[offset - start] with the stack depth before each instruction in [start, end) that
+// can be reached from start, and -1 for the rest. Jumps leaving the range are ignored, which
+// also covers jumps that haven't been patched yet.
+static void find_depths(Chunk *chunk, int start, int end, int depth, int *depths)
+{
+    for (int i = 0; i < end - start; ++i)
+    {
+        depths[i] = -1;
+    }
+
+    int *work = ALLOCATE(int, end - start);
+    int work_count = 0;
+
+    depths[0] = depth;
+    work[work_count++] = start;
+
+    while (work_count > 0)
+    {
+        int offset = work[--work_count];
+        uint8_t op = chunk->code[offset];
+        int after = depths[offset - start] + stack_effect(chunk, offset);
+        int successors[2];
+        int successor_count = 0;
+
+        int target = jump_target(chunk, offset);
+        if (target != -1)
+        {
+            successors[successor_count++] = target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN)
+        {
+            successors[successor_count++] = offset + instr_length(chunk, offset);
+        }
+
+        for (int s = 0; s < successor_count; ++s)
+        {
+            int next = successors[s];
+            if (next >= start && next < end && depths[next - start] < 0)
+            {
+                depths[next - start] = after;
+                work[work_count++] = next;
+            }
+        }
+    }
+
+    FREE_ARRAY(work, int, end - start);
+}
+
+// The stack depth before the instruction at offset, given the depth at start.
+int stack_depth_at(Chunk *chunk, int start, int depth, int offset)
+{
+    int *depths = ALLOCATE(int, offset - start + 1);
+    find_depths(chunk, start, offset + 1, depth, depths);
+    int result = depths[offset - start];
+    FREE_ARRAY(depths, int, offset - start + 1);
+    return result;
+}
+
+static bool uses_constant(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_HOISTED:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Small functions that don't capture anything and don't create closures can be copied into
+// their callers, since none of their locals can outlive the call. Counted loops and wide
+// instructions are left out because their operands would need rebasing too, tail calls because
+// inlined ones would grow the frame stack again, and super calls because their caches belong to
+// the callee's chunk.
+bool can_inline(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (function->source != NULL || function->upvalue_count > 0 || function->capture_count > 0 ||
+        chunk->count > INLINE_MAX_LENGTH)
+    {
+        return false;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        switch (chunk->code[offset])
+        {
+        case OP_CLOSURE:
+        case OP_CLOSE_UPVALUE:
+        case OP_FOR_PREP:
+        case OP_FOR_ITER:
+        case OP_TAIL_CALL:
+        case OP_SUPER_INVOKE:
+        case OP_WIDE:
+            return false;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+// Appends a copy of the function's code that runs in the caller's frame, with the callee's slot
+// zero at slot base. Each return drops the callee's slots with OP_UNWIND and jumps past the end.
+// The copied instructions keep the callee's line numbers, and calls inlined into the callee keep
+// their sites. Returns false, having appended nothing, when the slots or constants would not fit
+// in a byte operand.
+bool inline_function(Chunk *chunk, ObjFunction *function, int base)
+{
+    Chunk *body = &function->chunk;
+    int *depths = ALLOCATE(int, body->count);
+    find_depths(body, 0, body->count, function->arity + 1, depths);
+
+    bool fits = true;
+    int new_constants = 0;
+    int last = 0;
+
+    for (int offset = 0; offset < body->count; offset += instr_length(body, offset))
+    {
+        if (depths[offset] < 0)
+        {
+            continue;
+        }
+
+        uint8_t op = body->code[offset];
+        if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && base + body->code[offset + 1] > UINT8_MAX)
+        {
+            fits = false;
+        }
+        else if (op == OP_GET_HOISTED && base + body->code[offset + 2] > UINT8_MAX)
+        {
+            fits = false;
+        }
+        else if (op == OP_RETURN && depths[offset] - 1 > UINT8_MAX)
+        {
+            fits = false;
+        }
+        else if (uses_constant(op) && find_constant(chunk, body->constants.values[body->code[offset + 1]]) < 0)
+        {
+            ++new_constants;
+        }
+        last = offset;
+    }
+
+    if (!fits || chunk->constants.count + new_constants > UINT8_COUNT)
+    {
+        FREE_ARRAY(depths, int, body->count);
+        return false;
+    }
+
+    int *new_offset = ALLOCATE(int, body->count + 1);
+    int length = 0;
+    for (int offset = 0; offset < body->count; offset += instr_length(body, offset))
+    {
+        new_offset[offset] = length;
+        if (depths[offset] >= 0)
+        {
+            length += body->code[offset] != OP_RETURN ? instr_length(body, offset) : offset == last ? 2 : 5;
+        }
+    }
+    new_offset[body->count] = length;
+
+    int start = chunk->count;
+    for (int i = 0; i < body->site_count; ++i)
+    {
+        InlineSite *site = &body->sites[i];
+        add_inline_site(chunk, start + new_offset[site->start], start + new_offset[site->end], site->line_no,
+                        site->name);
+    }
+
+    for (int offset = 0; offset < body->count; offset += instr_length(body, offset))
+    {
+        if (depths[offset] < 0)
+        {
+            continue;
+        }
+
+        uint8_t op = body->code[offset];
+        int target = jump_target(body, offset);
+        int line_no = get_line_no(body, offset);
+
+        if (op == OP_GET_LOCAL || op == OP_SET_LOCAL)
+        {
+            append_to_chunk(chunk, op, line_no);
+            append_to_chunk(chunk, base + body->code[offset + 1], line_no);
+        }
+        else if (uses_constant(op))
+        {
+            Value value = body->constants.values[body->code[offset + 1]];
+            int constant = find_constant(chunk, value);
+            if (constant < 0)
+            {
+                constant = add_constant(chunk, value);
+            }
+            append_to_chunk(chunk, op, line_no);
+            append_to_chunk(chunk, constant, line_no);
+            if (op == OP_GET_HOISTED)
+            {
+                append_to_chunk(chunk, base + body->code[offset + 2], line_no);
+                continue;
+            }
+            for (int b = 2; b < instr_length(body, offset); ++b)
+            {
+                append_to_chunk(chunk, body->code[offset + b], line_no);
+            }
+        }
+        else if (target != -1)
+        {
+            int distance = new_offset[target] - (new_offset[offset] + 3);
+            if (op == OP_LOOP)
+            {
+                distance = -distance;
+            }
+            append_to_chunk(chunk, op, line_no);
+            append_to_chunk(chunk, (distance >> 8) & 0xff, line_no);
+            append_to_chunk(chunk, distance & 0xff, line_no);
+        }
+        else if (op == OP_RETURN)
+        {
+            append_to_chunk(chunk, OP_UNWIND, line_no);
+            append_to_chunk(chunk, depths[offset] - 1, line_no);
+            if (offset != last)
+            {
+                int distance = length - (new_offset[offset] + 5);
+                append_to_chunk(chunk, OP_JUMP, line_no);
+                append_to_chunk(chunk, (distance >> 8) & 0xff, line_no);
+                append_to_chunk(chunk, distance & 0xff, line_no);
+            }
+        }
+        else
+        {
+            for (int b = 0; b < instr_length(body, offset); ++b)
+            {
+                append_to_chunk(chunk, body->code[offset + b], line_no);
+            }
+        }
+    }
+
+    FREE_ARRAY(new_offset, int, body->count + 1);
+    FREE_ARRAY(depths, int, body->count);
+    return true;
+}
+
+// What the type inference knows about a stack slot.
+typedef enum
+{
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+} SlotType;
+
+static uint8_t unchecked_op(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD:
+        return OP_ADD_NUM;
+    case OP_SUB:
+        return OP_SUB_NUM;
+    case OP_MUL:
+        return OP_MUL_NUM;
+    case OP_DIV:
+        return OP_DIV_NUM;
+    case OP_GREATER:
+        return OP_GREATER_NUM;
+    case OP_LESS:
+        return OP_LESS_NUM;
+    case OP_NEGATE:
+        return OP_NEGATE_NUM;
+    default:
+        return op;
+    }
+}
+
+// Applies the instruction at offset to the slot types in types, where sp is the stack depth
+// before it. Locals are just the bottom slots of the frame's stack.
+static void transfer_types(Chunk *chunk, int offset, int sp, uint8_t *types, bool *is_captured)
+{
+    uint8_t *code = &chunk->code[offset];
+    int after = sp + stack_effect(chunk, offset);
+
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        types[sp] = IS_NUMBER(chunk->constants.values[code[1]]) ? TYPE_NUMBER : TYPE_UNKNOWN;
+        break;
+    case OP_GET_LOCAL:
+        types[sp] = is_captured[code[1]] ? TYPE_UNKNOWN : types[code[1]];
+        break;
+    case OP_SET_LOCAL:
+        types[code[1]] = is_captured[code[1]] ? TYPE_UNKNOWN : types[sp - 1];
+        break;
+    case OP_SET_PROPERTY:
+        types[sp - 2] = types[sp - 1];
+        break;
+    case OP_ADD:
+        types[sp - 2] = types[sp - 2] == TYPE_NUMBER && types[sp - 1] == TYPE_NUMBER ? TYPE_NUMBER : TYPE_UNKNOWN;
+        break;
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_NEGATE:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_NEGATE_NUM:
+        // These only get past their checks with numbers.
+        types[after - 1] = TYPE_NUMBER;
+        break;
+    case OP_FOR_PREP:
+        types[code[1]] = TYPE_NUMBER;
+        types[code[1] + 1] = TYPE_NUMBER;
+        break;
+    case OP_FOR_ITER:
+        types[code[1]] = TYPE_NUMBER;
+        break;
+    case OP_UNWIND:
+        types[after - 1] = types[sp - 1];
+        break;
+    case OP_WIDE:
+        // Wide slots are all past the ones short instructions use, and their types aren't
+        // tracked, so only constants are worth looking at.
+        if (code[1] == OP_CONSTANT)
+        {
+            Value value = chunk->constants.values[(code[2] << 8) | code[3]];
+            types[sp] = IS_NUMBER(value) ? TYPE_NUMBER : TYPE_UNKNOWN;
+        }
+        else if (after > 0)
+        {
+            types[after - 1] = TYPE_UNKNOWN;
+        }
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_PRINT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+        break;
+    default:
+        if (after > 0)
+        {
+            types[after - 1] = TYPE_UNKNOWN;
+        }
+        break;
+    }
+}
+
+// Proves which arithmetic and comparison operands are always numbers, by tracking the type of
+// every stack slot through the function's control flow until nothing changes, and switches
+// those instructions to variants that skip the type checks. Slots captured by closures can be
+// changed behind the function's back, so they're never assumed to be numbers.
+void specialize_arithmetic(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int *depths = ALLOCATE(int, chunk->count);
+    find_depths(chunk, 0, chunk->count, function->arity + 1, depths);
+
+    int width = 1;
+    bool is_captured[UINT8_COUNT] = {false};
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        if (depths[offset] + 1 > width)
+        {
+            width = depths[offset] + 1;
+        }
+
+        bool is_wide = chunk->code[offset] == OP_WIDE;
+        uint8_t *code = &chunk->code[offset + is_wide];
+        if (code[0] == OP_CLOSURE)
+        {
+            // Only upvalues share the slot; captures are copies. Behind OP_WIDE each index is two
+            // bytes.
+            int size = is_wide ? 2 : 1;
+            int constant = is_wide ? (code[1] << 8) | code[2] : code[1];
+            ObjFunction *closure = AS_FUNCTION(chunk->constants.values[constant]);
+            for (int i = 0; i < closure->upvalue_count; ++i)
+            {
+                uint8_t *variable = &code[1 + size + (1 + size) * i];
+                int slot = is_wide ? (variable[1] << 8) | variable[2] : variable[1];
+                if (variable[0] && slot < UINT8_COUNT)
+                {
+                    is_captured[slot] = true;
+                }
+            }
+        }
+    }
+
+    // types[offset * width + slot] is the type of the slot before the instruction at offset.
+    uint8_t *types = ALLOCATE(uint8_t, chunk->count * width);
+    bool *is_visited = ALLOCATE(bool, chunk->count);
+    bool *is_queued = ALLOCATE(bool, chunk->count);
+    int *work = ALLOCATE(int, chunk->count);
+    uint8_t *state = ALLOCATE(uint8_t, width);
+    int work_count = 0;
+
+    for (int offset = 0; offset < chunk->count; ++offset)
+    {
+        is_visited[offset] = false;
+        is_queued[offset] = false;
+    }
+    for (int slot = 0; slot < width; ++slot)
+    {
+        types[slot] = TYPE_UNKNOWN;
+    }
+    is_visited[0] = true;
+    is_queued[0] = true;
+    work[work_count++] = 0;
+
+    while (work_count > 0)
+    {
+        int offset = work[--work_count];
+        is_queued[offset] = false;
+        uint8_t op = chunk->code[offset];
+
+        for (int slot = 0; slot < width; ++slot)
+        {
+            state[slot] = types[offset * width + slot];
+        }
+        transfer_types(chunk, offset, depths[offset], state, is_captured);
+
+        int successors[2];
+        int successor_count = 0;
+        int target = jump_target(chunk, offset);
+        if (target != -1)
+        {
+            successors[successor_count++] = target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN)
+        {
+            successors[successor_count++] = offset + instr_length(chunk, offset);
+        }
+
+        for (int s = 0; s < successor_count; ++s)
+        {
+            int next = successors[s];
+            if (next >= chunk->count)
+            {
+                continue;
+            }
+
+            uint8_t *merged = &types[next * width];
+            bool changed = !is_visited[next];
+            for (int slot = 0; slot < width; ++slot)
+            {
+                uint8_t type = is_visited[next] && merged[slot] != state[slot] ? TYPE_UNKNOWN : state[slot];
+                changed |= type != merged[slot];
+                merged[slot] = type;
+            }
+
+            is_visited[next] = true;
+            if (changed && !is_queued[next])
+            {
+                is_queued[next] = true;
+                work[work_count++] = next;
+            }
+        }
+    }
+
+    int checked = 0;
+    int removed = 0;
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        uint8_t op = chunk->code[offset];
+        if (unchecked_op(op) == op)
+        {
+            continue;
+        }
+
+        ++checked;
+        if (!is_visited[offset])
+        {
+            continue;
+        }
+
+        uint8_t *before = &types[offset * width + depths[offset]];
+        if (before[-1] == TYPE_NUMBER && (op == OP_NEGATE || before[-2] == TYPE_NUMBER))
+        {
+            chunk->code[offset] = unchecked_op(op);
+            ++removed;
+        }
+    }
+
+    if (vm->type_stats)
+    {
+        if (function->name != NULL)
+        {
+            fprintf(stderr, "%.*s: ", function->name->length, function->name->chars);
+        }
+        else
+        {
+            fprintf(stderr, "<script>: ");
+        }
+        fprintf(stderr, "removed %d of %d type checks\n", removed, checked);
+    }
+
+    FREE_ARRAY(state, uint8_t, width);
+    FREE_ARRAY(work, int, chunk->count);
+    FREE_ARRAY(is_queued, bool, chunk->count);
+    FREE_ARRAY(is_visited, bool, chunk->count);
+    FREE_ARRAY(types, uint8_t, chunk->count * width);
+    FREE_ARRAY(depths, int, chunk->count);
+}
+
+// A loop in the bytecode, as the indices of its first and last instructions. It can only be
+// entered at start, and only left through exit, where the stack is as deep as at start again.
+typedef struct
+{
+    int start;
+    int end;
+    int exit;
+    int depth;
+} Loop;
+
+// What one of the slots put under a loop holds: the global name, or the value of the pure code
+// from start to end.
+typedef struct
+{
+    ObjString *name;
+    int start;
+    int end;
+} Hoist;
+
+// Instructions that can run other code, which could change any global or captured variable,
+// and ones with slot operands that aren't worth rebasing.
+static bool blocks_hoisting(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_WIDE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Finds the loop closed by the backward jump at back. A for loop's increment and body jump back
+// into each other, so loops whose ranges cross are taken as one, and a counted loop starts at
+// the OP_FOR_PREP that can skip it. Fails if the loop has anything in it that blocks hoisting,
+// if something jumps into it other than to its start, or if it can be left anywhere other than
+// straight after its end, or just past the condition popped there.
+static bool find_loop(Body *body, int *depths, int back, Loop *loop)
+{
+    Instr *instrs = body->instrs;
+    int start = instrs[back].target;
+    int end = back;
+
+    bool grew = true;
+    while (grew)
+    {
+        grew = false;
+        for (int i = 0; i < body->count; ++i)
+        {
+            int target = instrs[i].target;
+            if (is_backward(instrs[i].op) &&
+                ((target < start && i >= start && i < end) || (target > start && target <= end && i > end)))
+            {
+                start = target < start ? target : start;
+                end = i > end ? i : end;
+                grew = true;
+            }
+        }
+    }
+
+    if (start > 0 && instrs[start - 1].op == OP_FOR_PREP)
+    {
+        --start;
+    }
+
+    int after = end + 1;
+    int depth = depths[start];
+    if (after >= body->count || depth < 0)
+    {
+        return false;
+    }
+
+    int exit = after;
+    if (depths[after] == depth + 1 && instrs[after].op == OP_POP && after + 1 < body->count)
+    {
+        exit = after + 1;
+    }
+    if (depths[exit] != depth)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < body->count; ++i)
+    {
+        bool is_inside = i >= start && i <= end;
+        int target = instrs[i].target;
+        if (is_inside && (depths[i] < 0 || blocks_hoisting(instrs[i].op)))
+        {
+            return false;
+        }
+        if (target < 0)
+        {
+            continue;
+        }
+
+        bool lands_inside = target > start && target <= end;
+        if (is_inside ? !lands_inside && target != start && target != after && target != exit
+                      : lands_inside || target == after || target == exit)
+        {
+            return false;
+        }
+    }
+
+    *loop = (Loop){start, end, exit, depth};
+    return true;
+}
+
+static bool stores_global(Body *body, Loop *loop, ObjString *name)
+{
+    for (int i = loop->start; i <= loop->end; ++i)
+    {
+        uint8_t op = body->instrs[i].op;
+        if ((op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) &&
+            AS_STRING(body->chunk->constants.values[operand(body, i)]) == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// How many values the instruction at i takes if it computes one that's the same every time
+// round the loop and can't fail, or -1 if it doesn't. is_fixed marks the slots nothing in the
+// loop stores to.
+static int invariant_operands(Body *body, int i, bool *is_fixed, bool sets_upvalues)
+{
+    switch (body->instrs[i].op)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_CAPTURE:
+        return 0;
+    case OP_GET_LOCAL:
+        return is_fixed[operand(body, i)] ? 0 : -1;
+    case OP_GET_UPVALUE:
+        return sets_upvalues ? -1 : 0;
+    case OP_NOT:
+    case OP_NEGATE_NUM:
+        return 1;
+    case OP_EQUAL:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+// Gives the pure code from start to end a slot, sharing one with any code that's the same.
+static int add_pure_hoist(Body *body, Loop *loop, Hoist *hoists, int count, int *plan, int start, int end)
+{
+    Instr *instrs = body->instrs;
+    uint8_t *code = body->chunk->code;
+    int length = instrs[end].offset + instrs[end].length - instrs[start].offset;
+
+    int slot = 0;
+    for (; slot < count; ++slot)
+    {
+        Hoist *hoist = &hoists[slot];
+        if (hoist->name == NULL &&
+            instrs[hoist->end].offset + instrs[hoist->end].length - instrs[hoist->start].offset == length &&
+            memcmp(&code[instrs[hoist->start].offset], &code[instrs[start].offset], length) == 0)
+        {
+            break;
+        }
+    }
+    if (slot == UINT8_COUNT)
+    {
+        return count;
+    }
+    if (slot == count)
+    {
+        hoists[count++] = (Hoist){NULL, start, end};
+    }
+
+    plan[start] = loop->depth + slot;
+    for (int i = start + 1; i <= end; ++i)
+    {
+        plan[i] = -2;
+    }
+    return count;
+}
+
+// Picks what to move out of the loop: reads of globals it never stores to, and pure code that
+// computes the same value every time round, as long as that took more than a load. Pure code is
+// followed up the stack as the values it's made of are pushed, and taken as it stands when
+// something else comes along. plan[i] is set to the slot that replaces instruction i, or -2 for
+// the rest of the pure code it stands for. Returns how many slots that takes, or zero.
+static int plan_hoists(Body *body, int *depths, Loop *loop, int *plan, Hoist *hoists)
+{
+    Chunk *chunk = body->chunk;
+    Instr *instrs = body->instrs;
+
+    int width = loop->depth + 1;
+    for (int i = loop->start; i <= loop->end; ++i)
+    {
+        int after = depths[i] + stack_effect(chunk, instrs[i].offset);
+        width = depths[i] >= width ? depths[i] + 1 : width;
+        width = after > width ? after : width;
+    }
+
+    bool *is_fixed = ALLOCATE(bool, width);
+    for (int slot = 0; slot < width; ++slot)
+    {
+        is_fixed[slot] = slot < loop->depth;
+    }
+    bool sets_upvalues = false;
+    for (int i = loop->start; i <= loop->end; ++i)
+    {
+        uint8_t op = instrs[i].op;
+        if (op == OP_SET_LOCAL || op == OP_FOR_PREP || op == OP_FOR_ITER)
+        {
+            is_fixed[operand(body, i)] = false;
+        }
+        sets_upvalues |= op == OP_SET_UPVALUE;
+    }
+
+    int count = 0;
+    for (int i = loop->start; i <= loop->end; ++i)
+    {
+        if (instrs[i].op != OP_GET_GLOBAL)
+        {
+            continue;
+        }
+
+        ObjString *name = AS_STRING(chunk->constants.values[operand(body, i)]);
+        int slot = 0;
+        while (slot < count && hoists[slot].name != name)
+        {
+            ++slot;
+        }
+        if (stores_global(body, loop, name) || slot == UINT8_COUNT)
+        {
+            continue;
+        }
+        if (slot == count)
+        {
+            hoists[count++] = (Hoist){name, -1, -1};
+        }
+        plan[i] = loop->depth + slot;
+    }
+
+    int *starts = ALLOCATE(int, width);
+    int *ends = ALLOCATE(int, width);
+    for (int slot = 0; slot < width; ++slot)
+    {
+        starts[slot] = -1;
+    }
+
+    for (int i = loop->start; i <= loop->end + 1; ++i)
+    {
+        int depth = i <= loop->end ? depths[i] : width;
+        int operands = i <= loop->end ? invariant_operands(body, i, is_fixed, sets_upvalues) : -1;
+        bool extends = operands >= 0;
+        for (int slot = depth - operands; extends && slot < depth; ++slot)
+        {
+            extends = starts[slot] >= 0 && !instrs[i].is_target;
+        }
+
+        if (!extends || instrs[i].is_target)
+        {
+            for (int slot = 0; slot < depth; ++slot)
+            {
+                if (starts[slot] >= 0 && starts[slot] < ends[slot])
+                {
+                    count = add_pure_hoist(body, loop, hoists, count, plan, starts[slot], ends[slot]);
+                }
+                starts[slot] = -1;
+            }
+        }
+
+        if (extends)
+        {
+            int slot = depth - operands;
+            starts[slot] = operands == 0 ? i : starts[slot];
+            ends[slot] = i;
+            for (int consumed = slot + 1; consumed < depth; ++consumed)
+            {
+                starts[consumed] = -1;
+            }
+        }
+    }
+
+    FREE_ARRAY(ends, int, width);
+    FREE_ARRAY(starts, int, width);
+    FREE_ARRAY(is_fixed, bool, width);
+    return width + count <= UINT8_COUNT ? count : 0;
+}
+
+// Rewrites the function with the loop's slots pushed in front of it and popped where it's left.
+// A global's slot starts out nil for OP_GET_HOISTED to fill, and pure code is run there once.
+// Slots the loop uses above them move up to make room. Returns false, leaving the chunk as it
+// was, if a jump no longer fits.
+static bool hoist_loop(Body *body, Loop *loop, int *plan, Hoist *hoists, int count)
+{
+    Chunk *chunk = body->chunk;
+    Instr *instrs = body->instrs;
+    int *new_offset = ALLOCATE(int, body->count + 1);
+    int *patch_at = ALLOCATE(int, body->count);
+    int entry = 0;
+    int exit = 0;
+
+    Chunk code;
+    init_chunk(&code);
+
+    for (int i = 0; i < body->count; ++i)
+    {
+        Instr *instr = &instrs[i];
+        uint8_t *bytes = &chunk->code[instr->offset];
+
+        if (i == loop->start)
+        {
+            entry = code.count;
+            for (int h = 0; h < count; ++h)
+            {
+                if (hoists[h].name != NULL)
+                {
+                    append_to_chunk(&code, OP_NIL, instr->line_no);
+                    continue;
+                }
+                for (int j = hoists[h].start; j <= hoists[h].end; ++j)
+                {
+                    for (int b = 0; b < instrs[j].length; ++b)
+                    {
+                        append_to_chunk(&code, chunk->code[instrs[j].offset + b], instrs[j].line_no);
+                    }
+                }
+            }
+        }
+        if (i == loop->exit)
+        {
+            exit = code.count;
+            for (int h = 0; h < count; ++h)
+            {
+                append_to_chunk(&code, OP_POP, instrs[loop->end].line_no);
+            }
+        }
+
+        new_offset[i] = code.count;
+        if (plan[i] == -2)
+        {
+            continue;
+        }
+        if (plan[i] >= 0)
+        {
+            bool is_global = instr->op == OP_GET_GLOBAL;
+            append_to_chunk(&code, is_global ? OP_GET_HOISTED : OP_GET_LOCAL, instr->line_no);
+            if (is_global)
+            {
+                append_to_chunk(&code, bytes[1], instr->line_no);
+            }
+            append_to_chunk(&code, plan[i], instr->line_no);
+            continue;
+        }
+
+        int slot_at = -1;
+        if (i >= loop->start && i <= loop->end)
+        {
+            uint8_t op = instr->op;
+            slot_at = op == OP_GET_HOISTED ? 2
+                      : op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_FOR_PREP || op == OP_FOR_ITER ? 1
+                                                                                                             : -1;
+        }
+        for (int b = 0; b < instr->length; ++b)
+        {
+            int byte = b == slot_at && bytes[b] >= loop->depth ? bytes[b] + count : bytes[b];
+            append_to_chunk(&code, byte, instr->line_no);
+        }
+        patch_at[i] = code.count - 2;
+    }
+    new_offset[body->count] = code.count;
+
+    bool fits = true;
+    for (int i = 0; i < body->count && fits; ++i)
+    {
+        Instr *instr = &instrs[i];
+        if (instr->target < 0)
+        {
+            continue;
+        }
+
+        bool is_inside = i >= loop->start && i <= loop->end;
+        int target = instr->target == loop->start && !is_inside ? entry
+                     : instr->target == loop->exit && is_inside ? exit
+                                                                 : new_offset[instr->target];
+        int distance = target - (patch_at[i] + 2);
+        if (is_backward(instr->op))
+        {
+            distance = -distance;
+        }
+        fits = distance >= 0 && distance <= UINT16_MAX;
+        code.code[patch_at[i]] = (distance >> 8) & 0xff;
+        code.code[patch_at[i] + 1] = distance & 0xff;
+    }
+
+    if (fits)
+    {
+        replace_code(body, &code, new_offset);
+    }
+    else
+    {
+        free_chunk(&code);
+    }
+
+    FREE_ARRAY(patch_at, int, body->count);
+    FREE_ARRAY(new_offset, int, body->count + 1);
+    return fits;
+}
+
+// Moves what stays the same while a loop runs out in front of it, into slots under the ones the
+// loop uses. Outer loops go first, so whatever none of the loops change is only done once. A
+// loop with calls in it is left alone, since the call could change globals or, through a
+// closure, locals.
+void hoist_invariants(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    bool changed = true;
+
+    while (changed)
+    {
+        changed = false;
+
+        Body body;
+        body.chunk = chunk;
+        decode(&body);
+        find_targets(&body);
+        int code_count = chunk->count;
+        int *offset_depths = ALLOCATE(int, code_count);
+        find_depths(chunk, 0, code_count, function->arity + 1, offset_depths);
+        int *depths = ALLOCATE(int, body.count);
+        int *plan = ALLOCATE(int, body.count);
+        Loop *loops = ALLOCATE(Loop, body.count);
+        int loop_count = 0;
+
+        for (int i = 0; i < body.count; ++i)
+        {
+            depths[i] = offset_depths[body.instrs[i].offset];
+        }
+
+        // Sorted outermost first: by start, then by end from the last.
+        for (int i = 0; i < body.count; ++i)
+        {
+            Loop loop;
+            if (!is_backward(body.instrs[i].op) || !find_loop(&body, depths, i, &loop))
+            {
+                continue;
+            }
+
+            int at = loop_count++;
+            while (at > 0 && (loops[at - 1].start > loop.start ||
+                              (loops[at - 1].start == loop.start && loops[at - 1].end < loop.end)))
+            {
+                loops[at] = loops[at - 1];
+                --at;
+            }
+            loops[at] = loop;
+        }
+
+        for (int l = 0; l < loop_count && !changed; ++l)
+        {
+            for (int i = 0; i < body.count; ++i)
+            {
+                plan[i] = -1;
+            }
+
+            Hoist hoists[UINT8_COUNT];
+            int count = plan_hoists(&body, depths, &loops[l], plan, hoists);
+            changed = count > 0 && hoist_loop(&body, &loops[l], plan, hoists, count);
+        }
+
+        FREE_ARRAY(loops, Loop, body.count);
+        FREE_ARRAY(plan, int, body.count);
+        FREE_ARRAY(depths, int, body.count);
+        FREE_ARRAY(offset_depths, int, code_count);
+        FREE_ARRAY(body.instrs, Instr, body.count);
+    }
+}
+
+// The deepest the stack gets in a call to the function, so the VM can check for room once per
+// call instead of on every push.
+int max_stack_depth(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int *depths = ALLOCATE(int, chunk->count);
+    find_depths(chunk, 0, chunk->count, function->arity + 1, depths);
+
+    int max = function->arity + 1;
+    for (int offset = 0; offset < chunk->count; offset += instr_length(chunk, offset))
+    {
+        int after = depths[offset] + stack_effect(chunk, offset);
+        if (depths[offset] >= 0 && after > max)
+        {
+            max = after;
+        }
+    }
+
+    FREE_ARRAY(depths, int, chunk->count);
+    return max;
+}
@@ -0,0 +1,15 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+#include "obj.h"
+
+void optimize_chunk(ObjFunction *function);
+int stack_depth_at(Chunk *chunk, int start, int depth, int offset);
+bool can_inline(ObjFunction *function);
+bool inline_function(Chunk *chunk, ObjFunction *function, int base);
+void specialize_arithmetic(ObjFunction *function);
+void hoist_invariants(ObjFunction *function);
+int max_stack_depth(ObjFunction *function);
+
+#endif
@@ -0,0 +1,509 @@
+#define _DEFAULT_SOURCE
+
+#include "pool.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "chunk.h"
+#include "compiler.h"
+#include "isolate.h"
+#include "native.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
+
+// The indexes from begin to end that one thread has left, packed into a word so the owner taking
+// from the front and thieves splitting off the back can't both get the same index.
+typedef struct
+{
+    uint64_t range;
+    char padding[CACHE_LINE - sizeof(uint64_t)];
+} Share;
+
+// A call of parallelMap(). Each thread runs the function in a VM of its own, from one copy of it
+// made with the globals it reads, and leaves a copy of each result for the caller.
+typedef struct
+{
+    Writer copy;
+    Writer *results;
+    Share *shares;
+    bool failed;
+} Job;
+
+static pthread_once_t pool_started = PTHREAD_ONCE_INIT;
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int worker_count = 0;
+static Job *current_job = NULL;
+// Workers still on the current job. Its caller sleeps on this until it's zero. It lives here
+// rather than in the job, which the caller frees, so the last worker can wake it safely.
+static int busy = 0;
+// Workers sleep on this between jobs. Submitting a job bumps it.
+static uint32_t generation = 0;
+
+// Every thread runs tasks in a VM of its own, kept between jobs. The caller's thread switches to
+// its one for the duration.
+static _Thread_local Vm *task_vm = NULL;
+static _Thread_local bool in_task = false;
+
+static uint64_t pack(uint32_t begin, uint32_t end)
+{
+    return (uint64_t)begin << 32 | end;
+}
+
+static int take_index(Share *share)
+{
+    uint64_t range = __atomic_load_n(&share->range, __ATOMIC_ACQUIRE);
+    while (true)
+    {
+        uint32_t begin = (uint32_t)(range >> 32);
+        uint32_t end = (uint32_t)range;
+        if (begin >= end)
+        {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(&share->range, &range, pack(begin + 1, end), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return (int)begin;
+        }
+    }
+}
+
+// Moves the back half of another thread's indexes to the thief's empty share.
+static bool steal(Job *job, int thief, int share_count)
+{
+    for (int i = 1; i < share_count; ++i)
+    {
+        Share *victim = &job->shares[(thief + i) % share_count];
+        uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (true)
+        {
+            uint32_t begin = (uint32_t)(range >> 32);
+            uint32_t end = (uint32_t)range;
+            if (begin >= end)
+            {
+                break;
+            }
+
+            uint32_t middle = begin + (end - begin) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, pack(begin, middle), true,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                __atomic_store_n(&job->shares[thief].range, pack(middle, end), __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Runs the job's tasks on this thread's task VM until no thread has any left.
+static void work_on(Job *job, int id)
+{
+    Vm *caller = vm;
+    if (task_vm == NULL)
+    {
+        task_vm = malloc(sizeof(Vm));
+        init_vm(task_vm);
+    }
+    use_vm(task_vm);
+    in_task = true;
+
+    // Only the globals copied with the function are left, so nothing from an earlier job is.
+    free_table(&vm->globals);
+    init_table(&vm->globals);
+
+    Reader reader;
+    init_reader(&reader, job->copy.bytes, job->copy.count);
+    int count;
+    if (!read_copy(&reader, &count))
+    {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        // The function stays at the bottom of the stack, out of the collector's way.
+        Value function = vm->stack_top[-1];
+        int share_count = worker_count + 1;
+        while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+        {
+            int index = take_index(&job->shares[id]);
+            if (index == -1)
+            {
+                if (steal(job, id, share_count))
+                {
+                    continue;
+                }
+                break;
+            }
+
+            push(function);
+            push(NUMBER_VAL(index));
+            Value result;
+            if (call_function(1, &result) != INTERPRET_OK)
+            {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+
+            push(result);
+            if (!write_copy(&job->results[index], &vm->stack_top[-1], 1, NULL))
+            {
+                __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+            }
+            pop();
+        }
+    }
+    vm->stack_top = vm->stack;
+
+    in_task = false;
+    use_vm(caller);
+}
+
+static void *run_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint32_t seen = 0;
+
+    while (true)
+    {
+        uint32_t now;
+        while ((now = __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) == seen)
+        {
+            syscall(SYS_futex, &generation, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+        }
+        seen = now;
+
+        Job *job = __atomic_load_n(&current_job, __ATOMIC_ACQUIRE);
+        work_on(job, id);
+        if (__atomic_sub_fetch(&busy, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            syscall(SYS_futex, &busy, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+    }
+    return NULL;
+}
+
+// One worker for each processor but the caller's, or as many as CLOX_WORKERS asks for. Workers
+// that can't be started are done without.
+static void start_pool()
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    const char *forced = getenv("CLOX_WORKERS");
+    if (forced != NULL)
+    {
+        workers = strtol(forced, NULL, 10);
+    }
+
+    for (long i = 0; i < workers; ++i)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        int failed = pthread_create(&thread, &attr, run_worker, (void *)(intptr_t)worker_count);
+        pthread_attr_destroy(&attr);
+        if (failed)
+        {
+            break;
+        }
+        ++worker_count;
+    }
+}
+
+static void run_job(Job *job, int count)
+{
+    pthread_mutex_lock(&submit_lock);
+
+    int share_count = worker_count + 1;
+    for (int i = 0; i < share_count; ++i)
+    {
+        uint32_t begin = (uint32_t)((int64_t)count * i / share_count);
+        uint32_t end = (uint32_t)((int64_t)count * (i + 1) / share_count);
+        job->shares[i].range = pack(begin, end);
+    }
+    busy = worker_count;
+
+    __atomic_store_n(&current_job, job, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    syscall(SYS_futex, &generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+
+    work_on(job, worker_count);
+
+    int left;
+    while ((left = __atomic_load_n(&busy, __ATOMIC_ACQUIRE)) > 0)
+    {
+        syscall(SYS_futex, &busy, FUTEX_WAIT_PRIVATE, left, NULL, NULL, 0);
+    }
+
+    pthread_mutex_unlock(&submit_lock);
+}
+
+// The objects a task could run code from, in the order they were found.
+typedef struct
+{
+    Obj **objs;
+    int count;
+    int capacity;
+} Callables;
+
+// Queues the value if calling it, or anything reached through it, could run code.
+static void add_callable(Callables *callables, Value value)
+{
+    if (!IS_OBJ(value))
+    {
+        return;
+    }
+    Obj *obj = AS_OBJ(value);
+    if (obj->type != OBJ_CLOSURE && obj->type != OBJ_FUNCTION && obj->type != OBJ_CLASS &&
+        obj->type != OBJ_BOUND_METHOD && obj->type != OBJ_INSTANCE)
+    {
+        return;
+    }
+
+    for (int i = 0; i < callables->count; ++i)
+    {
+        if (callables->objs[i] == obj)
+        {
+            return;
+        }
+    }
+    if (callables->count == callables->capacity)
+    {
+        callables->capacity = callables->capacity < 8 ? 8 : callables->capacity * 2;
+        callables->objs = realloc(callables->objs, sizeof(Obj *) * callables->capacity);
+    }
+    callables->objs[callables->count++] = obj;
+}
+
+static void add_table(Callables *callables, Table *table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        if (table->entries[i].key != NULL)
+        {
+            add_callable(callables, table->entries[i].val);
+        }
+    }
+}
+
+// Queues what a closure, class, bound method or instance holds that could run code. Functions are
+// left to collect_globals(), which compiles them first.
+static void add_parts(Callables *callables, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        add_callable(callables, OBJ_VAL(closure->function));
+        for (int i = 0; i < closure->capture_count; ++i)
+        {
+            add_callable(callables, closure->captures[i]);
+        }
+        for (int i = 0; i < closure->upvalue_count; ++i)
+        {
+            add_callable(callables, *closure->upvalues[i]->location);
+        }
+        break;
+    }
+    case OBJ_CLASS:
+        add_table(callables, &((ObjClass *)obj)->methods);
+        break;
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        add_callable(callables, bound->receiver);
+        add_callable(callables, OBJ_VAL(bound->method));
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)obj;
+        add_callable(callables, OBJ_VAL(instance->klass));
+        add_table(callables, &instance->fields);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Tasks can read globals holding functions, classes and natives, which are copied to them along
+// with the function. Anything else a global holds could change under them, so functions that
+// read such globals, or assign any, are refused. Every function the callee can reach is checked,
+// through closures, classes, bound methods and instances. Reports why and returns false if so.
+static bool collect_globals(Value callee, Table *reads)
+{
+    Callables callables = {NULL, 0, 0};
+    add_callable(&callables, callee);
+
+    bool pure = true;
+    for (int i = 0; i < callables.count && pure; ++i)
+    {
+        if (callables.objs[i]->type != OBJ_FUNCTION)
+        {
+            add_parts(&callables, callables.objs[i]);
+            continue;
+        }
+
+        ObjFunction *function = (ObjFunction *)callables.objs[i];
+        if (function->source != NULL && !compile_body(function))
+        {
+            runtime_error("parallelMap() cannot run a function that doesn't compile.");
+            pure = false;
+            break;
+        }
+
+        Chunk *chunk = &function->chunk;
+        for (int j = 0; j < chunk->constants.count; ++j)
+        {
+            add_callable(&callables, chunk->constants.values[j]);
+        }
+
+        for (int offset = 0; offset < chunk->count && pure; offset += instr_length(chunk, offset))
+        {
+            uint8_t *code = &chunk->code[offset];
+            bool is_wide = code[0] == OP_WIDE;
+            uint8_t instr = is_wide ? code[1] : code[0];
+            if (instr != OP_GET_GLOBAL && instr != OP_SET_GLOBAL && instr != OP_DEFINE_GLOBAL)
+            {
+                continue;
+            }
+            int index = is_wide ? (code[2] << 8) | code[3] : code[1];
+
+            ObjString *name = AS_STRING(chunk->constants.values[index]);
+            Value value;
+            if (instr != OP_GET_GLOBAL)
+            {
+                runtime_error("parallelMap() cannot run a function that assigns global '%.*s'.",
+                              name->length, name->chars);
+                pure = false;
+            }
+            else if (!table_get(&vm->globals, name, &value))
+            {
+                // Left undefined, for the task to report.
+            }
+            else if (IS_CLOSURE(value) || IS_CLASS(value) || IS_NATIVE(value))
+            {
+                table_put(reads, name, value);
+                add_callable(&callables, value);
+            }
+            else
+            {
+                runtime_error("parallelMap() cannot run a function that reads global variable '%.*s'.",
+                              name->length, name->chars);
+                pure = false;
+            }
+        }
+    }
+
+    free(callables.objs);
+    return pure;
+}
+
+// parallelMap(fn, n) calls fn(i) for each i from 0 to n - 1 across the pool, and returns a
+// channel holding the results in order.
+bool parallel_map_native(int arg_count, Value *args)
+{
+    if (!check_arg_count("parallelMap", arg_count, 2, 2))
+    {
+        return false;
+    }
+    if (!IS_CLOSURE(args[0]) && !IS_BOUND_METHOD(args[0]))
+    {
+        runtime_error("parallelMap() expects a function as argument 1.");
+        return false;
+    }
+    if (!IS_NUMBER(args[1]) || !is_int(AS_NUMBER(args[1])) || AS_NUMBER(args[1]) < 0)
+    {
+        runtime_error("parallelMap() expects a non-negative integer as argument 2.");
+        return false;
+    }
+    if (in_task)
+    {
+        runtime_error("parallelMap() cannot be called from a parallelMap() task.");
+        return false;
+    }
+
+    int count = (int)AS_NUMBER(args[1]);
+    Table reads;
+    init_table(&reads);
+    bool pure = collect_globals(args[0], &reads);
+
+    Job job;
+    init_writer(&job.copy);
+    if (pure && !write_copy(&job.copy, &args[0], 1, &reads))
+    {
+        runtime_error("parallelMap() cannot copy the function.");
+        pure = false;
+    }
+    free_table(&reads);
+    if (!pure)
+    {
+        free_writer(&job.copy);
+        return false;
+    }
+
+    pthread_once(&pool_started, start_pool);
+
+    void *shares = NULL;
+    job.results = malloc(sizeof(Writer) * (count + 1));
+    if (job.results == NULL ||
+        posix_memalign(&shares, CACHE_LINE, sizeof(Share) * (worker_count + 1)) != 0)
+    {
+        free(job.results);
+        release_copy(job.copy.bytes, job.copy.count);
+        free_writer(&job.copy);
+        runtime_error("parallelMap() cannot allocate memory for %d tasks.", count);
+        return false;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        init_writer(&job.results[i]);
+    }
+    job.shares = shares;
+    job.failed = false;
+
+    if (count > 0)
+    {
+        run_job(&job, count);
+    }
+
+    Channel *results = NULL;
+    if (!job.failed)
+    {
+        results = open_channel();
+        for (int i = 0; i < count; ++i)
+        {
+            send_copy(results, &job.results[i]);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            release_copy(job.results[i].bytes, job.results[i].count);
+            free_writer(&job.results[i]);
+        }
+    }
+
+    free(job.results);
+    free(job.shares);
+    release_copy(job.copy.bytes, job.copy.count);
+    free_writer(&job.copy);
+
+    if (results == NULL)
+    {
+        runtime_error("A parallelMap() task failed.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(new_channel(results));
+    return true;
+}
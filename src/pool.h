@@ -0,0 +1,9 @@
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include "common.h"
+#include "value.h"
+
+bool parallel_map_native(int arg_count, Value *args);
+
+#endif
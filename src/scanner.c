@@ -2,20 +2,64 @@
 #include <string.h>
 #include "common.h"
 
-typedef struct
-{
-    const char *start;
-    const char *current;
-    int line_no;
-} Scanner;
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 16
+#endif
 
-Scanner scanner;
+#define SCALAR_PREFIX 8
+#define KEYWORD_HASH_SIZE 32
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
 
-void init_scanner(const char *source)
+typedef struct
+{
+    const char *name;
+    int length;
+    TokenType type;
+} Keyword;
+
+_Thread_local Scanner scanner;
+
+// Indexed by keyword_hash(). The hash is collision-free over the keyword set, so a single probe
+// and comparison classifies any identifier.
+static const Keyword keywords[KEYWORD_HASH_SIZE] = {
+    [17] = {"and", 3, TK_AND},
+    [21] = {"class", 5, TK_CLASS},
+    [28] = {"else", 4, TK_ELSE},
+    [0] = {"false", 5, TK_FALSE},
+    [8] = {"for", 3, TK_FOR},
+    [26] = {"fun", 3, TK_FUN},
+    [24] = {"if", 2, TK_IF},
+    [22] = {"nil", 3, TK_NIL},
+    [20] = {"or", 2, TK_OR},
+    [27] = {"print", 5, TK_PRINT},
+    [29] = {"return", 6, TK_RETURN},
+    [16] = {"super", 5, TK_SUPER},
+    [12] = {"this", 4, TK_THIS},
+    [10] = {"true", 4, TK_TRUE},
+    [30] = {"var", 3, TK_VAR},
+    [25] = {"while", 5, TK_WHILE},
+};
+
+// The source must be followed by a NUL byte at source[length].
+void init_scanner(const char *source, size_t length, int line_no)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line_no = 1;
+    scanner.end = source + length;
+    scanner.line_no = line_no;
+}
+
+Scanner save_scanner()
+{
+    return scanner;
+}
+
+void restore_scanner(Scanner saved)
+{
+    scanner = saved;
 }
 
 static bool is_alpha(char c)
@@ -66,6 +110,109 @@ static bool match(char expected)
     return true;
 }
 
+#ifdef __SSE2__
+static __m128i in_range(__m128i block, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(block, _mm_set1_epi8(hi + 1)));
+}
+
+// Advances past the leading bytes of 16-byte blocks whose mask bit is set. Returns false once a
+// block contains a byte outside the run, leaving the scalar code to look at that byte.
+static bool skip_run(int mask)
+{
+    if (mask == 0xffff)
+    {
+        scanner.current += SIMD_WIDTH;
+        return true;
+    }
+
+    scanner.current += __builtin_ctz(~mask);
+    return false;
+}
+#endif
+
+static void skip_identifier_chars()
+{
+    for (int i = 0; i < SCALAR_PREFIX; ++i)
+    {
+        if (!is_alpha(peek()) && !is_digit(peek()))
+        {
+            return;
+        }
+        advance();
+    }
+
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SIMD_WIDTH)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)scanner.current);
+        __m128i letters = _mm_or_si128(in_range(block, 'a', 'z'), in_range(block, 'A', 'Z'));
+        __m128i others = _mm_or_si128(in_range(block, '0', '9'), _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+
+        if (!skip_run(_mm_movemask_epi8(_mm_or_si128(letters, others))))
+        {
+            return;
+        }
+    }
+#endif
+
+    while (is_alpha(peek()) || is_digit(peek()))
+    {
+        advance();
+    }
+}
+
+static void skip_digits()
+{
+    for (int i = 0; i < SCALAR_PREFIX; ++i)
+    {
+        if (!is_digit(peek()))
+        {
+            return;
+        }
+        advance();
+    }
+
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SIMD_WIDTH)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)scanner.current);
+
+        if (!skip_run(_mm_movemask_epi8(in_range(block, '0', '9'))))
+        {
+            return;
+        }
+    }
+#endif
+
+    while (is_digit(peek()))
+    {
+        advance();
+    }
+}
+
+static int count_newlines(const char *start, const char *end)
+{
+    int count = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - start >= SIMD_WIDTH; start += SIMD_WIDTH)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)start);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+#endif
+
+    for (; start < end; ++start)
+    {
+        count += *start == '\n';
+    }
+
+    return count;
+}
+
 static Token make_token(TokenType type)
 {
     Token token;
@@ -86,6 +233,59 @@ static Token error_token(const char *message)
     return token;
 }
 
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+static void skip_blanks()
+{
+    for (int i = 0; i < SCALAR_PREFIX; ++i)
+    {
+        char c = peek();
+        if (!is_blank(c))
+        {
+            return;
+        }
+        if (c == '\n')
+        {
+            ++scanner.line_no;
+        }
+        advance();
+    }
+
+#ifdef __SSE2__
+    while (scanner.end - scanner.current >= SIMD_WIDTH)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)scanner.current);
+        __m128i newlines = _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'));
+        __m128i blanks = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+                                      _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+        blanks = _mm_or_si128(blanks, _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+
+        int mask = _mm_movemask_epi8(_mm_or_si128(blanks, newlines));
+        int run = mask == 0xffff ? SIMD_WIDTH : __builtin_ctz(~mask);
+
+        scanner.line_no += __builtin_popcount(_mm_movemask_epi8(newlines) & ((1 << run) - 1));
+        scanner.current += run;
+
+        if (run < SIMD_WIDTH)
+        {
+            return;
+        }
+    }
+#endif
+
+    while (is_blank(peek()))
+    {
+        if (peek() == '\n')
+        {
+            ++scanner.line_no;
+        }
+        advance();
+    }
+}
+
 static void skip_whitespace()
 {
     while (true)
@@ -96,24 +296,17 @@ static void skip_whitespace()
         case ' ':
         case '\r':
         case '\t':
-        {
-            advance();
-            break;
-        }
         case '\n':
         {
-            ++scanner.line_no;
-            advance();
+            skip_blanks();
             break;
         }
         case '/':
         {
             if (peek_next() == '/')
             {
-                while (peek() != '\n' && !is_at_end())
-                {
-                    advance();
-                }
+                const char *newline = memchr(scanner.current, '\n', scanner.end - scanner.current);
+                scanner.current = newline != NULL ? newline : scanner.end;
             }
             else
             {
@@ -130,97 +323,50 @@ static void skip_whitespace()
     }
 }
 
-static TokenType check_keyword(int start, int length, const char *rest, TokenType type)
+static int keyword_hash(const char *start, int length)
 {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
-    {
-        return type;
-    }
-
-    return TK_IDENTIFIER;
+    return ((unsigned char)start[0] * 4 + (unsigned char)start[1] * 3 + length) & (KEYWORD_HASH_SIZE - 1);
 }
 
 static TokenType identifier_type()
 {
-    switch (scanner.start[0])
+    int length = (int)(scanner.current - scanner.start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
     {
-    case 'a':
-        return check_keyword(1, 2, "nd", TK_AND);
-    case 'c':
-        return check_keyword(1, 4, "lass", TK_CLASS);
-    case 'e':
-        return check_keyword(1, 3, "lse", TK_ELSE);
-    case 'f':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'a':
-                return check_keyword(2, 3, "lse", TK_FALSE);
-            case 'o':
-                return check_keyword(2, 1, "r", TK_FOR);
-            case 'u':
-                return check_keyword(2, 1, "n", TK_FUN);
-            }
-        }
-        break;
-    case 'i':
-        return check_keyword(1, 1, "f", TK_IF);
-    case 'n':
-        return check_keyword(1, 2, "il", TK_NIL);
-    case 'o':
-        return check_keyword(1, 1, "r", TK_OR);
-    case 'p':
-        return check_keyword(1, 4, "rint", TK_PRINT);
-    case 'r':
-        return check_keyword(1, 5, "eturn", TK_RETURN);
-    case 's':
-        return check_keyword(1, 4, "uper", TK_SUPER);
-    case 't':
-        if (scanner.current - scanner.start > 1)
+        return TK_IDENTIFIER;
+    }
+
+    const Keyword *keyword = &keywords[keyword_hash(scanner.start, length)];
+    if (keyword->length != length)
+    {
+        return TK_IDENTIFIER;
+    }
+
+    for (int i = 0; i < length; ++i)
+    {
+        if (scanner.start[i] != keyword->name[i])
         {
-            switch (scanner.start[1])
-            {
-            case 'h':
-                return check_keyword(2, 2, "is", TK_THIS);
-            case 'r':
-                return check_keyword(2, 2, "ue", TK_TRUE);
-            }
+            return TK_IDENTIFIER;
         }
-        break;
-    case 'v':
-        return check_keyword(1, 2, "ar", TK_VAR);
-    case 'w':
-        return check_keyword(1, 4, "hile", TK_WHILE);
     }
-    return TK_IDENTIFIER;
+
+    return keyword->type;
 }
 
 static Token identifier()
 {
-    while (is_alpha(peek()) || is_digit(peek()))
-    {
-        advance();
-    }
-
+    skip_identifier_chars();
     return make_token(identifier_type());
 }
 
 static Token number()
 {
-    while (is_digit(peek()))
-    {
-        advance();
-    }
+    skip_digits();
 
     if (peek() == '.' && is_digit(peek_next()))
     {
         advance();
-        while (is_digit(peek()))
-        {
-            advance();
-        }
+        skip_digits();
     }
 
     return make_token(TK_NUMBER);
@@ -228,14 +374,11 @@ static Token number()
 
 static Token string()
 {
-    while (peek() != '"' && !is_at_end())
-    {
-        if (peek() == '\n')
-        {
-            ++scanner.line_no;
-        }
-        advance();
-    }
+    const char *quote = memchr(scanner.current, '"', scanner.end - scanner.current);
+    const char *stop = quote != NULL ? quote : scanner.end;
+
+    scanner.line_no += count_newlines(scanner.current, stop);
+    scanner.current = stop;
 
     if (is_at_end())
     {
@@ -1,6 +1,8 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#include "common.h"
+
 typedef enum
 {
     TK_LEFT_PAREN,
@@ -60,7 +62,17 @@ typedef struct
     int line_no;
 } Token;
 
-void init_scanner(const char *source);
+typedef struct
+{
+    const char *start;
+    const char *current;
+    const char *end;
+    int line_no;
+} Scanner;
+
+void init_scanner(const char *source, size_t length, int line_no);
 Token scan_token();
+Scanner save_scanner();
+void restore_scanner(Scanner saved);
 
 #endif
@@ -0,0 +1,553 @@
+#include "serialize.h"
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "vm.h"
+
+typedef enum
+{
+    TAG_NIL,
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_FUNCTION,
+} ValueTag;
+
+void init_writer(Writer *writer)
+{
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+void free_writer(Writer *writer)
+{
+    free(writer->bytes);
+    init_writer(writer);
+}
+
+void write_bytes(Writer *writer, const void *bytes, size_t count)
+{
+    if (writer->capacity < writer->count + count)
+    {
+        while (writer->capacity < writer->count + count)
+        {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+void write_u8(Writer *writer, uint8_t value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+void write_u32(Writer *writer, uint32_t value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+void write_u64(Writer *writer, uint64_t value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+void write_string(Writer *writer, ObjString *string)
+{
+    write_u32(writer, (uint32_t)string->length);
+    write_bytes(writer, string->chars, string->length);
+}
+
+// The compiler only puts numbers, strings and functions in constant tables.
+static void write_constant(Writer *writer, Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        write_u8(writer, TAG_NUMBER);
+        write_bytes(writer, &value.as.number, sizeof(double));
+    }
+    else if (IS_STRING(value))
+    {
+        write_u8(writer, TAG_STRING);
+        write_string(writer, AS_STRING(value));
+    }
+    else if (IS_FUNCTION(value))
+    {
+        write_u8(writer, TAG_FUNCTION);
+        write_function(writer, AS_FUNCTION(value));
+    }
+    else if (IS_BOOLEAN(value))
+    {
+        write_u8(writer, AS_BOOLEAN(value) ? TAG_TRUE : TAG_FALSE);
+    }
+    else
+    {
+        write_u8(writer, TAG_NIL);
+    }
+}
+
+// Writes everything about the function but its constants. Inline caches are written empty,
+// since what they hold only means something in this process.
+void write_function_body(Writer *writer, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    write_u32(writer, (uint32_t)function->arity);
+    write_u32(writer, (uint32_t)function->upvalue_count);
+    write_u32(writer, (uint32_t)function->capture_count);
+    write_u32(writer, (uint32_t)function->max_stack);
+    write_u32(writer, (uint32_t)chunk->cache_count);
+
+    write_u8(writer, function->name != NULL);
+    if (function->name != NULL)
+    {
+        write_string(writer, function->name);
+    }
+
+    write_u32(writer, (uint32_t)chunk->count);
+    write_bytes(writer, chunk->code, chunk->count);
+
+    write_u32(writer, (uint32_t)chunk->line_count);
+    for (int i = 0; i < chunk->line_count; ++i)
+    {
+        write_u32(writer, (uint32_t)chunk->lines[i].offset);
+        write_u32(writer, (uint32_t)chunk->lines[i].line_no);
+    }
+
+    write_u32(writer, (uint32_t)chunk->site_count);
+    for (int i = 0; i < chunk->site_count; ++i)
+    {
+        write_u32(writer, (uint32_t)chunk->sites[i].start);
+        write_u32(writer, (uint32_t)chunk->sites[i].end);
+        write_u32(writer, (uint32_t)chunk->sites[i].line_no);
+        write_string(writer, chunk->sites[i].name);
+    }
+}
+
+// Writes the function with its constants, nested functions included.
+void write_function(Writer *writer, ObjFunction *function)
+{
+    write_function_body(writer, function);
+
+    Chunk *chunk = &function->chunk;
+    write_u32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i)
+    {
+        write_constant(writer, chunk->constants.values[i]);
+    }
+}
+
+void init_reader(Reader *reader, const void *bytes, size_t count)
+{
+    reader->bytes = bytes;
+    reader->count = count;
+    reader->offset = 0;
+    reader->failed = false;
+}
+
+// Returns the next count bytes, or NULL when there aren't that many left.
+const uint8_t *read_bytes(Reader *reader, size_t count)
+{
+    if (reader->failed || count > reader->count - reader->offset)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+uint8_t read_u8(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, sizeof(uint8_t));
+    return bytes != NULL ? *bytes : 0;
+}
+
+uint32_t read_u32(Reader *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL)
+    {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+uint64_t read_u64(Reader *reader)
+{
+    uint64_t value = 0;
+    const uint8_t *bytes = read_bytes(reader, sizeof(value));
+    if (bytes != NULL)
+    {
+        memcpy(&value, bytes, sizeof(value));
+    }
+    return value;
+}
+
+// Whether count items of the given size could still be read, checked before allocating for them.
+bool has_room(Reader *reader, uint32_t count, size_t size)
+{
+    if (reader->failed || count > (reader->count - reader->offset) / size)
+    {
+        reader->failed = true;
+        return false;
+    }
+    return true;
+}
+
+ObjString *read_string(Reader *reader)
+{
+    uint32_t length = read_u32(reader);
+    const uint8_t *chars = read_bytes(reader, length);
+    return chars != NULL ? copy_string((const char *)chars, (int)length) : NULL;
+}
+
+static Value read_constant(Reader *reader)
+{
+    switch (read_u8(reader))
+    {
+    case TAG_FALSE:
+        return BOOLEAN_VAL(false);
+    case TAG_TRUE:
+        return BOOLEAN_VAL(true);
+    case TAG_NUMBER:
+    {
+        double number = 0;
+        const uint8_t *bytes = read_bytes(reader, sizeof(double));
+        if (bytes != NULL)
+        {
+            memcpy(&number, bytes, sizeof(double));
+        }
+        return NUMBER_VAL(number);
+    }
+    case TAG_STRING:
+    {
+        ObjString *string = read_string(reader);
+        return string != NULL ? OBJ_VAL(string) : NIL_VAL;
+    }
+    case TAG_FUNCTION:
+    {
+        ObjFunction *function = read_function(reader);
+        return function != NULL ? OBJ_VAL(function) : NIL_VAL;
+    }
+    default:
+        return NIL_VAL;
+    }
+}
+
+// Fills in a blank function from what write_function_body() wrote. The function has to be
+// reachable by the GC already, since reading allocates.
+void read_function_body(Reader *reader, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    function->arity = (int)read_u32(reader);
+    function->upvalue_count = (int)read_u32(reader);
+    function->capture_count = (int)read_u32(reader);
+    function->max_stack = (int)read_u32(reader);
+
+    uint32_t cache_count = read_u32(reader);
+    if (cache_count > UINT8_COUNT)
+    {
+        reader->failed = true;
+    }
+    else if (cache_count > 0)
+    {
+        chunk->caches = ALLOCATE(InlineCache, cache_count);
+        memset(chunk->caches, 0, sizeof(InlineCache) * cache_count);
+        chunk->cache_count = (int)cache_count;
+    }
+
+    if (read_u8(reader))
+    {
+        function->name = read_string(reader);
+    }
+
+    uint32_t code_count = read_u32(reader);
+    const uint8_t *code = read_bytes(reader, code_count);
+    if (code != NULL && code_count > 0)
+    {
+        chunk->code = ALLOCATE(uint8_t, code_count);
+        memcpy(chunk->code, code, code_count);
+        chunk->count = chunk->capacity = (int)code_count;
+    }
+
+    uint32_t line_count = read_u32(reader);
+    if (has_room(reader, line_count, 2 * sizeof(uint32_t)))
+    {
+        chunk->lines = ALLOCATE(LineStart, line_count);
+        chunk->line_count = chunk->line_capacity = (int)line_count;
+        for (uint32_t i = 0; i < line_count; ++i)
+        {
+            chunk->lines[i].offset = (int)read_u32(reader);
+            chunk->lines[i].line_no = (int)read_u32(reader);
+        }
+    }
+
+    uint32_t site_count = read_u32(reader);
+    for (uint32_t i = 0; i < site_count && !reader->failed; ++i)
+    {
+        int start = (int)read_u32(reader);
+        int end = (int)read_u32(reader);
+        int line_no = (int)read_u32(reader);
+        ObjString *name = read_string(reader);
+        if (name != NULL)
+        {
+            push(OBJ_VAL(name));
+            add_inline_site(chunk, start, end, line_no, name);
+            pop();
+        }
+    }
+}
+
+static bool can_be_wide(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_name(Chunk *chunk, int index)
+{
+    return index < chunk->constants.count && IS_STRING(chunk->constants.values[index]);
+}
+
+// Checks the operands of the instruction at offset and sets its length. Jump targets are left
+// for check_function(), which knows where instructions start.
+static bool check_instr(ObjFunction *function, int offset, int *length)
+{
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = &chunk->code[offset];
+    int left = chunk->count - offset;
+    bool is_wide = code[0] == OP_WIDE;
+    uint8_t op = is_wide && left > 1 ? code[1] : code[0];
+    int operand = is_wide ? 2 : 1;
+
+    if (op >= OP_WIDE || (is_wide && !can_be_wide(op)))
+    {
+        return false;
+    }
+
+    // A closure's length depends on the function it names.
+    if (op == OP_CLOSURE)
+    {
+        int constant = left < operand + (is_wide ? 2 : 1) ? -1 : is_wide ? (code[2] << 8) | code[3] : code[1];
+        if (constant == -1 || constant >= chunk->constants.count ||
+            !IS_FUNCTION(chunk->constants.values[constant]))
+        {
+            return false;
+        }
+    }
+    *length = instr_length(chunk, offset);
+    if (*length > left)
+    {
+        return false;
+    }
+    int index = *length == 1 ? 0 : is_wide ? (code[2] << 8) | code[3] : code[1];
+
+    switch (op)
+    {
+    case OP_CONSTANT:
+        return index < chunk->constants.count;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        return index < function->max_stack;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        return index < function->upvalue_count;
+    case OP_GET_CAPTURE:
+        return index < function->capture_count;
+    case OP_GET_HOISTED:
+        return is_name(chunk, index) && code[2] < function->max_stack;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return is_name(chunk, index);
+    case OP_SUPER_INVOKE:
+        return is_name(chunk, index) && code[*length - 1] < chunk->cache_count;
+    case OP_FOR_PREP:
+        // The counter's slot is followed by the limit's.
+        return index + 1 < function->max_stack;
+    case OP_LOOP:
+        // A backward jump mustn't land before the code, which would also read as no jump at all.
+        return jump_target(chunk, offset) >= 0;
+    case OP_FOR_ITER:
+        return index + 1 < function->max_stack && code[3] < chunk->constants.count &&
+               IS_NUMBER(chunk->constants.values[code[3]]) && jump_target(chunk, offset) >= 0;
+    case OP_CLOSURE:
+    {
+        ObjFunction *closed = AS_FUNCTION(chunk->constants.values[index]);
+        int width = is_wide ? 3 : 2;
+        for (int i = 0; i < closed->upvalue_count + closed->capture_count; ++i)
+        {
+            uint8_t *variable = &code[operand + (is_wide ? 2 : 1) + i * width];
+            int slot = is_wide ? (variable[1] << 8) | variable[2] : variable[1];
+            int limit = variable[0]                     ? function->max_stack
+                        : i >= closed->upvalue_count ? function->capture_count
+                                                        : function->upvalue_count;
+            if (variable[0] > 1 || slot >= limit)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// Code read back from a file is checked before it can run, so a damaged or mismatched file is
+// turned away instead of reading or writing past what the function has. Every instruction has to
+// be known, with its operands in range: constants of the right type, slots within the frame,
+// upvalues, captures and caches the function has. Jumps have to land on instructions, and every
+// path has to end in a return or jump, keeping the same stack depth where paths meet and within
+// max_stack throughout.
+bool check_function(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0 || function->arity < 0 || function->arity > UINT16_MAX ||
+        function->upvalue_count < 0 || function->upvalue_count > UINT16_COUNT ||
+        function->capture_count < 0 || function->capture_count > UINT16_COUNT ||
+        function->max_stack < function->arity + 1)
+    {
+        return false;
+    }
+
+    int *lengths = calloc((size_t)chunk->count, sizeof(int));
+    int *depths = malloc(sizeof(int) * (size_t)chunk->count);
+    int *work = malloc(sizeof(int) * (size_t)chunk->count);
+    bool valid = true;
+
+    for (int offset = 0; offset < chunk->count && valid; offset += lengths[offset])
+    {
+        depths[offset] = -1;
+        valid = check_instr(function, offset, &lengths[offset]);
+    }
+
+    int work_count = 0;
+    if (valid)
+    {
+        depths[0] = function->arity + 1;
+        work[work_count++] = 0;
+    }
+
+    while (work_count > 0 && valid)
+    {
+        int offset = work[--work_count];
+        uint8_t op = chunk->code[offset];
+        int after = depths[offset] + stack_effect(chunk, offset);
+        if (after < (op == OP_RETURN ? 0 : 1) || after > function->max_stack)
+        {
+            valid = false;
+            break;
+        }
+
+        int successors[2];
+        int successor_count = 0;
+        int target = jump_target(chunk, offset);
+        if (target != -1)
+        {
+            successors[successor_count++] = target;
+        }
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN)
+        {
+            successors[successor_count++] = offset + lengths[offset];
+        }
+
+        for (int i = 0; i < successor_count && valid; ++i)
+        {
+            int next = successors[i];
+            if (next < 0 || next >= chunk->count || lengths[next] == 0)
+            {
+                valid = false;
+            }
+            else if (depths[next] == -1)
+            {
+                depths[next] = after;
+                work[work_count++] = next;
+            }
+            else
+            {
+                valid = depths[next] == after;
+            }
+        }
+    }
+
+    free(lengths);
+    free(depths);
+    free(work);
+    return valid;
+}
+
+// Reads back a function written by write_function(), or returns NULL when the data runs out.
+ObjFunction *read_function(Reader *reader)
+{
+    ObjFunction *function = new_function();
+    push(OBJ_VAL(function));
+    read_function_body(reader, function);
+
+    Chunk *chunk = &function->chunk;
+    uint32_t constant_count = read_u32(reader);
+    if (has_room(reader, constant_count, sizeof(uint8_t)))
+    {
+        for (uint32_t i = 0; i < constant_count && !reader->failed; ++i)
+        {
+            add_constant(chunk, read_constant(reader));
+        }
+    }
+
+    pop();
+    return reader->failed || !check_function(function) ? NULL : function;
+}
+
+// 64-bit FNV-1a.
+uint64_t hash_bytes(const void *bytes, size_t count)
+{
+    const uint8_t *data = bytes;
+    uint64_t hash = 14695981039346656037u;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211u;
+    }
+
+    return hash;
+}
@@ -0,0 +1,47 @@
+#ifndef CLOX_SERIALIZE_H
+#define CLOX_SERIALIZE_H
+
+#include "common.h"
+#include "obj.h"
+
+// A growing buffer that serialized data is appended to.
+typedef struct
+{
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+// Reads serialized data back. Running past the end sets failed instead of reading garbage.
+typedef struct
+{
+    const uint8_t *bytes;
+    size_t count;
+    size_t offset;
+    bool failed;
+} Reader;
+
+void init_writer(Writer *writer);
+void free_writer(Writer *writer);
+void write_bytes(Writer *writer, const void *bytes, size_t count);
+void write_u8(Writer *writer, uint8_t value);
+void write_u32(Writer *writer, uint32_t value);
+void write_u64(Writer *writer, uint64_t value);
+void write_string(Writer *writer, ObjString *string);
+void write_function_body(Writer *writer, ObjFunction *function);
+void write_function(Writer *writer, ObjFunction *function);
+
+void init_reader(Reader *reader, const void *bytes, size_t count);
+const uint8_t *read_bytes(Reader *reader, size_t count);
+uint8_t read_u8(Reader *reader);
+uint32_t read_u32(Reader *reader);
+uint64_t read_u64(Reader *reader);
+bool has_room(Reader *reader, uint32_t count, size_t size);
+ObjString *read_string(Reader *reader);
+void read_function_body(Reader *reader, ObjFunction *function);
+ObjFunction *read_function(Reader *reader);
+bool check_function(ObjFunction *function);
+
+uint64_t hash_bytes(const void *bytes, size_t count);
+
+#endif
@@ -0,0 +1,867 @@
+#define _DEFAULT_SOURCE
+
+#include "snapshot.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compiler.h"
+#include "isolate.h"
+#include "memory.h"
+#include "native.h"
+#include "serialize.h"
+#include "vm.h"
+
+// "CLXI" in little-endian order.
+#define IMAGE_MAGIC 0x49584c43
+#define IMAGE_VERSION 7
+
+typedef enum
+{
+    REF_NIL,
+    REF_FALSE,
+    REF_TRUE,
+    REF_NUMBER,
+    REF_STRING,
+    REF_OBJ,
+} RefTag;
+
+typedef struct
+{
+    Obj *obj;
+    uint32_t id;
+} ObjSlot;
+
+// Every object reachable from the globals, strings aside, along with a hash map from each one
+// to its position in the image's object table.
+typedef struct
+{
+    Obj **objs;
+    int count;
+    int capacity;
+    ObjSlot *slots;
+    int slot_capacity;
+    // Channels can only be copied to VMs in this process.
+    bool in_process;
+    // Set when a function body that was left for its first call doesn't compile, or a channel
+    // turns up in an image.
+    bool failed;
+} ObjIndex;
+
+// Objects read back so far, kept alive by mark_snapshot_roots() until the globals point at them.
+static _Thread_local Obj **loading = NULL;
+static _Thread_local uint32_t loaded_count = 0;
+static _Thread_local Table loaded_globals;
+
+static ObjSlot *find_slot(ObjSlot *slots, int capacity, Obj *obj)
+{
+    uintptr_t address = (uintptr_t)obj;
+    int index = (int)((address >> 4) ^ (address >> 16)) & (capacity - 1);
+
+    while (slots[index].obj != NULL && slots[index].obj != obj)
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &slots[index];
+}
+
+static void add_obj(ObjIndex *index, Obj *obj)
+{
+    if (obj == NULL || obj->type == OBJ_STRING)
+    {
+        return;
+    }
+    // Fibers and streams can't be copied, and a channel only means something inside the process.
+    if (obj->type == OBJ_FIBER || obj->type == OBJ_STREAM ||
+        (obj->type == OBJ_CHANNEL && !index->in_process))
+    {
+        index->failed = true;
+        return;
+    }
+
+    if (index->count + 1 > index->slot_capacity * 3 / 4)
+    {
+        int capacity = GROW_CAPACITY(index->slot_capacity) * 2;
+        ObjSlot *slots = calloc((size_t)capacity, sizeof(ObjSlot));
+        for (int i = 0; i < index->count; ++i)
+        {
+            *find_slot(slots, capacity, index->objs[i]) = (ObjSlot){index->objs[i], (uint32_t)i};
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->slot_capacity = capacity;
+    }
+
+    ObjSlot *slot = find_slot(index->slots, index->slot_capacity, obj);
+    if (slot->obj != NULL)
+    {
+        return;
+    }
+
+    if (index->capacity < index->count + 1)
+    {
+        index->capacity = GROW_CAPACITY(index->capacity);
+        index->objs = realloc(index->objs, sizeof(Obj *) * index->capacity);
+    }
+
+    *slot = (ObjSlot){obj, (uint32_t)index->count};
+    index->objs[index->count++] = obj;
+}
+
+static void add_value(ObjIndex *index, Value value)
+{
+    if (IS_OBJ(value))
+    {
+        add_obj(index, AS_OBJ(value));
+    }
+}
+
+static void add_table(ObjIndex *index, Table *table)
+{
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        if (table->entries[i].key != NULL)
+        {
+            add_value(index, table->entries[i].val);
+        }
+    }
+}
+
+static void add_children(ObjIndex *index, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_BOUND_METHOD:
+        add_value(index, ((ObjBoundMethod *)obj)->receiver);
+        add_obj(index, (Obj *)((ObjBoundMethod *)obj)->method);
+        break;
+    case OBJ_CLASS:
+        add_table(index, &((ObjClass *)obj)->methods);
+        break;
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        add_obj(index, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalue_count; ++i)
+        {
+            add_obj(index, (Obj *)closure->upvalues[i]);
+        }
+        for (int i = 0; i < closure->capture_count; ++i)
+        {
+            add_value(index, closure->captures[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        // Images only hold bytecode, so bodies left for their first call are compiled now.
+        ObjFunction *function = (ObjFunction *)obj;
+        if (function->source != NULL && !compile_body(function))
+        {
+            index->failed = true;
+        }
+
+        ValueArray *constants = &function->chunk.constants;
+        for (int i = 0; i < constants->count; ++i)
+        {
+            add_value(index, constants->values[i]);
+        }
+        break;
+    }
+    case OBJ_INSTANCE:
+        add_obj(index, (Obj *)((ObjInstance *)obj)->klass);
+        add_table(index, &((ObjInstance *)obj)->fields);
+        break;
+    case OBJ_UPVALUE:
+        add_value(index, *((ObjUpvalue *)obj)->location);
+        break;
+    case OBJ_CHANNEL:
+    case OBJ_FIBER:
+    case OBJ_NATIVE:
+    case OBJ_STREAM:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Collects everything reachable from the globals, if given, and the values, and renumbers it
+// with the functions first, so they can be filled in before anything that needs their upvalue
+// and capture counts. Returns the number of functions.
+static int index_heap(ObjIndex *index, Table *globals, Value *values, int count)
+{
+    if (globals != NULL)
+    {
+        add_table(index, globals);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        add_value(index, values[i]);
+    }
+    for (int i = 0; i < index->count; ++i)
+    {
+        add_children(index, index->objs[i]);
+    }
+
+    Obj **ordered = malloc(sizeof(Obj *) * (index->count + 1));
+    int function_count = 0;
+    for (int i = 0; i < index->count; ++i)
+    {
+        if (index->objs[i]->type == OBJ_FUNCTION)
+        {
+            ordered[function_count++] = index->objs[i];
+        }
+    }
+    int next = function_count;
+    for (int i = 0; i < index->count; ++i)
+    {
+        if (index->objs[i]->type != OBJ_FUNCTION)
+        {
+            ordered[next++] = index->objs[i];
+        }
+    }
+
+    for (int i = 0; i < index->count; ++i)
+    {
+        find_slot(index->slots, index->slot_capacity, ordered[i])->id = (uint32_t)i;
+    }
+    free(index->objs);
+    index->objs = ordered;
+    index->capacity = index->count + 1;
+
+    return function_count;
+}
+
+static void write_ref(Writer *writer, ObjIndex *index, Obj *obj)
+{
+    write_u32(writer, find_slot(index->slots, index->slot_capacity, obj)->id);
+}
+
+static void write_value(Writer *writer, ObjIndex *index, Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        write_u8(writer, REF_NUMBER);
+        write_bytes(writer, &value.as.number, sizeof(double));
+    }
+    else if (IS_STRING(value))
+    {
+        write_u8(writer, REF_STRING);
+        write_string(writer, AS_STRING(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        write_u8(writer, REF_OBJ);
+        write_ref(writer, index, AS_OBJ(value));
+    }
+    else if (IS_BOOLEAN(value))
+    {
+        write_u8(writer, AS_BOOLEAN(value) ? REF_TRUE : REF_FALSE);
+    }
+    else
+    {
+        write_u8(writer, REF_NIL);
+    }
+}
+
+static void write_table(Writer *writer, ObjIndex *index, Table *table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        count += table->entries[i].key != NULL;
+    }
+
+    write_u32(writer, count);
+    for (int i = 0; i < table->capacity; ++i)
+    {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL)
+        {
+            write_string(writer, entry->key);
+            write_value(writer, index, entry->val);
+        }
+    }
+}
+
+static const char *native_name(NativeFn function)
+{
+    for (int i = 0; i < native_count; ++i)
+    {
+        if (natives[i].function == function)
+        {
+            return natives[i].name;
+        }
+    }
+    return "";
+}
+
+// What's needed to allocate the object before anything it refers to exists.
+static void write_shell(Writer *writer, ObjIndex *index, Obj *obj)
+{
+    write_u8(writer, (uint8_t)obj->type);
+
+    if (obj->type == OBJ_CLOSURE)
+    {
+        write_ref(writer, index, (Obj *)((ObjClosure *)obj)->function);
+    }
+    else if (obj->type == OBJ_CLASS)
+    {
+        write_string(writer, ((ObjClass *)obj)->name);
+    }
+    else if (obj->type == OBJ_NATIVE)
+    {
+        const char *name = native_name(((ObjNative *)obj)->function);
+        write_u32(writer, (uint32_t)strlen(name));
+        write_bytes(writer, name, strlen(name));
+    }
+    else if (obj->type == OBJ_CHANNEL)
+    {
+        write_u64(writer, (uint64_t)(uintptr_t)((ObjChannel *)obj)->channel);
+    }
+}
+
+static void write_contents(Writer *writer, ObjIndex *index, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_BOUND_METHOD:
+        write_value(writer, index, ((ObjBoundMethod *)obj)->receiver);
+        write_ref(writer, index, (Obj *)((ObjBoundMethod *)obj)->method);
+        break;
+    case OBJ_CLASS:
+        write_table(writer, index, &((ObjClass *)obj)->methods);
+        break;
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        for (int i = 0; i < closure->upvalue_count; ++i)
+        {
+            write_ref(writer, index, (Obj *)closure->upvalues[i]);
+        }
+        for (int i = 0; i < closure->capture_count; ++i)
+        {
+            write_value(writer, index, closure->captures[i]);
+        }
+        break;
+    }
+    case OBJ_INSTANCE:
+        write_ref(writer, index, (Obj *)((ObjInstance *)obj)->klass);
+        write_table(writer, index, &((ObjInstance *)obj)->fields);
+        break;
+    case OBJ_UPVALUE:
+        write_value(writer, index, *((ObjUpvalue *)obj)->location);
+        break;
+    case OBJ_CHANNEL:
+    case OBJ_FIBER:
+    case OBJ_FUNCTION:
+    case OBJ_NATIVE:
+    case OBJ_STREAM:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Writes the object table, then the globals if given, then the values.
+// A copy starts with the channels in it, each of which it holds a reference on until
+// release_copy(). Nothing can fail once they're retained.
+static void write_channels(Writer *payload, ObjIndex *index)
+{
+    uint32_t channel_count = 0;
+    for (int i = 0; i < index->count; ++i)
+    {
+        channel_count += index->objs[i]->type == OBJ_CHANNEL;
+    }
+
+    write_u32(payload, channel_count);
+    for (int i = 0; i < index->count; ++i)
+    {
+        if (index->objs[i]->type == OBJ_CHANNEL)
+        {
+            Channel *channel = ((ObjChannel *)index->objs[i])->channel;
+            retain_channel(channel);
+            write_u64(payload, (uint64_t)(uintptr_t)channel);
+        }
+    }
+}
+
+static bool write_graph(Writer *payload, bool in_process, Table *globals, Value *values, int count)
+{
+    ObjIndex index = {NULL, 0, 0, NULL, 0, in_process, false};
+    int function_count = index_heap(&index, globals, values, count);
+    if (index.failed)
+    {
+        free(index.objs);
+        free(index.slots);
+        return false;
+    }
+
+    if (in_process)
+    {
+        write_channels(payload, &index);
+    }
+
+    write_u32(payload, (uint32_t)function_count);
+    write_u32(payload, (uint32_t)index.count);
+
+    for (int i = 0; i < function_count; ++i)
+    {
+        ObjFunction *function = (ObjFunction *)index.objs[i];
+        write_function_body(payload, function);
+        write_u32(payload, (uint32_t)function->chunk.constants.count);
+        for (int j = 0; j < function->chunk.constants.count; ++j)
+        {
+            write_value(payload, &index, function->chunk.constants.values[j]);
+        }
+    }
+    for (int i = function_count; i < index.count; ++i)
+    {
+        write_shell(payload, &index, index.objs[i]);
+    }
+    for (int i = function_count; i < index.count; ++i)
+    {
+        write_contents(payload, &index, index.objs[i]);
+    }
+
+    if (globals != NULL)
+    {
+        write_table(payload, &index, globals);
+    }
+    else
+    {
+        write_u32(payload, 0);
+    }
+    write_u32(payload, (uint32_t)count);
+    for (int i = 0; i < count; ++i)
+    {
+        write_value(payload, &index, values[i]);
+    }
+
+    free(index.objs);
+    free(index.slots);
+    return true;
+}
+
+// An image is a header followed by the object table and the globals:
+//
+//     magic, version                 u32 each
+//     payload length, payload hash   u64 each
+//     function count, object count   u32 each
+//     functions                      body and constants
+//     other objects                  type and shell each, then their contents in the same order
+//     globals                        name and value pairs
+//     values                         count, then each value
+//
+// References to objects are indexes into the table. Strings are written inline wherever they
+// appear and interned again when read, which rebuilds the string table as a side effect. Images
+// are written with the globals and no values.
+bool save_snapshot(const char *path)
+{
+    Writer payload;
+    init_writer(&payload);
+    if (!write_graph(&payload, false, &vm->globals, NULL, 0))
+    {
+        free_writer(&payload);
+        return false;
+    }
+
+    Writer header;
+    init_writer(&header);
+    write_u32(&header, IMAGE_MAGIC);
+    write_u32(&header, IMAGE_VERSION);
+    write_u64(&header, payload.count);
+    write_u64(&header, hash_bytes(payload.bytes, payload.count));
+
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+
+    bool saved = false;
+    FILE *file = fopen(temp_path, "wb");
+    if (file != NULL)
+    {
+        bool written = fwrite(header.bytes, 1, header.count, file) == header.count &&
+                       fwrite(payload.bytes, 1, payload.count, file) == payload.count;
+        saved = fclose(file) == 0 && written && rename(temp_path, path) == 0;
+        if (!saved)
+        {
+            remove(temp_path);
+        }
+    }
+
+    free_writer(&header);
+    free_writer(&payload);
+    return saved;
+}
+
+// Reads a reference to an object of the given type that has already been allocated.
+static Obj *read_ref(Reader *reader, ObjType type)
+{
+    uint32_t id = read_u32(reader);
+    if (reader->failed || id >= loaded_count || loading[id]->type != type)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    return loading[id];
+}
+
+static Value read_value(Reader *reader)
+{
+    switch (read_u8(reader))
+    {
+    case REF_FALSE:
+        return BOOLEAN_VAL(false);
+    case REF_TRUE:
+        return BOOLEAN_VAL(true);
+    case REF_NUMBER:
+    {
+        double number = 0;
+        const uint8_t *bytes = read_bytes(reader, sizeof(double));
+        if (bytes != NULL)
+        {
+            memcpy(&number, bytes, sizeof(double));
+        }
+        return NUMBER_VAL(number);
+    }
+    case REF_STRING:
+    {
+        ObjString *string = read_string(reader);
+        return string != NULL ? OBJ_VAL(string) : NIL_VAL;
+    }
+    case REF_OBJ:
+    {
+        uint32_t id = read_u32(reader);
+        if (reader->failed || id >= loaded_count)
+        {
+            reader->failed = true;
+            return NIL_VAL;
+        }
+        return OBJ_VAL(loading[id]);
+    }
+    case REF_NIL:
+        return NIL_VAL;
+    default:
+        reader->failed = true;
+        return NIL_VAL;
+    }
+}
+
+// Class methods have to be closures, since calls to them assume so.
+static void read_table(Reader *reader, Table *table, bool methods)
+{
+    uint32_t count = read_u32(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; ++i)
+    {
+        ObjString *key = read_string(reader);
+        if (key == NULL)
+        {
+            return;
+        }
+        push(OBJ_VAL(key));
+        Value value = read_value(reader);
+        push(value);
+
+        if (methods && !IS_CLOSURE(value))
+        {
+            reader->failed = true;
+        }
+        else
+        {
+            table_put(table, key, value);
+        }
+
+        pop();
+        pop();
+    }
+}
+
+static Obj *read_native_obj(Reader *reader)
+{
+    uint32_t length = read_u32(reader);
+    const uint8_t *name = read_bytes(reader, length);
+
+    for (int i = 0; name != NULL && i < native_count; ++i)
+    {
+        if (strlen(natives[i].name) == length && memcmp(natives[i].name, name, length) == 0)
+        {
+            return (Obj *)new_native(natives[i].function);
+        }
+    }
+
+    reader->failed = true;
+    return NULL;
+}
+
+static Obj *read_shell(Reader *reader, bool in_process)
+{
+    switch (read_u8(reader))
+    {
+    case OBJ_CHANNEL:
+    {
+        uint64_t channel = read_u64(reader);
+        if (!in_process || reader->failed)
+        {
+            reader->failed = true;
+            return NULL;
+        }
+        // The copy keeps its own reference, since it can be read more than once.
+        retain_channel((Channel *)(uintptr_t)channel);
+        return (Obj *)new_channel((Channel *)(uintptr_t)channel);
+    }
+    case OBJ_BOUND_METHOD:
+        return (Obj *)new_bound_method(NIL_VAL, NULL);
+    case OBJ_CLASS:
+    {
+        ObjString *name = read_string(reader);
+        if (name == NULL)
+        {
+            return NULL;
+        }
+        push(OBJ_VAL(name));
+        ObjClass *klass = new_class(name);
+        pop();
+        return (Obj *)klass;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjFunction *function = (ObjFunction *)read_ref(reader, OBJ_FUNCTION);
+        return function != NULL ? (Obj *)new_closure(function) : NULL;
+    }
+    case OBJ_INSTANCE:
+        return (Obj *)new_instance(NULL);
+    case OBJ_NATIVE:
+        return read_native_obj(reader);
+    case OBJ_UPVALUE:
+    {
+        ObjUpvalue *upvalue = new_upvalue(NULL);
+        upvalue->location = &upvalue->closed;
+        return (Obj *)upvalue;
+    }
+    default:
+        reader->failed = true;
+        return NULL;
+    }
+}
+
+static void read_contents(Reader *reader, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)obj;
+        bound->receiver = read_value(reader);
+        bound->method = (ObjClosure *)read_ref(reader, OBJ_CLOSURE);
+        break;
+    }
+    case OBJ_CLASS:
+        read_table(reader, &((ObjClass *)obj)->methods, true);
+        break;
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)obj;
+        for (int i = 0; i < closure->upvalue_count; ++i)
+        {
+            closure->upvalues[i] = (ObjUpvalue *)read_ref(reader, OBJ_UPVALUE);
+        }
+        for (int i = 0; i < closure->capture_count; ++i)
+        {
+            closure->captures[i] = read_value(reader);
+        }
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)obj;
+        instance->klass = (ObjClass *)read_ref(reader, OBJ_CLASS);
+        read_table(reader, &instance->fields, false);
+        break;
+    }
+    case OBJ_UPVALUE:
+        ((ObjUpvalue *)obj)->closed = read_value(reader);
+        break;
+    case OBJ_CHANNEL:
+    case OBJ_FIBER:
+    case OBJ_FUNCTION:
+    case OBJ_NATIVE:
+    case OBJ_STREAM:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Allocates every object in the table, then fills them in, then links the globals to them and
+// pushes the values.
+static bool read_objs(Reader *reader, bool in_process, int *pushed)
+{
+    uint32_t function_count = read_u32(reader);
+    uint32_t count = read_u32(reader);
+    if (function_count > count || !has_room(reader, count, sizeof(uint8_t)))
+    {
+        return false;
+    }
+
+    loading = malloc(sizeof(Obj *) * (count + 1));
+    for (; loaded_count < function_count; ++loaded_count)
+    {
+        loading[loaded_count] = (Obj *)new_function();
+    }
+
+    for (uint32_t i = 0; i < function_count && !reader->failed; ++i)
+    {
+        ObjFunction *function = (ObjFunction *)loading[i];
+        read_function_body(reader, function);
+
+        uint32_t constant_count = read_u32(reader);
+        if (has_room(reader, constant_count, sizeof(uint8_t)))
+        {
+            for (uint32_t j = 0; j < constant_count && !reader->failed; ++j)
+            {
+                add_constant(&function->chunk, read_value(reader));
+            }
+        }
+    }
+
+    while (loaded_count < count && !reader->failed)
+    {
+        Obj *obj = read_shell(reader, in_process);
+        if (obj != NULL)
+        {
+            loading[loaded_count++] = obj;
+        }
+    }
+
+    for (uint32_t i = function_count; i < count && !reader->failed; ++i)
+    {
+        read_contents(reader, loading[i]);
+    }
+
+    // Copies come from this process; only images from disk need their bytecode checked.
+    for (uint32_t i = 0; i < function_count && !in_process && !reader->failed; ++i)
+    {
+        reader->failed = !check_function((ObjFunction *)loading[i]);
+    }
+
+    read_table(reader, &loaded_globals, false);
+
+    uint32_t value_count = read_u32(reader);
+    if (!has_room(reader, value_count, sizeof(uint8_t)) || !reserve_stack((int)value_count))
+    {
+        return false;
+    }
+    for (; *pushed < (int)value_count && !reader->failed; ++*pushed)
+    {
+        push(read_value(reader));
+    }
+
+    return !reader->failed && reader->offset == reader->count;
+}
+
+// Nothing is published to vm->globals, or left on the stack, unless everything reads back
+// cleanly.
+static bool read_graph(Reader *reader, bool in_process, int *count)
+{
+    *count = 0;
+    init_table(&loaded_globals);
+    bool loaded = read_objs(reader, in_process, count);
+    if (loaded)
+    {
+        table_put_all(&loaded_globals, &vm->globals);
+    }
+    else
+    {
+        vm->stack_top -= *count;
+        *count = 0;
+    }
+    free_table(&loaded_globals);
+    free(loading);
+    loading = NULL;
+    loaded_count = 0;
+    return loaded;
+}
+
+// Maps the image and restores the globals it was taken with, along with everything they
+// reach. Returns false when the image is missing, damaged or from another format version.
+bool load_snapshot(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd == -1)
+    {
+        return false;
+    }
+    if (fstat(fd, &info) == -1 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED)
+    {
+        return false;
+    }
+
+    Reader reader;
+    init_reader(&reader, bytes, size);
+
+    bool loaded = false;
+    if (read_u32(&reader) == IMAGE_MAGIC && read_u32(&reader) == IMAGE_VERSION)
+    {
+        uint64_t payload_length = read_u64(&reader);
+        uint64_t payload_hash = read_u64(&reader);
+        if (!reader.failed && payload_length == reader.count - reader.offset &&
+            payload_hash == hash_bytes(reader.bytes + reader.offset, payload_length))
+        {
+            int count;
+            loaded = read_graph(&reader, false, &count);
+            vm->stack_top -= count;
+        }
+    }
+
+    munmap(bytes, size);
+    return loaded;
+}
+
+bool write_copy(Writer *writer, Value *values, int count, Table *globals)
+{
+    return write_graph(writer, true, globals, values, count);
+}
+
+bool read_copy(Reader *reader, int *count)
+{
+    uint32_t channel_count = read_u32(reader);
+    read_bytes(reader, sizeof(uint64_t) * channel_count);
+    return read_graph(reader, true, count);
+}
+
+void release_copy(const uint8_t *bytes, size_t count)
+{
+    Reader reader;
+    init_reader(&reader, bytes, count);
+    uint32_t channel_count = read_u32(&reader);
+    for (uint32_t i = 0; i < channel_count; ++i)
+    {
+        uint64_t channel = read_u64(&reader);
+        if (reader.failed)
+        {
+            break;
+        }
+        release_channel((Channel *)(uintptr_t)channel);
+    }
+}
+
+void mark_snapshot_roots()
+{
+    for (uint32_t i = 0; i < loaded_count; ++i)
+    {
+        mark_obj(loading[i]);
+    }
+    mark_table(&loaded_globals);
+}
@@ -0,0 +1,20 @@
+#ifndef CLOX_SNAPSHOT_H
+#define CLOX_SNAPSHOT_H
+
+#include "common.h"
+#include "serialize.h"
+#include "table.h"
+#include "value.h"
+
+bool save_snapshot(const char *path);
+bool load_snapshot(const char *path);
+void mark_snapshot_roots();
+
+// Copies values, and the globals if given, with everything they reach, for another VM in this
+// process. read_copy() defines the globals that came along and pushes the values. A copy holds
+// references on the channels in it, which release_copy() drops before its bytes are freed.
+bool write_copy(Writer *writer, Value *values, int count, Table *globals);
+bool read_copy(Reader *reader, int *count);
+void release_copy(const uint8_t *bytes, size_t count);
+
+#endif
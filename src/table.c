@@ -3,10 +3,14 @@
 #include "memory.h"
 
 #define TABLE_MAX_LOAD 0.75
+#define TABLE_MIN_LOAD 0.25
+#define TABLE_MAX_TOMBSTONES 0.25
+#define TABLE_MIN_CAPACITY 8
 
 void init_table(Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
 }
@@ -59,6 +63,7 @@ static void adjust_capacity(Table *table, int capacity)
     }
 
     table->count = 0;
+    table->tombstones = 0;
 
     for (int i = 0; i < table->capacity; ++i)
     {
@@ -113,6 +118,10 @@ bool table_put(Table *table, ObjString *key, Value val)
     {
         ++table->count;
     }
+    else if (is_new_key)
+    {
+        --table->tombstones;
+    }
 
     entry->key = key;
     entry->val = val;
@@ -148,6 +157,7 @@ bool table_remove(Table *table, ObjString *key)
 
     entry->key = NULL;
     entry->val = BOOLEAN_VAL(true);
+    ++table->tombstones;
 
     return true;
 }
@@ -204,3 +214,103 @@ void mark_table(Table *table)
         mark_value(entry->val);
     }
 }
+
+static void purge_tombstones(Table *table)
+{
+    Entry *entries = table->entries;
+    int capacity = table->capacity;
+
+    // Start right after a truly empty slot. No probe sequence crosses it, so every entry's home
+    // slot is visited before the entry itself and can be refilled in a single pass.
+    int start = 0;
+    while (entries[start].key != NULL || !IS_NIL(entries[start].val))
+    {
+        ++start;
+    }
+
+    for (int i = 0; i < capacity; ++i)
+    {
+        if (entries[i].key == NULL)
+        {
+            entries[i].val = NIL_VAL;
+        }
+    }
+
+    for (int n = 1; n <= capacity; ++n)
+    {
+        Entry *entry = &entries[(start + n) % capacity];
+        if (entry->key == NULL)
+        {
+            continue;
+        }
+
+        Entry moved = *entry;
+        entry->key = NULL;
+        entry->val = NIL_VAL;
+
+        Entry *dest = find_entry(entries, capacity, moved.key);
+        *dest = moved;
+    }
+
+    table->count -= table->tombstones;
+    table->tombstones = 0;
+}
+
+static void shrink_in_place(Table *table, int capacity)
+{
+    Entry *entries = table->entries;
+
+    // Pack the live entries against the back of the array. The new table is at most half the old
+    // one, so the packed entries never overlap the front part we rebuild below.
+    int packed = table->capacity;
+    for (int i = table->capacity - 1; i >= 0; --i)
+    {
+        if (entries[i].key != NULL)
+        {
+            entries[--packed] = entries[i];
+        }
+    }
+
+    for (int i = 0; i < capacity; ++i)
+    {
+        entries[i].key = NULL;
+        entries[i].val = NIL_VAL;
+    }
+
+    for (int i = packed; i < table->capacity; ++i)
+    {
+        Entry *dest = find_entry(entries, capacity, entries[i].key);
+        *dest = entries[i];
+    }
+
+    table->entries = GROW_ARRAY(entries, Entry, table->capacity, capacity);
+    table->count = table->capacity - packed;
+    table->tombstones = 0;
+    table->capacity = capacity;
+}
+
+void table_compact(Table *table)
+{
+    int live = table->count - table->tombstones;
+
+    if (table->capacity > TABLE_MIN_CAPACITY && live < table->capacity * TABLE_MIN_LOAD)
+    {
+        if (live == 0)
+        {
+            free_table(table);
+            return;
+        }
+
+        int capacity = TABLE_MIN_CAPACITY;
+        while (live > capacity * (TABLE_MAX_LOAD - TABLE_MIN_LOAD))
+        {
+            capacity *= 2;
+        }
+
+        shrink_in_place(table, capacity);
+    }
+    else if (table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES)
+    {
+        purge_tombstones(table);
+    }
+}
@@ -13,6 +13,7 @@ typedef struct
 typedef struct
 {
     int count;
+    int tombstones;
     int capacity;
     Entry *entries;
 } Table;
@@ -25,6 +26,7 @@ void table_put_all(Table *from, Table *to);
 bool table_remove(Table *table, ObjString *key);
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
 void table_remove_white(Table *table);
+void table_compact(Table *table);
 void mark_table(Table *table);
 
 #endif
@@ -35,7 +35,7 @@ void init_value_array(ValueArray *arr)
 
 void free_value_array(ValueArray *arr)
 {
-    FREE_ARRAY(arr->values, uint8_t, arr->capacity);
+    FREE_ARRAY(arr->values, Value, arr->capacity);
     init_value_array(arr);
 }
 
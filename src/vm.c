@@ -1,42 +1,130 @@
+#define _DEFAULT_SOURCE
+
 #include "vm.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "native.h"
+
+// Deep stack traces only show this many frames at each end.
+#define TRACE_EDGE 16
+
+// Pushes the runtime makes beyond what the compiler counted, like rooting a new string.
+#define STACK_RESERVE 8
+
+_Thread_local Vm *vm = NULL;
+
+static Context *context_of(ObjFiber *fiber)
+{
+    return fiber != NULL ? &fiber->context : &vm->main_context;
+}
 
-Vm vm;
+static void save_context(Context *context)
+{
+    context->frames = vm->frames;
+    context->frame_count = vm->frame_count;
+    context->frame_capacity = vm->frame_capacity;
+    context->stack = vm->stack;
+    context->stack_top = vm->stack_top;
+    context->stack_limit = vm->stack_limit;
+    context->stack_capacity = vm->stack_capacity;
+    context->open_upvalues = vm->open_upvalues;
+}
 
-static Value clock_native(int arg_count, Value *args)
+static void load_context(Context *context)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    vm->frames = context->frames;
+    vm->frame_count = context->frame_count;
+    vm->frame_capacity = context->frame_capacity;
+    vm->stack = context->stack;
+    vm->stack_top = context->stack_top;
+    vm->stack_limit = context->stack_limit;
+    vm->stack_capacity = context->stack_capacity;
+    vm->open_upvalues = context->open_upvalues;
+}
+
+static void close_upvalues(Value *last)
+{
+    while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last)
+    {
+        ObjUpvalue *upvalue = vm->open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm->open_upvalues = upvalue->next;
+    }
+}
+
+// Frees the running fiber's stacks and goes back to the fiber that resumed it.
+NOINLINE static void end_fiber()
+{
+    ObjFiber *fiber = vm->fiber;
+    // Closures can outlive a fiber that fails, so nothing may point into its stack.
+    close_upvalues(vm->stack);
+    free(vm->frames);
+    free(vm->stack);
+    fiber->context = (Context){NULL, 0, 0, NULL, NULL, NULL, 0, NULL};
+    fiber->state = FIBER_DONE;
+
+    vm->fiber = fiber->caller;
+    fiber->caller = NULL;
+    load_context(context_of(vm->fiber));
 }
 
 static void reset_stack()
 {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = NULL;
+    // An error ends every fiber on the way back to the VM's own stacks.
+    while (vm->fiber != NULL)
+    {
+        end_fiber();
+    }
+    unpark_main();
+
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalues = NULL;
 }
 
-static void runtime_error(const char *fmt, ...)
+void runtime_error(const char *fmt, ...)
 {
+    flockfile(stderr);
+
     va_list args;
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (int i = vm.frame_count - 1; i >= 0; --i)
+    for (int i = vm->frame_count - 1; i >= 0; --i)
     {
-        CallFrame *frame = &vm.frames[i];
+        if (i == vm->frame_count - 1 - TRACE_EDGE && i >= TRACE_EDGE)
+        {
+            fprintf(stderr, "... %d more frames ...\n", i + 1 - TRACE_EDGE);
+            i = TRACE_EDGE - 1;
+        }
+
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->closure->function;
+        Chunk *chunk = &function->chunk;
 
-        size_t instr = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.line_nos[instr]);
+        int instr = (int)(frame->ip - chunk->code - 1);
+        int line_no = get_line_no(chunk, instr);
+        // Calls the compiler inlined show up as though they had frames of their own, innermost
+        // first.
+        for (int s = 0; s < chunk->site_count; ++s)
+        {
+            InlineSite *site = &chunk->sites[s];
+            if (instr >= site->start && instr < site->end)
+            {
+                fprintf(stderr, "[line %d] in %.*s()\n", line_no, site->name->length, site->name->chars);
+                line_no = site->line_no;
+            }
+        }
+        fprintf(stderr, "[line %d] in ", line_no);
 
         if (function->name == NULL)
         {
@@ -44,10 +132,11 @@ static void runtime_error(const char *fmt, ...)
         }
         else
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(stderr, "%.*s()\n", function->name->length, function->name->chars);
         }
     }
 
+    funlockfile(stderr);
     reset_stack();
 }
 
@@ -55,54 +144,106 @@ static void define_native(const char *name, NativeFn function)
 {
     push(OBJ_VAL(copy_string(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(function)));
-    table_put(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    table_put(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
     pop();
     pop();
 }
 
-void init_vm()
+void init_vm(Vm *instance)
 {
+    vm = instance;
+    vm->frames = NULL;
+    vm->frame_capacity = 0;
+    vm->stack = malloc(sizeof(Value) * STACK_INIT);
+    vm->stack_capacity = STACK_INIT;
+    vm->stack_limit = vm->stack + STACK_INIT - STACK_RESERVE;
+    vm->fiber = NULL;
+    vm->switching = false;
+    init_io(&vm->io);
     reset_stack();
-    vm.objs = NULL;
+    vm->objs = NULL;
 
-    vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
+    vm->bytes_allocated = 0;
+    vm->next_gc = 1024 * 1024;
 
-    vm.gray_count = 0;
-    vm.gray_capacity = 0;
-    vm.gray_stack = NULL;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
 
-    init_table(&vm.globals);
-    init_table(&vm.strings);
+    vm->opt_level = 0;
+    vm->whole_program = false;
+    vm->lazy = false;
+    vm->type_stats = false;
 
-    define_native("clock", clock_native);
+    init_table(&vm->globals);
+    init_table(&vm->strings);
+
+    vm->init_string = NULL;
+    vm->init_string = copy_string("init", 4);
+
+    for (int i = 0; i < native_count; ++i)
+    {
+        define_native(natives[i].name, natives[i].function);
+    }
 }
 
 void free_vm()
 {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
+    free_table(&vm->globals);
+    free_table(&vm->strings);
+    vm->init_string = NULL;
     free_objs();
+    free_io();
+    free(vm->frames);
+    free(vm->stack);
+    vm = NULL;
+}
+
+void use_vm(Vm *instance)
+{
+    vm = instance;
+}
+
+static Vm *current_vm()
+{
+    return vm;
+}
+
+// The stack operations on a VM that's already at hand, which run() uses to stay off the
+// thread-local.
+static inline void push_on(Vm *target, Value value)
+{
+    *target->stack_top = value;
+    ++target->stack_top;
+}
+
+static inline Value pop_from(Vm *target)
+{
+    --target->stack_top;
+    return *target->stack_top;
+}
+
+static inline Value peek_at(Vm *target, int distance)
+{
+    return target->stack_top[-1 - distance];
 }
 
 void push(Value value)
 {
-    *vm.stack_top = value;
-    ++vm.stack_top;
+    push_on(vm, value);
 }
 
 Value pop()
 {
-    --vm.stack_top;
-    return *vm.stack_top;
+    return pop_from(vm);
 }
 
 static Value peek(int distance)
 {
-    return vm.stack_top[-1 - distance];
+    return peek_at(vm, distance);
 }
 
-static bool call(ObjClosure *closure, int arg_count)
+static bool check_arity(ObjClosure *closure, int arg_count)
 {
     if (arg_count != closure->function->arity)
     {
@@ -110,30 +251,222 @@ static bool call(ObjClosure *closure, int arg_count)
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX)
+    return true;
+}
+
+static bool grow_frames()
+{
+    if (vm->frame_capacity == FRAMES_MAX)
     {
         runtime_error("Stack-overflow.");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frame_count++];
+    int capacity = GROW_CAPACITY(vm->frame_capacity);
+    CallFrame *frames = realloc(vm->frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL)
+    {
+        runtime_error("Cannot grow the call stack.");
+        return false;
+    }
+
+    vm->frames = frames;
+    vm->frame_capacity = capacity;
+    return true;
+}
+
+// Grows the value stack to hold at least size values plus the reserve. Frames and open upvalues
+// point into it, so they're moved along with it. Reports an error and leaves the stack as it
+// was if there's no memory for it.
+static bool grow_stack(int size)
+{
+    int capacity = vm->stack_capacity;
+    while (capacity < size + STACK_RESERVE)
+    {
+        capacity *= 2;
+    }
+
+    Value *stack = realloc(vm->stack, sizeof(Value) * capacity);
+    if (stack == NULL)
+    {
+        runtime_error("Cannot grow the value stack.");
+        return false;
+    }
+
+    for (int i = 0; i < vm->frame_count; ++i)
+    {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    vm->stack_top = stack + (vm->stack_top - vm->stack);
+
+    vm->stack = stack;
+    vm->stack_capacity = capacity;
+    vm->stack_limit = stack + capacity - STACK_RESERVE;
+    return true;
+}
+
+// Makes sure a frame at slots has room for the function's values, returning where slots ended up,
+// or NULL if the stack couldn't grow.
+static Value *ensure_stack(Value *slots, ObjFunction *function)
+{
+    if (slots + function->max_stack > vm->stack_limit)
+    {
+        int base = (int)(slots - vm->stack);
+        if (!grow_stack(base + function->max_stack))
+        {
+            return NULL;
+        }
+        slots = vm->stack + base;
+    }
+
+    return slots;
+}
+
+// Compiles the body of a function left for its first call, if it hasn't been yet.
+static bool ensure_compiled(ObjFunction *function)
+{
+    if (function->source != NULL && !compile_body(function))
+    {
+        runtime_error("Cannot compile %.*s().", function->name->length, function->name->chars);
+        return false;
+    }
+    return true;
+}
+
+static bool call(ObjClosure *closure, int arg_count)
+{
+    if (!ensure_compiled(closure->function) || !check_arity(closure, arg_count))
+    {
+        return false;
+    }
+
+    if (vm->frame_count == vm->frame_capacity && !grow_frames())
+    {
+        return false;
+    }
+
+    Value *slots = ensure_stack(vm->stack_top - arg_count - 1, closure->function);
+    if (slots == NULL)
+    {
+        return false;
+    }
+
+    CallFrame *frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = slots;
     return true;
 }
 
+static ObjClosure *fiber_closure(ObjFiber *fiber)
+{
+    return IS_BOUND_METHOD(fiber->function) ? AS_BOUND_METHOD(fiber->function)->method
+                                            : AS_CLOSURE(fiber->function);
+}
+
+// Switches to the fiber, or the VM's own stacks if NULL, handing it value: a fiber that hasn't
+// started is called with it, and any other gets it back from whatever it's waiting on. When the
+// VM's own stacks are parked on I/O, the event loop picks what runs instead. Returns false with
+// the error reported if a fiber can't be started.
+NOINLINE static bool switch_to(ObjFiber *to, Value value)
+{
+    if (to == NULL && vm->io.main_parked)
+    {
+        wait_for_io(&to, &value);
+    }
+
+    // Fibers start out with just the room their function needs, and grow like any other stack.
+    // It's found before switching, so running out of memory is reported where it was resumed.
+    CallFrame *frames = NULL;
+    Value *stack = NULL;
+    ObjClosure *closure = to != NULL && to->context.stack == NULL ? fiber_closure(to) : NULL;
+    if (closure != NULL)
+    {
+        frames = malloc(sizeof(CallFrame));
+        stack = malloc(sizeof(Value) * (closure->function->max_stack + STACK_RESERVE));
+        if (frames == NULL || stack == NULL)
+        {
+            free(frames);
+            free(stack);
+            to->state = FIBER_NEW;
+            to->caller = NULL;
+            runtime_error("Cannot allocate a stack for the fiber.");
+            return false;
+        }
+    }
+
+    save_context(context_of(vm->fiber));
+    vm->fiber = to;
+    load_context(context_of(to));
+
+    if (closure == NULL)
+    {
+        vm->stack_top[-1] = value;
+        return true;
+    }
+
+    ObjFunction *function = closure->function;
+    vm->frame_capacity = 1;
+    vm->frames = frames;
+    vm->stack_capacity = function->max_stack + STACK_RESERVE;
+    vm->stack = stack;
+    vm->stack_limit = stack + function->max_stack;
+    vm->stack_top = stack;
+
+    push(IS_BOUND_METHOD(to->function) ? AS_BOUND_METHOD(to->function)->receiver : to->function);
+    if (function->arity == 1)
+    {
+        push(value);
+    }
+    return call(closure, function->arity);
+}
+
+// Makes the switch a native asked for, handing over its result.
+NOINLINE static bool switch_fiber()
+{
+    vm->switching = false;
+    return switch_to(vm->switch_to, vm->stack_top[-1]);
+}
+
+// Ends the running fiber, whose function returned result, and goes back to what resumed it.
+NOINLINE static bool finish_fiber(Value result)
+{
+    ObjFiber *caller = vm->fiber->caller;
+    end_fiber();
+    return switch_to(caller, result);
+}
+
 static bool call_value(Value callee, int arg_count)
 {
     if (IS_OBJ(callee))
     {
         switch (OBJ_TYPE(callee))
         {
+        case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+            vm->stack_top[-arg_count - 1] = bound->receiver;
+            return call(bound->method, arg_count);
+        }
         case OBJ_CLASS:
         {
             ObjClass *klass = AS_CLASS(callee);
-            vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+            vm->stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+
+            Value initializer;
+            if (table_get(&klass->methods, vm->init_string, &initializer))
+            {
+                return call(AS_CLOSURE(initializer), arg_count);
+            }
+            else if (arg_count != 0)
+            {
+                runtime_error("Expected 0 arguments but got %d.", arg_count);
+                return false;
+            }
             return true;
         }
         case OBJ_CLOSURE:
@@ -141,10 +474,13 @@ static bool call_value(Value callee, int arg_count)
         case OBJ_NATIVE:
         {
             NativeFn native = AS_NATIVE(callee);
-            Value result = native(arg_count, vm.stack_top - arg_count);
-            vm.stack_top -= arg_count + 1;
-            push(result);
-            return true;
+            if (!native(arg_count, vm->stack_top - arg_count))
+            {
+                return false;
+            }
+            vm->stack_top -= arg_count;
+            // Natives that switch fibers leave it to here, where their arguments are gone.
+            return !vm->switching || switch_fiber();
         }
         default:
             break;
@@ -155,10 +491,60 @@ static bool call_value(Value callee, int arg_count)
     return false;
 }
 
+static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count)
+{
+    Value method;
+    if (!table_get(&klass->methods, name, &method))
+    {
+        runtime_error("Undefined property '%.*s'.", name->length, name->chars);
+        return false;
+    }
+
+    return call(AS_CLOSURE(method), arg_count);
+}
+
+// Calls the receiver's method in one step, leaving the receiver in slot zero instead of creating
+// a bound method. A field holding something callable takes precedence, as with a property read.
+static bool invoke(ObjString *name, int arg_count)
+{
+    Value receiver = peek(arg_count);
+    if (!IS_INSTANCE(receiver))
+    {
+        runtime_error("Only instances have methods.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+
+    Value value;
+    if (table_get(&instance->fields, name, &value))
+    {
+        vm->stack_top[-arg_count - 1] = value;
+        return call_value(value, arg_count);
+    }
+
+    return invoke_from_class(instance->klass, name, arg_count);
+}
+
+static bool bind_method(ObjClass *klass, ObjString *name)
+{
+    Value method;
+    if (!table_get(&klass->methods, name, &method))
+    {
+        runtime_error("Undefined property '%.*s'.", name->length, name->chars);
+        return false;
+    }
+
+    ObjBoundMethod *bound = new_bound_method(peek(0), AS_CLOSURE(method));
+    pop();
+    push(OBJ_VAL(bound));
+    return true;
+}
+
 static ObjUpvalue *capture_upvalue(Value *local)
 {
     ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.open_upvalues;
+    ObjUpvalue *upvalue = vm->open_upvalues;
 
     while (upvalue != NULL && upvalue->location > local)
     {
@@ -173,10 +559,11 @@ static ObjUpvalue *capture_upvalue(Value *local)
 
     ObjUpvalue *created_upvalue = new_upvalue(local);
     created_upvalue->next = upvalue;
+    created_upvalue->fiber = vm->fiber;
 
     if (prevUpvalue == NULL)
     {
-        vm.open_upvalues = created_upvalue;
+        vm->open_upvalues = created_upvalue;
     }
     else
     {
@@ -185,15 +572,30 @@ static ObjUpvalue *capture_upvalue(Value *local)
     return created_upvalue;
 }
 
-static void close_upvalues(Value *last)
+// Replaces the running frame with a call to the closure, so returning calls don't grow the
+// frame stack.
+static bool tail_call(ObjClosure *closure, int arg_count)
 {
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last)
+    if (!ensure_compiled(closure->function) || !check_arity(closure, arg_count))
     {
-        ObjUpvalue *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+        return false;
+    }
+
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    close_upvalues(frame->slots);
+
+    memmove(frame->slots, vm->stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+    vm->stack_top = frame->slots + arg_count + 1;
+    Value *slots = ensure_stack(frame->slots, closure->function);
+    if (slots == NULL)
+    {
+        return false;
     }
+    frame->slots = slots;
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
 }
 
 static bool is_falsey(Value value)
@@ -201,6 +603,21 @@ static bool is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOLEAN(value) && !AS_BOOLEAN(value));
 }
 
+static bool counter_in_range(uint8_t kind, double counter, double limit)
+{
+    switch (kind & ~FOR_SUBTRACT)
+    {
+    case FOR_LESS:
+        return counter < limit;
+    case FOR_LESS_EQUAL:
+        return !(counter > limit);
+    case FOR_GREATER:
+        return counter > limit;
+    default:
+        return !(counter < limit);
+    }
+}
+
 static void concatenate()
 {
     ObjString *b = AS_STRING(peek(0));
@@ -218,33 +635,104 @@ static void concatenate()
     push(OBJ_VAL(result));
 }
 
+// Pushes a closure over the function, reading what it closes over from the rest of the
+// instruction. Variable indices are two bytes behind OP_WIDE.
+static void make_closure(CallFrame *frame, ObjFunction *function, bool is_wide)
+{
+    ObjClosure *closure = new_closure(function);
+    push(OBJ_VAL(closure));
+
+    for (int i = 0; i < closure->upvalue_count + closure->capture_count; ++i)
+    {
+        uint8_t is_local = *frame->ip++;
+        int index = *frame->ip++;
+        if (is_wide)
+        {
+            index = (index << 8) | *frame->ip++;
+        }
+
+        if (i >= closure->upvalue_count)
+        {
+            int capture = i - closure->upvalue_count;
+            closure->captures[capture] = is_local ? frame->slots[index] : frame->closure->captures[index];
+        }
+        else if (is_local)
+        {
+            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        }
+        else
+        {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
 static InterpretResult run()
 {
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    // Reading the thread-local once keeps every instruction off it.
+    Vm *const vm = current_vm();
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    AotFn aot = frame->closure->function->aot;
+    // Operands of instructions that OP_WIDE can widen. Both forms read them into these and then
+    // share the rest of the code.
+    int index;
+    int arg_count;
+
+// Translated code runs as far as it can, leaving the next instruction to the switch. It is
+// entered when a frame starts or resumes and on loops' back edges, never per instruction, so
+// code that falls back runs interpreted until the next call, return or loop.
+#define RUN_AOT()          \
+    do                     \
+    {                      \
+        if (aot != NULL)   \
+        {                  \
+            aot(frame);    \
+        }                  \
+    } while (false)
 
+#define LOAD_FRAME()                              \
+    do                                            \
+    {                                             \
+        frame = &vm->frames[vm->frame_count - 1]; \
+        aot = frame->closure->function->aot;      \
+        RUN_AOT();                                \
+    } while (false)
+
+#define PUSH(value) push_on(vm, value)
+#define POP() pop_from(vm)
+#define PEEK(distance) peek_at(vm, distance)
 #define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define GET_CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() GET_CONSTANT(READ_BYTE())
 #define READ_SHORT() \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define GET_STRING(index) AS_STRING(GET_CONSTANT(index))
 #define BINARY_OP(value_type, op)                       \
     do                                                  \
     {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
         {                                               \
             runtime_error("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR;             \
         }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(value_type(a op b));                       \
+        double b = AS_NUMBER(POP());                    \
+        double a = AS_NUMBER(POP());                    \
+        PUSH(value_type(a op b));                       \
+    } while (false);
+// For operands the compiler has proven to be numbers.
+#define NUMBER_OP(value_type, op)                                          \
+    do                                                                     \
+    {                                                                      \
+        double b = AS_NUMBER(POP());                                       \
+        vm->stack_top[-1] = value_type(AS_NUMBER(vm->stack_top[-1]) op b); \
     } while (false);
 
+    RUN_AOT();
     while (true)
     {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stack_top; ++slot)
+        for (Value *slot = vm->stack; slot < vm->stack_top; ++slot)
         {
             printf("[ ");
             print_value(*slot);
@@ -257,116 +745,145 @@ static InterpretResult run()
         switch (instr = READ_BYTE())
         {
         case OP_CONSTANT:
-            push(READ_CONSTANT());
+            index = READ_BYTE();
+        op_constant:
+            PUSH(GET_CONSTANT(index));
             break;
         case OP_NIL:
-            push(NIL_VAL);
+            PUSH(NIL_VAL);
             break;
         case OP_TRUE:
-            push(BOOLEAN_VAL(true));
+            PUSH(BOOLEAN_VAL(true));
             break;
         case OP_FALSE:
-            push(BOOLEAN_VAL(false));
+            PUSH(BOOLEAN_VAL(false));
             break;
         case OP_POP:
-            pop();
+            POP();
             break;
         case OP_GET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
+            index = READ_BYTE();
+        op_get_local:
+            PUSH(frame->slots[index]);
             break;
-        }
         case OP_SET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
+            index = READ_BYTE();
+        op_set_local:
+            frame->slots[index] = PEEK(0);
             break;
-        }
         case OP_GET_GLOBAL:
+            index = READ_BYTE();
+        op_get_global:
         {
-            ObjString *name = READ_STRING();
+            ObjString *name = GET_STRING(index);
             Value value;
-            if (!table_get(&vm.globals, name, &value))
+            if (!table_get(&vm->globals, name, &value))
             {
-                runtime_error("Undefined variable '%s'.", name->chars);
+                runtime_error("Undefined variable '%.*s'.", name->length, name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            push(value);
+            PUSH(value);
             break;
         }
         case OP_DEFINE_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            table_put(&vm.globals, name, peek(0));
-            pop();
+            index = READ_BYTE();
+        op_define_global:
+            table_put(&vm->globals, GET_STRING(index), PEEK(0));
+            POP();
             break;
-        }
         case OP_SET_GLOBAL:
+            index = READ_BYTE();
+        op_set_global:
         {
-            ObjString *name = READ_STRING();
-            if (table_put(&vm.globals, name, peek(0)))
+            ObjString *name = GET_STRING(index);
+            if (table_put(&vm->globals, name, PEEK(0)))
             {
-                table_remove(&vm.globals, name);
-                runtime_error("Undefined variable '%s'", name->chars);
+                table_remove(&vm->globals, name);
+                runtime_error("Undefined variable '%.*s'", name->length, name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
         }
         case OP_GET_UPVALUE:
-        {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            index = READ_BYTE();
+        op_get_upvalue:
+            PUSH(*frame->closure->upvalues[index]->location);
             break;
-        }
         case OP_SET_UPVALUE:
+            index = READ_BYTE();
+        op_set_upvalue:
+            *frame->closure->upvalues[index]->location = PEEK(0);
+            break;
+        case OP_GET_CAPTURE:
+            index = READ_BYTE();
+        op_get_capture:
+            PUSH(frame->closure->captures[index]);
+            break;
+        case OP_GET_HOISTED:
         {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            // The slot starts out nil and keeps the global once it's been found, so an undefined
+            // one is still only reported where it's read.
+            index = READ_BYTE();
+            Value *slot = &frame->slots[READ_BYTE()];
+            if (IS_NIL(*slot) && !table_get(&vm->globals, GET_STRING(index), slot))
+            {
+                ObjString *name = GET_STRING(index);
+                runtime_error("Undefined variable '%.*s'.", name->length, name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            PUSH(*slot);
             break;
         }
         case OP_GET_PROPERTY:
+            index = READ_BYTE();
+        op_get_property:
         {
-            if (!IS_INSTANCE(peek(0)))
+            if (!IS_INSTANCE(PEEK(0)))
             {
                 runtime_error("Only instances have properties.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjInstance *instance = AS_INSTANCE(peek(0));
-            ObjString *name = READ_STRING();
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
+            ObjString *name = GET_STRING(index);
 
             Value value;
 
             if (table_get(&instance->fields, name, &value))
             {
-                pop();
-                push(value);
+                POP();
+                PUSH(value);
                 break;
             }
 
-            runtime_error("Undefined property '%s'.", name->chars);
-            return INTERPRET_RUNTIME_ERROR;
+            if (!bind_method(instance->klass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
         }
         case OP_SET_PROPERTY:
+            index = READ_BYTE();
+        op_set_property:
         {
-            if (!IS_INSTANCE(peek(1)))
+            if (!IS_INSTANCE(PEEK(1)))
             {
                 runtime_error("Only instances have properties.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            table_put(&instance->fields, READ_STRING(), peek(0));
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            table_put(&instance->fields, GET_STRING(index), PEEK(0));
 
-            Value value = pop();
-            pop();
-            push(value);
+            Value value = POP();
+            POP();
+            PUSH(value);
             break;
         }
         case OP_EQUAL:
-            push(BOOLEAN_VAL(values_equal(pop(), pop())));
+            PUSH(BOOLEAN_VAL(values_equal(POP(), POP())));
             break;
         case OP_GREATER:
             BINARY_OP(BOOLEAN_VAL, >);
@@ -375,15 +892,15 @@ static InterpretResult run()
             BINARY_OP(BOOLEAN_VAL, <);
             break;
         case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
             {
                 concatenate();
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
             }
             else
             {
@@ -400,21 +917,45 @@ static InterpretResult run()
         case OP_DIV:
             BINARY_OP(NUMBER_VAL, /);
             break;
+        case OP_ADD_NUM:
+            NUMBER_OP(NUMBER_VAL, +);
+            break;
+        case OP_SUB_NUM:
+            NUMBER_OP(NUMBER_VAL, -);
+            break;
+        case OP_MUL_NUM:
+            NUMBER_OP(NUMBER_VAL, *);
+            break;
+        case OP_DIV_NUM:
+            NUMBER_OP(NUMBER_VAL, /);
+            break;
+        case OP_GREATER_NUM:
+            NUMBER_OP(BOOLEAN_VAL, >);
+            break;
+        case OP_LESS_NUM:
+            NUMBER_OP(BOOLEAN_VAL, <);
+            break;
+        case OP_NEGATE_NUM:
+            vm->stack_top[-1] = NUMBER_VAL(-AS_NUMBER(vm->stack_top[-1]));
+            break;
         case OP_NOT:
-            push(BOOLEAN_VAL(is_falsey(pop())));
+            PUSH(BOOLEAN_VAL(is_falsey(POP())));
             break;
         case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            if (!IS_NUMBER(PEEK(0)))
             {
                 runtime_error("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            PUSH(NUMBER_VAL(-AS_NUMBER(POP())));
             break;
         case OP_PRINT:
-            print_value(pop());
+            // Isolates print to the same stdout, a line at a time.
+            flockfile(stdout);
+            print_value(POP());
             printf("\n");
+            funlockfile(stdout);
             break;
         case OP_JUMP:
         {
@@ -425,7 +966,7 @@ static InterpretResult run()
         case OP_JUMP_IF_FALSE:
         {
             uint16_t offset = READ_SHORT();
-            if (is_falsey(peek(0)))
+            if (is_falsey(PEEK(0)))
             {
                 frame->ip += offset;
             }
@@ -435,87 +976,401 @@ static InterpretResult run()
         {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
+            RUN_AOT();
+            break;
+        }
+        case OP_FOR_PREP:
+        {
+            // The counter's slot is followed by a hidden slot holding the limit.
+            Value *counter = &frame->slots[READ_BYTE()];
+            uint8_t kind = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(counter[0]) || !IS_NUMBER(counter[1]))
+            {
+                runtime_error("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!counter_in_range(kind, AS_NUMBER(counter[0]), AS_NUMBER(counter[1])))
+            {
+                frame->ip += offset;
+            }
+            break;
+        }
+        case OP_FOR_ITER:
+        {
+            Value *counter = &frame->slots[READ_BYTE()];
+            uint8_t kind = READ_BYTE();
+            double step = AS_NUMBER(READ_CONSTANT());
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(*counter))
+            {
+                runtime_error(kind & FOR_SUBTRACT ? "Operands must be numbers." : "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // The body may have stored any number in the counter, but its type is checked, so
+            // the update can happen in place.
+            counter->as.number += kind & FOR_SUBTRACT ? -step : step;
+            if (counter_in_range(kind, AS_NUMBER(counter[0]), AS_NUMBER(counter[1])))
+            {
+                frame->ip -= offset;
+                RUN_AOT();
+            }
             break;
         }
         case OP_CALL:
+            arg_count = READ_BYTE();
+        op_call:
         {
-            int arg_count = READ_BYTE();
-            if (!call_value(peek(arg_count), arg_count))
+            if (!call_value(PEEK(arg_count), arg_count))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frame_count - 1];
+            LOAD_FRAME();
             break;
         }
-        case OP_CLOSURE:
+        case OP_INVOKE:
+            index = READ_BYTE();
+            arg_count = READ_BYTE();
+        op_invoke:
         {
-            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure *closure = new_closure(function);
-            push(OBJ_VAL(closure));
-            for (int i = 0; i < closure->upvalue_count; ++i)
+            if (!invoke(GET_STRING(index), arg_count))
             {
-                uint8_t is_local = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (is_local)
-                {
-                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                }
-                else
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            break;
+        }
+        case OP_SUPER_INVOKE:
+            index = READ_BYTE();
+            arg_count = READ_BYTE();
+        op_super_invoke:
+        {
+            ObjString *name = GET_STRING(index);
+            InlineCache *cache = &frame->closure->function->chunk.caches[READ_BYTE()];
+            ObjClass *superclass = AS_CLASS(POP());
+
+            // A superclass's methods are all in place before any subclass can be declared, so
+            // what the lookup found stays right for as long as the superclass is the same.
+            if (cache->klass != (Obj *)superclass)
+            {
+                Value method;
+                if (!table_get(&superclass->methods, name, &method))
                 {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    runtime_error("Undefined property '%.*s'.", name->length, name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
                 }
+                cache->klass = (Obj *)superclass;
+                cache->method = AS_OBJ(method);
             }
+
+            if (!call((ObjClosure *)cache->method, arg_count))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
             break;
         }
+        case OP_TAIL_CALL:
+            arg_count = READ_BYTE();
+        op_tail_call:
+        {
+            Value callee = PEEK(arg_count);
+            // Only closures reuse the frame. Anything else gets a normal call, bound methods and
+            // initializers a frame of their own, and the OP_RETURN that follows passes on its result.
+            bool ok = IS_CLOSURE(callee) ? tail_call(AS_CLOSURE(callee), arg_count)
+                                         : call_value(callee, arg_count);
+            if (!ok)
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            break;
+        }
+        case OP_CLOSURE:
+            make_closure(frame, AS_FUNCTION(READ_CONSTANT()), false);
+            break;
         case OP_CLOSE_UPVALUE:
-            close_upvalues(vm.stack_top - 1);
-            pop();
+            close_upvalues(vm->stack_top - 1);
+            POP();
             break;
+        case OP_UNWIND:
+        {
+            // Returns from inlined code: drops the callee's slots and keeps the result.
+            Value result = POP();
+            vm->stack_top -= READ_BYTE();
+            PUSH(result);
+            break;
+        }
         case OP_RETURN:
         {
-            Value result = pop();
+            Value result = POP();
 
             close_upvalues(frame->slots);
 
-            --vm.frame_count;
-            if (vm.frame_count == 0)
+            --vm->frame_count;
+            if (vm->frame_count == 0)
             {
-                pop();
+                if (vm->fiber != NULL)
+                {
+                    if (!finish_fiber(result))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+
+                vm->stack_top = frame->slots;
+                PUSH(result);
                 return INTERPRET_OK;
             }
 
-            vm.stack_top = frame->slots;
-            push(result);
+            vm->stack_top = frame->slots;
+            PUSH(result);
 
-            frame = &vm.frames[vm.frame_count - 1];
+            LOAD_FRAME();
             break;
         }
         case OP_CLASS:
-            push(OBJ_VAL(new_class(READ_STRING())));
+            index = READ_BYTE();
+        op_class:
+            PUSH(OBJ_VAL(new_class(GET_STRING(index))));
+            break;
+        case OP_INHERIT:
+        {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass))
+            {
+                runtime_error("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // Copying the methods down keeps every lookup to one table, however deep the
+            // hierarchy. The subclass's own methods are added afterwards and override these.
+            ObjClass *subclass = AS_CLASS(PEEK(0));
+            table_put_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+            POP();
+            break;
+        }
+        case OP_GET_SUPER:
+            index = READ_BYTE();
+        op_get_super:
+        {
+            ObjClass *superclass = AS_CLASS(POP());
+            if (!bind_method(superclass, GET_STRING(index)))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        }
+        case OP_METHOD:
+            index = READ_BYTE();
+        op_method:
+        {
+            ObjClass *klass = AS_CLASS(PEEK(1));
+            table_put(&klass->methods, GET_STRING(index), PEEK(0));
+            POP();
+            break;
+        }
+        case OP_WIDE:
+            // Reads the two-byte operands, then joins the short form's code past its own reads.
+            instr = READ_BYTE();
+            index = READ_SHORT();
+            switch (instr)
+            {
+            case OP_CONSTANT:
+                goto op_constant;
+            case OP_GET_LOCAL:
+                goto op_get_local;
+            case OP_SET_LOCAL:
+                goto op_set_local;
+            case OP_GET_GLOBAL:
+                goto op_get_global;
+            case OP_DEFINE_GLOBAL:
+                goto op_define_global;
+            case OP_SET_GLOBAL:
+                goto op_set_global;
+            case OP_GET_UPVALUE:
+                goto op_get_upvalue;
+            case OP_SET_UPVALUE:
+                goto op_set_upvalue;
+            case OP_GET_CAPTURE:
+                goto op_get_capture;
+            case OP_GET_PROPERTY:
+                goto op_get_property;
+            case OP_SET_PROPERTY:
+                goto op_set_property;
+            case OP_CALL:
+                arg_count = index;
+                goto op_call;
+            case OP_TAIL_CALL:
+                arg_count = index;
+                goto op_tail_call;
+            case OP_INVOKE:
+                arg_count = READ_SHORT();
+                goto op_invoke;
+            case OP_SUPER_INVOKE:
+                arg_count = READ_SHORT();
+                goto op_super_invoke;
+            case OP_CLOSURE:
+                make_closure(frame, AS_FUNCTION(GET_CONSTANT(index)), true);
+                break;
+            case OP_CLASS:
+                goto op_class;
+            case OP_METHOD:
+                goto op_method;
+            case OP_GET_SUPER:
+                goto op_get_super;
+            }
             break;
         }
     }
 
+#undef NUMBER_OP
 #undef BINARY_OP
-#undef READ_STRING
+#undef GET_STRING
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef GET_CONSTANT
 #undef READ_BYTE
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef LOAD_FRAME
+#undef RUN_AOT
+}
+
+// Has the native calling this switch to the fiber once it returns. The fiber's function takes
+// at most one argument, the first value it's resumed with.
+bool resume_fiber(ObjFiber *fiber)
+{
+    if (fiber->state == FIBER_RUNNING)
+    {
+        runtime_error("Cannot resume a fiber that is running.");
+        return false;
+    }
+    if (fiber->state == FIBER_DONE)
+    {
+        runtime_error("Cannot resume a fiber that has finished.");
+        return false;
+    }
+    if (fiber->state == FIBER_WAITING)
+    {
+        runtime_error("Cannot resume a fiber that is waiting on I/O.");
+        return false;
+    }
+
+    if (fiber->state == FIBER_NEW)
+    {
+        ObjFunction *function = fiber_closure(fiber)->function;
+        if (!ensure_compiled(function))
+        {
+            return false;
+        }
+        if (function->arity > 1)
+        {
+            runtime_error("Cannot start a fiber on a function that takes %d arguments.", function->arity);
+            return false;
+        }
+    }
+
+    fiber->state = FIBER_RUNNING;
+    fiber->caller = vm->fiber;
+    vm->switch_to = fiber;
+    vm->switching = true;
+    return true;
+}
+
+// Has the native calling this switch away from the running fiber once it returns, back to
+// whatever resumed it.
+static void leave_fiber(FiberState state)
+{
+    ObjFiber *fiber = vm->fiber;
+    fiber->state = state;
+    vm->switch_to = fiber->caller;
+    fiber->caller = NULL;
+    vm->switching = true;
 }
 
-InterpretResult interpret(const char *source)
+bool yield_fiber()
 {
-    ObjFunction *function = compile(source);
+    if (vm->fiber == NULL)
+    {
+        runtime_error("Cannot yield outside a fiber.");
+        return false;
+    }
+
+    leave_fiber(FIBER_SUSPENDED);
+    return true;
+}
+
+// Has the native calling this park what's running on I/O once it returns. A fiber goes back to
+// whatever resumed it, and the VM's own stacks leave it to the event loop what runs next.
+void park_running()
+{
+    if (vm->fiber != NULL)
+    {
+        leave_fiber(FIBER_WAITING);
+        return;
+    }
+
+    vm->switch_to = NULL;
+    vm->switching = true;
+}
+
+InterpretResult interpret(const char *source, size_t length, int line_no)
+{
+    ObjFunction *function = compile(source, length, line_no);
     if (function == NULL)
     {
         return INTERPRET_COMPILE_ERROR;
     }
 
+    return interpret_function(function);
+}
+
+// Runs a script that has already been compiled.
+InterpretResult interpret_function(ObjFunction *function)
+{
     push(OBJ_VAL(function));
     ObjClosure *closure = new_closure(function);
     pop();
     push(OBJ_VAL(closure));
-    call_value(OBJ_VAL(closure), 0);
 
-    return run();
+    Value result;
+    return call_function(0, &result);
+}
+
+// Calls the value below the arguments on top of the stack, on a VM that isn't running anything
+// else, and pops it with them. The return value is left in result.
+InterpretResult call_function(int arg_count, Value *result)
+{
+    if (!call_value(vm->stack_top[-1 - arg_count], arg_count))
+    {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // Natives and classes without initializers are done already.
+    if (vm->frame_count > 0)
+    {
+        InterpretResult status = run();
+        if (status != INTERPRET_OK)
+        {
+            return status;
+        }
+    }
+
+    *result = pop();
+    return INTERPRET_OK;
+}
+
+// Makes room to push count more values. Reports an error and returns false if there's no memory
+// for them.
+bool reserve_stack(int count)
+{
+    if (vm->stack_top + count > vm->stack_limit)
+    {
+        return grow_stack((int)(vm->stack_top - vm->stack) + count);
+    }
+    return true;
 }
@@ -2,14 +2,15 @@
 #define CLOX_VM_H
 
 #include "chunk.h"
+#include "io.h"
 #include "obj.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_MAX 65536
+#define STACK_INIT 256
 
-typedef struct
+typedef struct CallFrame
 {
     ObjClosure *closure;
     uint8_t *ip;
@@ -18,12 +19,17 @@ typedef struct
 
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frame_count;
-    Value stack[STACK_MAX];
+    int frame_capacity;
+    Value *stack;
     Value *stack_top;
+    // Calls make sure their frame fits below this, which leaves some room above for temporaries.
+    Value *stack_limit;
+    int stack_capacity;
     Table globals;
     Table strings;
+    ObjString *init_string;
     ObjUpvalue *open_upvalues;
     size_t bytes_allocated;
     size_t next_gc;
@@ -31,6 +37,20 @@ typedef struct
     int gray_count;
     int gray_capacity;
     Obj **gray_stack;
+    int opt_level;
+    bool whole_program;
+    // Function bodies are compiled on their first call rather than with the script.
+    bool lazy;
+    // Report how many type checks -O removed from each function it compiles.
+    bool type_stats;
+    // The fiber running, or NULL when it's the VM's own stacks, which wait in main_context while
+    // a fiber runs.
+    ObjFiber *fiber;
+    Context main_context;
+    // The switch resume(), yield() or I/O asked for, which is made once they've returned.
+    bool switching;
+    ObjFiber *switch_to;
+    IoLoop io;
 } Vm;
 
 typedef enum
@@ -40,12 +60,25 @@ typedef enum
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern Vm vm;
+// The VM this thread is running. Separate threads can run separate VMs side by side, and one
+// thread can switch between several with use_vm(). It stands in for a Vm* passed to every
+// function: the compiler and scanner state is per-thread too, so VMs share nothing, and natives,
+// allocation and strings keep their signatures. run() copies it into a local, so the hot loop
+// doesn't pay for the thread-local. A VM is used by one thread at a time.
+extern _Thread_local Vm *vm;
 
-void init_vm();
+void init_vm(Vm *instance);
 void free_vm();
-InterpretResult interpret(const char *source);
+void use_vm(Vm *instance);
+InterpretResult interpret(const char *source, size_t length, int line_no);
+InterpretResult interpret_function(ObjFunction *function);
+InterpretResult call_function(int arg_count, Value *result);
+bool reserve_stack(int count);
+bool resume_fiber(ObjFiber *fiber);
+bool yield_fiber();
+void park_running();
 void push(Value value);
 Value pop();
+void runtime_error(const char *fmt, ...);
 
 #endif
@@ -0,0 +1,71 @@
+#!/bin/bash
+# A second run with --cache reuses the file the first one wrote. An edited cache file is turned
+# away and written again: by the header when the payload no longer matches its hash, and by
+# check_function() when it does but the bytecode is bad.
+clox=$1
+
+# The header's fields up to the payload's hash, then the hash, in bytes.
+hash_offset=37
+header_length=45
+# The script's code follows its counts, its missing name and its code length in the payload.
+code_offset=$((header_length + 25))
+
+echo 'print "cached";' >script.lox
+
+run() {
+    actual=$($clox --cache script.lox 2>&1)
+    if [ "$actual" != "cached" ]; then
+        echo "$1: clox --cache script.lox printed:"
+        echo "$actual"
+        exit 1
+    fi
+}
+
+# Writes the bytes, given as numbers, into the cache file at the offset.
+poke() {
+    local offset=$1
+    shift
+    printf "$(printf '\\x%02x' "$@")" | dd of=script.loxc bs=1 seek="$offset" conv=notrunc status=none
+}
+
+# The payload's 64-bit FNV-1a hash, as little-endian bytes.
+payload_hash() {
+    local hash=-3750763034362895579
+    for byte in $(od -An -v -tu1 -j $header_length script.loxc); do
+        hash=$(((hash ^ byte) * 1099511628211))
+    done
+    for i in 0 1 2 3 4 5 6 7; do
+        echo $(((hash >> (i * 8)) & 255))
+    done
+}
+
+run "first run"
+cp script.loxc written.loxc
+inode=$(stat -c %i script.loxc)
+if [ "$(payload_hash | tr '\n' ' ')" != "$(od -An -v -tu1 -j $hash_offset -N 8 script.loxc | xargs echo) " ]; then
+    echo "The payload's hash doesn't match the one in the header."
+    exit 1
+fi
+
+run "second run"
+if [ "$(stat -c %i script.loxc)" != "$inode" ]; then
+    echo "The second run wrote the cache again instead of reusing it."
+    exit 1
+fi
+
+# The last byte of the payload, so its hash is off.
+poke $(($(wc -c <script.loxc) - 1)) 255
+run "payload edited"
+if ! cmp -s script.loxc written.loxc; then
+    echo "The cache wasn't written again after its payload was edited."
+    exit 1
+fi
+
+# The first instruction loads constant 0; make it one the script doesn't have, and fix the hash.
+poke $((code_offset + 1)) 200
+poke $hash_offset $(payload_hash)
+run "bytecode edited"
+if ! cmp -s script.loxc written.loxc; then
+    echo "The cache wasn't written again after its bytecode was edited."
+    exit 1
+fi
@@ -0,0 +1,69 @@
+#!/bin/bash
+# A class instance and closures saved into an image with --snapshot, and carried on with in a new
+# process with --image. An image cut short is turned away.
+clox=$1
+
+cat >setup.lox <<'LOX'
+class Counter {
+  init(start) {
+    this.count = start;
+  }
+
+  next() {
+    this.count = this.count + 1;
+    return this.count;
+  }
+}
+
+fun adder(n) {
+  fun add(x) {
+    return x + n;
+  }
+  return add;
+}
+
+fun stepper() {
+  var steps = 0;
+  fun step() {
+    steps = steps + 1;
+    return steps;
+  }
+  return step;
+}
+
+var counter = Counter(10);
+counter.next();
+var add5 = adder(5);
+var step = stepper();
+step();
+LOX
+
+cat >check.lox <<'LOX'
+print counter;
+print counter.next();
+print add5(1);
+print step();
+print Counter(0).next();
+LOX
+
+$clox --snapshot app.image setup.lox || exit 1
+
+expected=$'Counter instance\n12\n6\n2\n1'
+actual=$($clox --image app.image check.lox 2>&1)
+if [ "$actual" != "$expected" ]; then
+    echo "clox --image app.image check.lox printed:"
+    echo "$actual"
+    exit 1
+fi
+
+size=$(wc -c <app.image)
+for length in 16 $((size / 2)) $((size - 1)); do
+    head -c $length app.image >cut.image
+    actual=$($clox --image cut.image check.lox 2>&1)
+    status=$?
+    if [ $status -ne 74 ] || [ "$actual" != 'Could not load image "cut.image".' ]; then
+        echo "clox --image with the image cut to $length bytes exited with $status and printed:"
+        echo "$actual"
+        exit 1
+    fi
+done
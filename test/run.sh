@@ -0,0 +1,68 @@
+#!/bin/bash
+# Runs each test script with the interpreter given, bin/clox by default, and checks what it
+# prints against the comments in the script:
+#   // expect: <text>   the next line of standard output
+#   // error: <text>    the next line of standard error
+#   // flags: <flags>   options to run the interpreter with
+#   // env: <name=value>   an environment variable to run it with
+#   // repl             feed the script to the REPL a line at a time, which carries on after errors
+# Each script runs in an empty directory of its own, so files it makes are thrown away after.
+# Shell scripts here besides this one test what takes more than one run. They get the interpreter
+# as their argument, and pass if they exit with 0.
+
+clox=$(realpath "${1:-bin/clox}")
+dir=$(dirname "$0")
+out=$(mktemp)
+scratch=$(mktemp -d)
+passed=0
+failed=0
+
+# The I/O tests hold a socket open for each of many connections at once.
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+for test in "$dir"/*.lox; do
+    flags=$(sed -n 's|.*// flags: ||p' "$test")
+    env=$(sed -n 's|.*// env: ||p' "$test")
+    expected_out=$(sed -n 's|.*// expect: ||p' "$test")
+    expected_err=$(sed -n 's|.*// error: ||p' "$test")
+
+    rm -rf "$scratch" && mkdir "$scratch"
+    cp "$test" "$scratch"
+    script=$scratch/$(basename "$test")
+
+    if grep -q '^// repl$' "$test"; then
+        actual_err=$(cd "$scratch" && env $env $clox $flags <"$script" 2>&1 >"$out")
+        actual_out=$(sed 's/^\(> \)*//; /^$/d' "$out")
+    else
+        actual_err=$(cd "$scratch" && env $env $clox $flags "$script" 2>&1 >"$out")
+        actual_out=$(cat "$out")
+    fi
+
+    if [ "$actual_out" == "$expected_out" ] && [ "$actual_err" == "$expected_err" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL $test"
+        diff <(echo "$expected_out"; echo "$expected_err") <(echo "$actual_out"; echo "$actual_err")
+    fi
+done
+
+for test in "$dir"/*.sh; do
+    if [ "$test" -ef "$0" ]; then
+        continue
+    fi
+
+    rm -rf "$scratch" && mkdir "$scratch"
+    script=$(realpath "$test")
+    if output=$(cd "$scratch" && bash "$script" "$clox" 2>&1); then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL $test"
+        echo "$output"
+    fi
+done
+
+rm -rf "$out" "$scratch"
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
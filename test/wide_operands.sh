@@ -0,0 +1,30 @@
+#!/bin/bash
+# More than 256 constants, globals, locals and arguments in one function, so their operands take
+# the wide forms. It's compiled with and without -O, and read back from the cache as well.
+clox=$1
+count=300
+
+{
+    echo "class Box {}"
+    for i in $(seq 0 $((count - 1))); do echo "var g$i = $i;"; done
+    echo "fun sum($(seq -s ', ' -f 'p%g' 0 $((count - 1)))) {"
+    for i in $(seq 0 $((count - 1))); do echo "  var l$i = p$i + $((1000 + i));"; done
+    echo "  var total = $(seq -s ' + ' -f 'l%g' 0 $((count - 1)));"
+    echo "  fun last() { return l$((count - 1)); }"
+    echo "  var box = Box();"
+    echo "  box.value = total + g$((count - 1));"
+    echo "  print box.value;"
+    echo "  return last;"
+    echo "}"
+    echo "print sum($(seq -s ', ' -f 'g%g' 0 $((count - 1))))();"
+} >wide.lox
+
+expected=$'389999\n1598'
+for flags in "" "-O" "--cache" "--cache" "-O --cache" "-O --cache"; do
+    actual=$($clox $flags wide.lox 2>&1)
+    if [ "$actual" != "$expected" ]; then
+        echo "clox $flags wide.lox printed:"
+        echo "$actual"
+        exit 1
+    fi
+done